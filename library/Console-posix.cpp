@@ -59,6 +59,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <deque>
 
 // George Vulov for MacOSX
@@ -133,6 +136,195 @@ const char * getANSIColor(const int c)
     }
 }
 
+/*
+ * Console output is not written by the thread that prints it. Each message
+ * is encoded as a run of segments ([int8 color][uint32 length][text]) and
+ * copied into a ring of fixed-size slots. A writer thread drains the ring
+ * under the console lock, so a slow terminal only holds up that thread.
+ *
+ * Producers reserve all the slots of a message with one CAS on the head
+ * position. The consumer frees slots strictly in order, so if the last
+ * slot of a reservation is free, all the ones before it are free too.
+ * When the ring is full the message is counted as dropped, and the writer
+ * prints a summary once it has caught up. Messages too large for the ring
+ * are written directly after draining it.
+ */
+
+static const size_t OUTPUT_SLOT_DATA = 240;
+static const size_t OUTPUT_SLOTS = 4096; // power of two, ~1MB of text
+static const size_t OUTPUT_SEGMENT_HEADER = 1 + sizeof(uint32_t);
+
+struct OutputSlot
+{
+    volatile long seq;
+    uint32_t size; // message size, in the first slot of a message
+    char data[OUTPUT_SLOT_DATA];
+};
+
+class OutputQueue
+{
+public:
+    OutputQueue()
+    {
+        slots = new OutputSlot[OUTPUT_SLOTS];
+        for (size_t i = 0; i < OUTPUT_SLOTS; i++)
+            slots[i].seq = (long)i;
+        head = tail = 0;
+        dropped = dropped_bytes = 0;
+    }
+    ~OutputQueue()
+    {
+        delete[] slots;
+    }
+
+    /// Copy a message into the ring, or count it as dropped if the ring is
+    /// full. Returns false if the message can never fit.
+    bool push(const char *data, size_t size)
+    {
+        size_t count = (size + OUTPUT_SLOT_DATA - 1) / OUTPUT_SLOT_DATA;
+        if (count == 0)
+            return true;
+        if (count > OUTPUT_SLOTS / 2)
+            return false;
+
+        long pos;
+        for (;;)
+        {
+            pos = head;
+            long last = pos + (long)count - 1;
+            long diff = slots[last & (OUTPUT_SLOTS-1)].seq - last;
+            if (diff == 0)
+            {
+                if (__sync_bool_compare_and_swap(&head, pos, pos + (long)count))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                __sync_add_and_fetch(&dropped, 1);
+                __sync_add_and_fetch(&dropped_bytes, (long)size);
+                return true;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            OutputSlot &slot = slots[(pos + i) & (OUTPUT_SLOTS-1)];
+            size_t offset = i * OUTPUT_SLOT_DATA;
+            memcpy(slot.data, data + offset, std::min(OUTPUT_SLOT_DATA, size - offset));
+        }
+        slots[pos & (OUTPUT_SLOTS-1)].size = (uint32_t)size;
+
+        // Publish back to front, so that a visible first slot means the
+        // whole message is there.
+        for (size_t i = count; i-- > 0;)
+        {
+            __sync_synchronize();
+            slots[(pos + i) & (OUTPUT_SLOTS-1)].seq = pos + (long)i + 1;
+        }
+        return true;
+    }
+
+    /// Take the next complete message. Single consumer only.
+    bool pop(std::string &out)
+    {
+        OutputSlot &first = slots[tail & (OUTPUT_SLOTS-1)];
+        if (first.seq != tail + 1)
+            return false;
+        __sync_synchronize();
+
+        size_t size = first.size;
+        size_t count = (size + OUTPUT_SLOT_DATA - 1) / OUTPUT_SLOT_DATA;
+        out.clear();
+        for (size_t i = 0; i < count; i++)
+        {
+            OutputSlot &slot = slots[(tail + i) & (OUTPUT_SLOTS-1)];
+            size_t offset = i * OUTPUT_SLOT_DATA;
+            out.append(slot.data, std::min(OUTPUT_SLOT_DATA, size - offset));
+        }
+
+        __sync_synchronize();
+        for (size_t i = 0; i < count; i++)
+            slots[(tail + i) & (OUTPUT_SLOTS-1)].seq = tail + (long)(i + OUTPUT_SLOTS);
+        tail += (long)count;
+        return true;
+    }
+
+    /// Fetch and reset the number of dropped messages and their bytes.
+    long take_dropped(long *bytes)
+    {
+        *bytes = __sync_lock_test_and_set(&dropped_bytes, 0);
+        return __sync_lock_test_and_set(&dropped, 0);
+    }
+
+private:
+    OutputSlot *slots;
+    volatile long head;
+    long tail;
+    volatile long dropped;
+    volatile long dropped_bytes;
+};
+
+/// Append text to an encoded message, extending the last segment if the
+/// color did not change.
+static void append_segment(std::string &msg, size_t &last_segment,
+                           color_ostream::color_value color, const char *text, size_t size)
+{
+    if (!size)
+        return;
+    uint32_t len;
+    if (last_segment != std::string::npos && (int8_t)msg[last_segment] == (int8_t)color)
+    {
+        memcpy(&len, &msg[last_segment + 1], sizeof(len));
+        len += (uint32_t)size;
+        memcpy(&msg[last_segment + 1], &len, sizeof(len));
+    }
+    else
+    {
+        last_segment = msg.size();
+        len = (uint32_t)size;
+        msg.push_back((char)(int8_t)color);
+        msg.append((const char*)&len, sizeof(len));
+    }
+    msg.append(text, size);
+}
+
+/// Messages printed between begin_batch and end_batch are collected per
+/// thread and queued as one, so that batches from different threads
+/// never interleave.
+struct OutputBatch
+{
+    int depth;
+    size_t last_segment;
+    std::string msg;
+};
+
+static pthread_key_t batch_key;
+static pthread_once_t batch_key_once = PTHREAD_ONCE_INIT;
+
+static void free_batch(void *batch)
+{
+    delete (OutputBatch*)batch;
+}
+
+static void create_batch_key()
+{
+    pthread_key_create(&batch_key, free_batch);
+}
+
+static OutputBatch *get_batch()
+{
+    pthread_once(&batch_key_once, create_batch_key);
+    OutputBatch *batch = (OutputBatch*)pthread_getspecific(batch_key);
+    if (!batch)
+    {
+        batch = new OutputBatch();
+        batch->depth = 0;
+        batch->last_segment = std::string::npos;
+        pthread_setspecific(batch_key, batch);
+    }
+    return batch;
+}
+
 namespace DFHack
 {
     class Private
@@ -142,9 +334,17 @@ namespace DFHack
         {
             dfout_C = NULL;
             rawmode = false;
-            in_batch = false;
             supported_terminal = false;
             state = con_unclaimed;
+            wlock = NULL;
+            writer = NULL;
+            writer_quit = false;
+            wake_pending = 0;
+            output_started = false;
+            output_color = -2;
+            log_file = NULL;
+            log_max_size = log_size = 0;
+            log_backups = 0;
         };
         virtual ~Private()
         {
@@ -182,49 +382,106 @@ namespace DFHack
             fputs(data, dfout_C);
         }
 
-        void print_text(color_ostream::color_value clr, const std::string &chunk)
+        /// Queue an encoded message for the writer thread. Never blocks on
+        /// the terminal, unless the message is too large for the queue.
+        void queue_output(const std::string &msg)
         {
-            if(!in_batch && state == con_lineedit)
+            if (msg.empty())
+                return;
+            if (!writer || !queue.push(msg.data(), msg.size()))
             {
-                disable_raw();
-                fprintf(dfout_C,"\x1b[1G");
-                fprintf(dfout_C,"\x1b[0K");
-
-                color(clr);
-                print(chunk.c_str());
-
-                reset_color();
-                enable_raw();
-                prompt_refresh();
+                lock_guard <recursive_mutex> g(*wlock);
+                drain_output();
+                write_output(msg, true);
+                return;
             }
-            else
+            wake_writer();
+        }
+
+        void wake_writer()
+        {
+            if (__sync_bool_compare_and_swap(&wake_pending, 0, 1))
             {
-                color(clr);
-                print(chunk.c_str());
+                if (::write(wake_pipe[1], "", 1) == -1)
+                    ;
             }
         }
 
-        void begin_batch()
+        /// Write everything queued so far. The console lock must be held.
+        void drain_output()
         {
-            assert(!in_batch);
-
-            in_batch = true;
+            bool any = false;
+            while (queue.pop(drain_buffer))
+            {
+                any = true;
+                write_output(drain_buffer, false);
+            }
 
-            if (state == con_lineedit)
+            long bytes;
+            long dropped = queue.take_dropped(&bytes);
+            if (dropped)
             {
-                disable_raw();
-                fprintf(dfout_C,"\x1b[1G");
-                fprintf(dfout_C,"\x1b[0K");
+                char note[128];
+                snprintf(note, sizeof(note),
+                         "[console overloaded: %ld messages (%ld bytes) dropped]\n",
+                         dropped, bytes);
+                std::string msg;
+                size_t last_segment = std::string::npos;
+                append_segment(msg, last_segment, COLOR_LIGHTRED, note, strlen(note));
+                write_output(msg, false);
+                any = true;
             }
+
+            if (any)
+                finish_output();
         }
 
-        void end_batch()
+        /// Decode a message, switching colors only where they change, and
+        /// mirror its plain text to the log file.
+        void write_output(const std::string &msg, bool finish)
         {
-            assert(in_batch);
+            if (!output_started)
+            {
+                if (state == con_lineedit)
+                {
+                    disable_raw();
+                    output_text.append("\x1b[1G\x1b[0K");
+                }
+                output_started = true;
+                output_color = -2;
+            }
 
-            flush();
+            size_t pos = 0;
+            while (pos + OUTPUT_SEGMENT_HEADER <= msg.size())
+            {
+                int color = (int8_t)msg[pos];
+                uint32_t len;
+                memcpy(&len, &msg[pos + 1], sizeof(len));
+                pos += OUTPUT_SEGMENT_HEADER;
+                len = std::min<uint32_t>(len, msg.size() - pos);
 
-            in_batch = false;
+                if (color != output_color)
+                {
+                    output_text.append(getANSIColor(color));
+                    output_color = color;
+                }
+                output_text.append(msg, pos, len);
+                write_log(msg.data() + pos, len);
+                pos += len;
+            }
+
+            if (finish)
+                finish_output();
+        }
+
+        void finish_output()
+        {
+            if (!output_started)
+                return;
+            if (!output_text.empty())
+                fwrite(output_text.data(), 1, output_text.size(), dfout_C);
+            output_text.clear();
+            output_started = false;
 
             if (state == con_lineedit)
             {
@@ -232,12 +489,115 @@ namespace DFHack
                 enable_raw();
                 prompt_refresh();
             }
+            else
+                fflush(dfout_C);
+
+            if (log_file)
+                fflush(log_file);
         }
 
-        void flush()
+        static void writer_thread(void *arg)
         {
-            if (!rawmode)
-                fflush(dfout_C);
+            Private *d = (Private*)arg;
+            for (;;)
+            {
+                fd_set wake_set;
+                FD_ZERO(&wake_set);
+                FD_SET(d->wake_pipe[0], &wake_set);
+                int ret = TMP_FAILURE_RETRY(
+                    select (d->wake_pipe[0] + 1, &wake_set, NULL, NULL, NULL)
+                );
+                if (ret == -1)
+                    break;
+
+                char junk[64];
+                while (read(d->wake_pipe[0], junk, sizeof(junk)) > 0)
+                    ;
+                // Cleared before draining: anything queued from now on
+                // wakes us again.
+                __sync_lock_test_and_set(&d->wake_pending, 0);
+
+                bool quit = d->writer_quit;
+                {
+                    lock_guard <recursive_mutex> g(*d->wlock);
+                    d->drain_output();
+                }
+                if (quit)
+                    break;
+            }
+        }
+
+        bool start_writer()
+        {
+            if (pipe(wake_pipe) == -1)
+                return false;
+            fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+            fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+            writer = new thread(writer_thread, this);
+            return true;
+        }
+
+        void stop_writer()
+        {
+            if (!writer)
+                return;
+            writer_quit = true;
+            __sync_synchronize();
+            if (::write(wake_pipe[1], "", 1) == -1)
+                ;
+            writer->join();
+            delete writer;
+            writer = NULL;
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+        }
+
+        bool set_log_file(const std::string &path, size_t max_size, int backups)
+        {
+            if (log_file)
+                fclose(log_file);
+            log_file = NULL;
+            log_path = path;
+            log_max_size = max_size;
+            log_backups = std::max(backups, 0);
+            if (path.empty())
+                return true;
+
+            log_file = fopen(path.c_str(), "a");
+            if (!log_file)
+                return false;
+            fseek(log_file, 0, SEEK_END);
+            log_size = ftell(log_file);
+            return true;
+        }
+
+        void write_log(const char *text, size_t size)
+        {
+            if (!log_file || !size)
+                return;
+            if (log_max_size && log_size + size > log_max_size && log_size)
+                rotate_log();
+            if (!log_file)
+                return;
+            fwrite(text, 1, size, log_file);
+            log_size += size;
+        }
+
+        /// Shift path.N-1 to path.N, ..., path to path.1 and start afresh.
+        void rotate_log()
+        {
+            fclose(log_file);
+            for (int i = log_backups; i > 0; i--)
+            {
+                std::stringstream from, to;
+                from << log_path;
+                if (i > 1)
+                    from << "." << (i - 1);
+                to << log_path << "." << i;
+                rename(from.str().c_str(), to.str().c_str());
+            }
+            log_file = fopen(log_path.c_str(), "w");
+            log_size = 0;
         }
 
         /// Clear the console, along with its scrollback
@@ -700,6 +1060,23 @@ namespace DFHack
         }
         FILE * dfout_C;
         bool supported_terminal;
+        recursive_mutex * wlock;
+        // output queue and its writer thread
+        OutputQueue queue;
+        thread * writer;
+        volatile bool writer_quit;
+        volatile long wake_pending;
+        int wake_pipe[2];
+        std::string drain_buffer;
+        std::string output_text;
+        bool output_started;
+        int output_color;
+        // mirrored output
+        FILE * log_file;
+        std::string log_path;
+        size_t log_max_size;
+        size_t log_size;
+        int log_backups;
         // state variables
         bool rawmode;           // is raw mode active?
         termios orig_termios;   // saved/restored by raw mode
@@ -709,7 +1086,6 @@ namespace DFHack
             con_unclaimed,
             con_lineedit
         } state;
-        bool in_batch;
         std::string prompt;      // current prompt string
         std::string raw_buffer;  // current raw mode buffer
         std::string yank_buffer; // last text deleted with Ctrl-K/Ctrl-U
@@ -747,6 +1123,7 @@ bool Console::init(bool sharing)
     if (!freopen("stdout.log", "w", stdout))
         ;
     d = new Private();
+    d->wlock = wlock;
     // make our own weird streams so our IO isn't redirected
     d->dfout_C = fopen("/dev/tty", "w");
     std::cin.tie(this);
@@ -759,6 +1136,8 @@ bool Console::init(bool sharing)
     FD_SET(STDIN_FILENO, &d->descriptor_set);
     FD_SET(d->exit_pipe[0], &d->descriptor_set);
     inited = true;
+    // print synchronously if the writer can't be started
+    d->start_writer();
     return true;
 }
 
@@ -766,7 +1145,11 @@ bool Console::shutdown(void)
 {
     if(!d)
         return true;
+    // the writer takes the lock to drain, so stop it first
+    d->stop_writer();
     lock_guard <recursive_mutex> g(*wlock);
+    d->drain_output();
+    d->set_log_file("", 0, 0);
     if(d->rawmode)
         d->disable_raw();
     d->print("\n");
@@ -780,34 +1163,55 @@ void Console::begin_batch()
 {
     //color_ostream::begin_batch();
 
-    wlock->lock();
-
-    if (inited)
-        d->begin_batch();
+    get_batch()->depth++;
 }
 
 void Console::end_batch()
 {
-    if (inited)
-        d->end_batch();
+    OutputBatch *batch = get_batch();
+    if (--batch->depth > 0)
+        return;
 
-    wlock->unlock();
+    if (inited)
+        d->queue_output(batch->msg);
+    batch->msg.clear();
+    batch->last_segment = std::string::npos;
 }
 
 void Console::flush_proxy()
 {
-    lock_guard <recursive_mutex> g(*wlock);
-    if (inited)
-        d->flush();
+    // Output is queued as soon as it is added; the writer flushes the
+    // terminal whenever it drains the queue.
 }
 
 void Console::add_text(color_value color, const std::string &text)
 {
-    lock_guard <recursive_mutex> g(*wlock);
-    if (inited)
-        d->print_text(color, text);
-    else
+    if (!inited)
+    {
         fwrite(text.data(), 1, text.size(), stderr);
+        return;
+    }
+
+    OutputBatch *batch = get_batch();
+    if (batch->depth > 0)
+    {
+        append_segment(batch->msg, batch->last_segment, color, text.data(), text.size());
+        return;
+    }
+
+    std::string msg;
+    size_t last_segment = std::string::npos;
+    append_segment(msg, last_segment, color, text.data(), text.size());
+    d->queue_output(msg);
+}
+
+bool Console::setLogFile(const std::string &path, size_t max_size, int backups)
+{
+    lock_guard <recursive_mutex> g(*wlock);
+    if (!inited)
+        return false;
+    d->drain_output();
+    return d->set_log_file(path, max_size, backups);
 }
 
 int Console::get_columns(void)
@@ -832,21 +1236,30 @@ void Console::clear()
 {
     lock_guard <recursive_mutex> g(*wlock);
     if(inited)
+    {
+        d->drain_output();
         d->clear();
+    }
 }
 
 void Console::gotoxy(int x, int y)
 {
     lock_guard <recursive_mutex> g(*wlock);
     if(inited)
+    {
+        d->drain_output();
         d->gotoxy(x,y);
+    }
 }
 
 void Console::cursor(bool enable)
 {
     lock_guard <recursive_mutex> g(*wlock);
     if(inited)
+    {
+        d->drain_output();
         d->cursor(enable);
+    }
 }
 
 int Console::lineedit(const std::string & prompt, std::string & output, CommandHistory & ch)
@@ -854,7 +1267,11 @@ int Console::lineedit(const std::string & prompt, std::string & output, CommandH
     lock_guard <recursive_mutex> g(*wlock);
     int ret = -2;
     if(inited)
+    {
+        // anything printed before the prompt goes above it
+        d->drain_output();
         ret = d->lineedit(prompt,output,wlock,ch);
+    }
     return ret;
 }
 
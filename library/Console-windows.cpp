@@ -585,6 +585,12 @@ int Console::lineedit(const std::string & prompt, std::string & output, CommandH
     return ret;
 }
 
+bool Console::setLogFile(const std::string &path, size_t max_size, int backups)
+{
+    // not supported by the windows console
+    return false;
+}
+
 void Console::msleep (unsigned int msec)
 {
     Sleep(msec);
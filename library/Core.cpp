@@ -32,6 +32,8 @@ distribution.
 #include <cstring>
 #include <iterator>
 #include <sstream>
+#include <deque>
+#include <algorithm>
 using namespace std;
 
 #include "Error.h"
@@ -88,6 +90,7 @@ struct Core::Cond
     Cond()
     {
         predicate = false;
+        queued_at = 0;
         wakeup = new tthread::condition_variable();
     }
     ~Cond()
@@ -111,13 +114,38 @@ struct Core::Cond
     }
     tthread::condition_variable * wakeup;
     bool predicate;
+    // for suspend-stats
+    uint64_t queued_at;
+    std::string owner;
+};
+
+struct SuspendStat
+{
+    int count;
+    uint64_t wait_total, wait_max;
+    uint64_t hold_total, hold_max;
+
+    SuspendStat() : count(0), wait_total(0), wait_max(0), hold_total(0), hold_max(0) {}
+
+    void add(uint64_t wait, uint64_t hold)
+    {
+        count++;
+        wait_total += wait;
+        wait_max = std::max(wait_max, wait);
+        hold_total += hold;
+        hold_max = std::max(hold_max, hold);
+    }
 };
 
 struct Core::Private
 {
     tthread::mutex AccessMutex;
+    // guards everything below up to core_cond
     tthread::mutex StackMutex;
-    std::stack<Core::Cond*> suspended_tools;
+    std::deque<Core::Cond*> suspended_tools;
+    std::vector<Core::Cond*> free_conds;
+    std::map<thread::id, std::string> suspend_owners;
+    std::map<std::string, SuspendStat> suspend_stats;
     Core::Cond core_cond;
     thread::id df_suspend_thread;
     int df_suspend_depth;
@@ -440,6 +468,7 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                           "  help COMMAND          - Usage help for the given command.\n"
                           "  ls|dir [-a] [PLUGIN]  - List available commands. Optionally for single plugin.\n"
                           "  cls                   - Clear the console.\n"
+                          "  console-log FILE|off  - Mirror console output to a rotated log file.\n"
                           "  fpause                - Force DF to pause.\n"
                           "  die                   - Force DF to close immediately\n"
                           "  keybinding            - Modify bindings of commands to keys\n"
@@ -448,6 +477,9 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                           "  load PLUGIN|all       - Load a plugin by name or load all possible plugins.\n"
                           "  unload PLUGIN|all     - Unload a plugin or all loaded plugins.\n"
                           "  reload PLUGIN|all     - Reload a plugin or all loaded plugins.\n"
+                          "  suspend-stats [reset] - Show how long tools waited for and held the core.\n"
+                          "  plugin-profile [start|stop|reset] - Show per-plugin time spent in onupdate.\n"
+                          "  startup-profile       - Show the time taken by each startup step and plugin load.\n"
                          );
 
                 con.print("\nDFHack version " DFHACK_VERSION ".\n");
@@ -456,6 +488,8 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
             {
                 Plugin *plug = plug_mgr->getPluginByCommand(parts[0]);
                 if (plug) {
+                    // the usage text is not in the manifest
+                    plug->load_deferred(con);
                     for (size_t j = 0; j < plug->size();j++)
                     {
                         const PluginCommand & pcmd = (plug->operator[](j));
@@ -587,6 +621,9 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                 {
                     Plugin * plug = plug_mgr->getPluginByName(parts[i]);
 
+                    if (plug)
+                        plug->load_deferred(con);
+
                     if(!plug)
                     {
                         res = CR_NOT_FOUND;
@@ -656,6 +693,7 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                 "  help|?|man            - This text or help specific to a plugin.\n"
                 "  ls [-a] [PLUGIN]      - List available commands. Optionally for single plugin.\n"
                 "  cls                   - Clear the console.\n"
+                "  console-log FILE|off  - Mirror console output to a rotated log file.\n"
                 "  fpause                - Force DF to pause.\n"
                 "  die                   - Force DF to close immediately\n"
                 "  keybinding            - Modify bindings of commands to keys\n"
@@ -665,6 +703,9 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                 "  unload PLUGIN|all     - Unload a plugin or all loaded plugins.\n"
                 "  reload PLUGIN|all     - Reload a plugin or all loaded plugins.\n"
                 "  enable/disable PLUGIN - Enable or disable a plugin if supported.\n"
+                "  suspend-stats [reset] - Show how long tools waited for and held the core.\n"
+                "  plugin-profile [start|stop|reset] - Show per-plugin time spent in onupdate.\n"
+                "  startup-profile       - Show the time taken by each startup step and plugin load.\n"
                 "\n"
                 "plugins:\n"
                 );
@@ -755,6 +796,96 @@ command_result Core::runCommand(color_ostream &con, const std::string &first, ve
                     << Gui::getFocusString(Core::getTopViewscreen()) << endl;
             }
         }
+        else if(first == "suspend-stats")
+        {
+            if (parts.size() == 1 && parts[0] == "reset")
+            {
+                resetSuspendStats();
+                con.print("Suspend statistics cleared.\n");
+            }
+            else if (parts.empty())
+                printSuspendStats(con);
+            else
+            {
+                con << "Usage:" << endl
+                    << "  suspend-stats [reset]" << endl
+                    << "Shows how long tools waited for and held the core, per plugin." << endl;
+                return CR_WRONG_USAGE;
+            }
+        }
+        else if(first == "plugin-profile")
+        {
+            // the profiles are updated from the simulation thread
+            CoreSuspender suspend;
+            if (parts.size() == 1 && parts[0] == "start")
+            {
+                plug_mgr->setProfilingUpdates(true);
+                con.print("Plugin update profiling started.\n");
+            }
+            else if (parts.size() == 1 && parts[0] == "stop")
+            {
+                plug_mgr->setProfilingUpdates(false);
+                con.print("Plugin update profiling stopped.\n");
+            }
+            else if (parts.size() == 1 && parts[0] == "reset")
+            {
+                plug_mgr->resetUpdateProfiles();
+                con.print("Plugin update profiles cleared.\n");
+            }
+            else if (parts.empty())
+                printPluginProfile(con);
+            else
+            {
+                con << "Usage:" << endl
+                    << "  plugin-profile [start|stop|reset]" << endl
+                    << "Measures the time each plugin spends in its per-frame update." << endl
+                    << "Profiling is off until started, as timing every call has a cost." << endl;
+                return CR_WRONG_USAGE;
+            }
+        }
+        else if(first == "startup-profile")
+        {
+            printStartupProfile(con);
+        }
+        else if(first == "console-log")
+        {
+            if (!con.is_console())
+            {
+                con.printerr("No console to log.\n");
+                return CR_NEEDS_CONSOLE;
+            }
+            Console &console = (Console&)con;
+            if (parts.size() == 1 && parts[0] == "off")
+            {
+                console.setLogFile("", 0, 0);
+                con.print("Console log stopped.\n");
+            }
+            else if (parts.size() >= 1 && parts.size() <= 3)
+            {
+                size_t max_kb = 1024;
+                int backups = 3;
+                if (parts.size() >= 2)
+                    max_kb = atoi(parts[1].c_str());
+                if (parts.size() >= 3)
+                    backups = atoi(parts[2].c_str());
+                if (!console.setLogFile(parts[0], max_kb * 1024, backups))
+                {
+                    con.printerr("Could not log the console to %s\n", parts[0].c_str());
+                    return CR_FAILURE;
+                }
+                con.print("Console output is mirrored to %s.\n", parts[0].c_str());
+            }
+            else
+            {
+                con << "Usage:" << endl
+                    << "  console-log FILE [MAX_KB [BACKUPS]]" << endl
+                    << "  console-log off" << endl
+                    << "Copies everything printed to the console into FILE. Once it grows" << endl
+                    << "past MAX_KB (default 1024, 0 = no limit) it is renamed to FILE.1," << endl
+                    << "keeping BACKUPS old copies (default 3)." << endl;
+                return CR_WRONG_USAGE;
+            }
+        }
         else if(first == "fpause")
         {
             World::SetPauseState(true);
@@ -989,6 +1120,9 @@ bool Core::Init()
     if(errorstate)
         return false;
 
+    uint64_t init_start = GetTimeUs64();
+    uint64_t phase_start = init_start;
+
     // find out what we are...
     #ifdef LINUX_BUILD
         const char * path = "hack/symbols.xml";
@@ -1012,8 +1146,10 @@ bool Core::Init()
         fatal(out.str(), true);
         return false;
     }
+    addStartupPhase("symbols.xml", phase_start);
     p = new DFHack::Process(vif);
     vinfo = p->getDescriptor();
+    addStartupPhase("identify executable", phase_start);
 
     if(!vinfo || !p->isIdentified())
     {
@@ -1027,6 +1163,7 @@ bool Core::Init()
 
     // Init global object pointers
     df::global::InitGlobals();
+    addStartupPhase("globals", phase_start);
 
     cerr << "Initializing Console.\n";
     // init the console.
@@ -1044,6 +1181,7 @@ bool Core::Init()
         cerr << "Console is running.\n";
     else
         fatal ("Console has failed to initialize!\n", false);
+    addStartupPhase("console", phase_start);
 /*
     // dump offsets to a file
     std::ofstream dump("offsets.log");
@@ -1056,9 +1194,11 @@ bool Core::Init()
     // initialize data defs
     virtual_identity::Init(this);
     init_screen_module(this);
+    addStartupPhase("data definitions", phase_start);
 
     // initialize common lua context
     Lua::Core::Init(con);
+    addStartupPhase("lua", phase_start);
 
     // create mutex for syncing with interactive tasks
     misc_data_mutex=new mutex();
@@ -1066,6 +1206,7 @@ bool Core::Init()
     // create plugin manager
     plug_mgr = new PluginManager(this);
     plug_mgr->init(this);
+    addStartupPhase("plugins", phase_start);
     IODATA *temp = new IODATA;
     temp->core = this;
     temp->plug_mgr = plug_mgr;
@@ -1096,10 +1237,55 @@ bool Core::Init()
     server = new ServerMain();
     if (!server->listen(RemoteClient::GetDefaultPort()))
         cerr << "TCP listen failed.\n";
+    addStartupPhase("threads and listener", phase_start);
 
-    cerr << "DFHack is running.\n";
+    cerr << "DFHack is running (started in " << (GetTimeUs64() - init_start) / 1000 << " ms).\n";
     return true;
 }
+
+void Core::addStartupPhase(const char *name, uint64_t &start)
+{
+    uint64_t now = GetTimeUs64();
+    startup_phases.push_back(std::make_pair(std::string(name), now - start));
+    start = now;
+}
+
+static bool compareLoadTime(Plugin *a, Plugin *b)
+{
+    return a->getLoadTime() > b->getLoadTime();
+}
+
+void Core::printStartupProfile(color_ostream &out)
+{
+    uint64_t total = 0;
+    out.print("%-24s %10s\n", "startup phase", "time");
+    for (size_t i = 0; i < startup_phases.size(); i++)
+    {
+        out.print("%-24s %8.1fms\n", startup_phases[i].first.c_str(),
+                  startup_phases[i].second/1000.0);
+        total += startup_phases[i].second;
+    }
+    out.print("%-24s %8.1fms\n\n", "total", total/1000.0);
+
+    std::vector<Plugin*> plugins;
+    size_t deferred = 0;
+    for (size_t i = 0; i < plug_mgr->size(); i++)
+    {
+        Plugin *plug = (*plug_mgr)[i];
+        if (plug->is_deferred())
+            deferred++;
+        else if (plug->getLoadTime())
+            plugins.push_back(plug);
+    }
+    std::sort(plugins.begin(), plugins.end(), compareLoadTime);
+
+    out.print("%-24s %10s\n", "plugin", "load");
+    for (size_t i = 0; i < plugins.size(); i++)
+        out.print("%-24s %8.1fms\n", plugins[i]->getName().c_str(),
+                  plugins[i]->getLoadTime()/1000.0);
+    if (deferred)
+        out.print("%d plugins not loaded yet (DFHACK_LAZY_PLUGINS).\n", (int)deferred);
+}
 /// sets the current hotkey command
 bool Core::setHotkeyCmd( std::string cmd )
 {
@@ -1196,13 +1382,25 @@ void Core::Suspend()
         }
     }
 
-    // put the condition on a stack
-    Core::Cond *nc = new Core::Cond();
+    // put a condition in the queue, reusing one from earlier calls if possible
+    Core::Cond *nc;
 
     {
         lock_guard<mutex> lock2(d->StackMutex);
 
-        d->suspended_tools.push(nc);
+        if (d->free_conds.empty())
+            nc = new Core::Cond();
+        else
+        {
+            nc = d->free_conds.back();
+            d->free_conds.pop_back();
+        }
+
+        auto it = d->suspend_owners.find(tid);
+        nc->owner = (it != d->suspend_owners.end()) ? it->second : std::string();
+        nc->queued_at = GetTimeUs64();
+
+        d->suspended_tools.push_back(nc);
     }
 
     // wait until Core::Update() wakes up the tool
@@ -1228,6 +1426,107 @@ void Core::Resume()
         d->core_cond.Unlock();
 }
 
+std::string Core::setSuspendOwner(const std::string &owner)
+{
+    auto tid = this_thread::get_id();
+    lock_guard<mutex> lock(d->StackMutex);
+
+    std::string old;
+    auto it = d->suspend_owners.find(tid);
+    if (it != d->suspend_owners.end())
+    {
+        old = it->second;
+        if (owner.empty())
+            d->suspend_owners.erase(it);
+        else
+            it->second = owner;
+    }
+    else if (!owner.empty())
+        d->suspend_owners[tid] = owner;
+
+    return old;
+}
+
+void Core::printSuspendStats(color_ostream &out)
+{
+    std::map<std::string, SuspendStat> stats;
+    {
+        lock_guard<mutex> lock(d->StackMutex);
+        stats = d->suspend_stats;
+    }
+
+    if (stats.empty())
+    {
+        out.print("No tools have suspended the core yet.\n");
+        return;
+    }
+
+    out.print("%-24s %8s %10s %10s %10s %10s\n",
+              "owner", "count", "wait avg", "wait max", "hold avg", "hold max");
+    SuspendStat total;
+    for (auto it = stats.begin(); it != stats.end(); ++it)
+    {
+        SuspendStat &st = it->second;
+        out.print("%-24s %8d %8.2fms %8.2fms %8.2fms %8.2fms\n",
+                  it->first.empty() ? "(unattributed)" : it->first.c_str(), st.count,
+                  st.wait_total/1000.0/st.count, st.wait_max/1000.0,
+                  st.hold_total/1000.0/st.count, st.hold_max/1000.0);
+        total.count += st.count;
+        total.wait_total += st.wait_total;
+        total.wait_max = std::max(total.wait_max, st.wait_max);
+        total.hold_total += st.hold_total;
+        total.hold_max = std::max(total.hold_max, st.hold_max);
+    }
+    out.print("%-24s %8d %8.2fms %8.2fms %8.2fms %8.2fms\n",
+              "total", total.count,
+              total.wait_total/1000.0/total.count, total.wait_max/1000.0,
+              total.hold_total/1000.0/total.count, total.hold_max/1000.0);
+}
+
+void Core::resetSuspendStats()
+{
+    lock_guard<mutex> lock(d->StackMutex);
+    d->suspend_stats.clear();
+}
+
+static bool compareUpdateTotal(Plugin *a, Plugin *b)
+{
+    return a->getUpdateProfile().total_us > b->getUpdateProfile().total_us;
+}
+
+void Core::printPluginProfile(color_ostream &out)
+{
+    std::vector<Plugin*> plugins;
+    for (size_t i = 0; i < plug_mgr->size(); i++)
+    {
+        Plugin *plug = (*plug_mgr)[i];
+        if (plug->getUpdateProfile().calls)
+            plugins.push_back(plug);
+    }
+
+    if (!plug_mgr->isProfilingUpdates())
+        out.print("Plugin update profiling is off; use 'plugin-profile start'.\n");
+    if (plugins.empty())
+    {
+        out.print("No plugin updates have been measured.\n");
+        return;
+    }
+
+    std::sort(plugins.begin(), plugins.end(), compareUpdateTotal);
+
+    out.print("%-24s %10s %10s %10s %10s %10s\n",
+              "plugin", "frames", "total", "mean", "p99", "max");
+    for (size_t i = 0; i < plugins.size(); i++)
+    {
+        const PluginUpdateProfile &prof = plugins[i]->getUpdateProfile();
+        out.print("%-24s %10llu %8.1fms %8.1fus %8lluus %8lluus\n",
+                  plugins[i]->getName().c_str(), (unsigned long long)prof.calls,
+                  prof.total_us/1000.0, prof.mean(),
+                  (unsigned long long)prof.percentile(0.99),
+                  (unsigned long long)prof.max_us);
+    }
+}
+
 int Core::TileUpdate()
 {
     if(!started)
@@ -1356,6 +1655,8 @@ void Core::doUpdate(color_ostream &out, bool first_update)
     out << std::flush;
 }
 
+void world_flushPersistentData();
+
 // should always be from simulation thread!
 int Core::Update()
 {
@@ -1384,34 +1685,60 @@ int Core::Update()
         doUpdate(out, first_update);
     }
 
-    // wake waiting tools
-    // do not allow more tools to join in while we process stuff here
-    lock_guard<mutex> lock_stack(d->StackMutex);
+    // wake waiting tools in the order they queued up.
+    // tools that join in while we process a batch are served in the same
+    // window, but only for a few rounds so that DF is never starved
+    std::deque<Core::Cond*> batch;
 
-    while (!d->suspended_tools.empty())
+    for (int round = 0; round < 4; round++)
     {
-        Core::Cond * nc = d->suspended_tools.top();
-        d->suspended_tools.pop();
+        {
+            lock_guard<mutex> lock_stack(d->StackMutex);
+            if (d->suspended_tools.empty())
+                break;
+            batch.swap(d->suspended_tools);
+        }
 
-        lock_guard<mutex> lock(d->AccessMutex);
-        // wake tool
-        nc->Unlock();
-        // wait for tool to wake us
-        d->core_cond.Lock(&d->AccessMutex);
-        // verify
-        assert(d->df_suspend_depth == 0);
-        // destroy condition
-        delete nc;
-        // check lua stack depth
-        Lua::Core::Reset(out, "suspend");
+        while (!batch.empty())
+        {
+            Core::Cond * nc = batch.front();
+            batch.pop_front();
+
+            uint64_t woken = GetTimeUs64();
+            {
+                lock_guard<mutex> lock(d->AccessMutex);
+                // wake tool
+                nc->Unlock();
+                // wait for tool to wake us
+                d->core_cond.Lock(&d->AccessMutex);
+                // verify
+                assert(d->df_suspend_depth == 0);
+            }
+            uint64_t done = GetTimeUs64();
+
+            // account and recycle the condition
+            {
+                lock_guard<mutex> lock_stack(d->StackMutex);
+                d->suspend_stats[nc->owner].add(woken - nc->queued_at, done - woken);
+                d->free_conds.push_back(nc);
+            }
+            // check lua stack depth
+            Lua::Core::Reset(out, "suspend");
+        }
     }
 
+    // store persistent data added during this frame
+    world_flushPersistentData();
+
     return 0;
 };
 
 extern bool buildings_do_onupdate;
 void buildings_onStateChange(color_ostream &out, state_change_event event);
 void buildings_onUpdate(color_ostream &out);
+void materials_onStateChange(color_ostream &out, state_change_event event);
+void items_onStateChange(color_ostream &out, state_change_event event);
+void mapcensus_onStateChange(color_ostream &out, state_change_event event);
 
 static int buildings_timer = 0;
 
@@ -1459,6 +1786,9 @@ void Core::onStateChange(color_ostream &out, state_change_event event)
     EventManager::onStateChange(out, event);
 
     buildings_onStateChange(out, event);
+    materials_onStateChange(out, event);
+    items_onStateChange(out, event);
+    mapcensus_onStateChange(out, event);
 
     plug_mgr->OnStateChange(out, event);
 
@@ -32,6 +32,11 @@ distribution.
 #include "Core.h"
 #include "VersionInfo.h"
 #include "tinythread.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 // must be last due to MS stupidity
 #include "DataDefs.h"
 #include "DataIdentity.h"
@@ -227,6 +232,110 @@ static std::map<std::string, virtual_identity*> name_lookup;
 /* Vtable pointer to identity lookup. */
 std::map<void*, virtual_identity*> virtual_identity::known;
 
+/*
+ * Lock-free front for 'known', used by every virtual_cast. It is an open
+ * addressing table that only ever gains entries; writers hold known_mutex,
+ * fill in the identity before publishing the key, and replace a full table
+ * by a bigger copy, publishing the new pointer last. Old tables are leaked
+ * on purpose, since readers may still be scanning them.
+ *
+ * DF only runs on x86, where stores are not reordered with other stores nor
+ * loads with other loads, so preventing compiler reordering is enough.
+ */
+#ifdef _MSC_VER
+#pragma intrinsic(_ReadWriteBarrier)
+#define VTABLE_CACHE_BARRIER() _ReadWriteBarrier()
+#else
+#define VTABLE_CACHE_BARRIER() __asm__ __volatile__("" ::: "memory")
+#endif
+
+namespace {
+    struct vtable_cache_slot {
+        void *volatile vtable;
+        virtual_identity *volatile identity;
+    };
+
+    struct vtable_cache {
+        size_t mask;
+        size_t count;
+        vtable_cache_slot *slots;
+    };
+}
+
+static vtable_cache *volatile vtable_cache_ptr = NULL;
+
+static inline size_t vtable_hash(void *vtable)
+{
+    return (size_t(vtable) >> 2) * 2654435761U;
+}
+
+static bool vtable_cache_lookup(void *vtable, virtual_identity **out)
+{
+    vtable_cache *cache = vtable_cache_ptr;
+    VTABLE_CACHE_BARRIER();
+    if (!cache)
+        return false;
+
+    for (size_t i = vtable_hash(vtable) & cache->mask; ; i = (i+1) & cache->mask)
+    {
+        void *key = cache->slots[i].vtable;
+        if (key == vtable)
+        {
+            VTABLE_CACHE_BARRIER();
+            *out = cache->slots[i].identity;
+            return true;
+        }
+        if (!key)
+            return false;
+    }
+}
+
+static void vtable_cache_put(vtable_cache *cache, void *vtable, virtual_identity *identity)
+{
+    size_t i = vtable_hash(vtable) & cache->mask;
+    while (cache->slots[i].vtable && cache->slots[i].vtable != vtable)
+        i = (i+1) & cache->mask;
+
+    if (cache->slots[i].vtable)
+        return;
+
+    cache->slots[i].identity = identity;
+    VTABLE_CACHE_BARRIER();
+    cache->slots[i].vtable = vtable;
+    cache->count++;
+}
+
+// Called with known_mutex held, after 'known' has been updated.
+static void vtable_cache_add(const std::map<void*, virtual_identity*> &known,
+                             void *vtable, virtual_identity *identity)
+{
+    vtable_cache *cache = vtable_cache_ptr;
+
+    // Keep the load factor under 1/2
+    if (!cache || (cache->count+1)*2 > cache->mask+1)
+    {
+        size_t size = cache ? (cache->mask+1)*2 : 1024;
+        while (size < known.size()*4)
+            size *= 2;
+
+        vtable_cache *grown = new vtable_cache();
+        grown->mask = size-1;
+        grown->count = 0;
+        grown->slots = new vtable_cache_slot[size];
+        memset(grown->slots, 0, sizeof(vtable_cache_slot)*size);
+
+        std::map<void*, virtual_identity*>::const_iterator it;
+        for (it = known.begin(); it != known.end(); ++it)
+            vtable_cache_put(grown, it->first, it->second);
+
+        VTABLE_CACHE_BARRIER();
+        vtable_cache_ptr = grown;
+        return;
+    }
+
+    vtable_cache_put(cache, vtable, identity);
+}
+
 void virtual_identity::doInit(Core *core)
 {
     struct_identity::doInit(core);
@@ -255,16 +364,20 @@ virtual_identity *virtual_identity::get(virtual_ptr instance_ptr)
 
 virtual_identity *virtual_identity::find(void *vtable)
 {
-    // Actually, a reader/writer lock would be sufficient,
-    // since the table is only written once per class.
+    virtual_identity *cached;
+    if (vtable_cache_lookup(vtable, &cached))
+        return cached;
+
     tthread::lock_guard<tthread::mutex> lock(*known_mutex);
 
     std::map<void*, virtual_identity*>::iterator it = known.find(vtable);
 
     if (it != known.end())
+    {
+        vtable_cache_add(known, vtable, it->second);
         return it->second;
+    }
 
-    // If using a reader/writer lock, re-grab as write here, and recheck
     Core &core = Core::getInstance();
     std::string name = core.p->doReadClassName(vtable);
 
@@ -288,6 +401,7 @@ virtual_identity *virtual_identity::find(void *vtable)
 
         known[vtable] = p;
         p->vtable_ptr = vtable;
+        vtable_cache_add(known, vtable, p);
         return p;
     }
 
@@ -295,6 +409,7 @@ virtual_identity *virtual_identity::find(void *vtable)
               << std::hex << unsigned(vtable) << std::dec << std::endl;
 
     known[vtable] = NULL;
+    vtable_cache_add(known, vtable, NULL);
     return NULL;
 }
 
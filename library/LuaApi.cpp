@@ -30,6 +30,7 @@ distribution.
 
 #include "MemAccess.h"
 #include "Core.h"
+#include "PluginManager.h"
 #include "Error.h"
 #include "VersionInfo.h"
 #include "tinythread.h"
@@ -1699,6 +1700,29 @@ static int buildings_findCivzonesAt(lua_State *L)
     return 1;
 }
 
+static int buildings_findInRect(lua_State *L)
+{
+    df::coord2d p1(luaL_checkint(L, 1), luaL_checkint(L, 2));
+    df::coord2d p2(luaL_checkint(L, 3), luaL_checkint(L, 4));
+    int z = luaL_checkint(L, 5);
+    std::vector<df::building*> pvec;
+    if (Buildings::findInRect(&pvec, p1, p2, z))
+        Lua::PushVector(L, pvec);
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+static int buildings_findNearest(lua_State *L)
+{
+    df::coord pos;
+    Lua::CheckDFAssign(L, &pos, 1);
+    int max_dist = luaL_checkint(L, 2);
+    auto type = (df::building_type)luaL_optint(L, 3, -1);
+    Lua::PushDFObject(L, Buildings::findNearest(pos, max_dist, type));
+    return 1;
+}
+
 static int buildings_getCorrectSize(lua_State *state)
 {
     df::coord2d size(luaL_optint(state, 1, 1), luaL_optint(state, 2, 1));
@@ -1755,6 +1779,8 @@ static int buildings_getStockpileContents(lua_State *state)
 static const luaL_Reg dfhack_buildings_funcs[] = {
     { "findAtTile", buildings_findAtTile },
     { "findCivzonesAt", buildings_findCivzonesAt },
+    { "findInRect", buildings_findInRect },
+    { "findNearest", buildings_findNearest },
     { "getCorrectSize", buildings_getCorrectSize },
     { "setSize", &Lua::CallWithCatchWrapper<buildings_setSize> },
     { "getStockpileContents", buildings_getStockpileContents},
@@ -2294,6 +2320,31 @@ static int internal_getDir(lua_State *L)
     return 1;
 }
 
+static int internal_getPluginProfile(lua_State *L)
+{
+    PluginManager *plug_mgr = Core::getInstance().getPluginManager();
+    lua_newtable(L);
+    for (size_t i = 0; i < plug_mgr->size(); i++)
+    {
+        Plugin *plug = (*plug_mgr)[i];
+        const PluginUpdateProfile &prof = plug->getUpdateProfile();
+        if (!prof.calls)
+            continue;
+
+        lua_createtable(L, 0, 4);
+        lua_pushnumber(L, (lua_Number)prof.calls);
+        lua_setfield(L, -2, "calls");
+        lua_pushnumber(L, prof.mean());
+        lua_setfield(L, -2, "mean");
+        lua_pushnumber(L, (lua_Number)prof.percentile(0.99));
+        lua_setfield(L, -2, "p99");
+        lua_pushnumber(L, (lua_Number)prof.max_us);
+        lua_setfield(L, -2, "max");
+        lua_setfield(L, -2, plug->getName().c_str());
+    }
+    return 1;
+}
+
 static int internal_runCommand(lua_State *L)
 {
     buffered_color_ostream out;
@@ -2365,6 +2416,7 @@ static const luaL_Reg dfhack_internal_funcs[] = {
     { "diffscan", internal_diffscan },
     { "getDir", internal_getDir },
     { "runCommand", internal_runCommand },
+    { "getPluginProfile", internal_getPluginProfile },
     { NULL, NULL }
 };
 
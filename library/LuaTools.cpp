@@ -1210,6 +1210,8 @@ static int dfhack_open_plugin(lua_State *L)
     if (!plugin)
         luaL_error(L, "plugin not found: '%s'", name);
 
+    color_ostream *out = Lua::GetOutput(L);
+    plugin->load_deferred(out ? *out : Core::getInstance().getConsole());
     plugin->open_lua(L, 1);
     return 0;
 }
@@ -167,6 +167,13 @@ uint64_t GetTimeMs64()
     return ret;
 }
 
+uint64_t GetTimeUs64()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
 
 #else // Windows
 uint64_t GetTimeMs64()
@@ -188,6 +195,23 @@ uint64_t GetTimeMs64()
 
     return ret;
 }
+
+uint64_t GetTimeUs64()
+{
+    FILETIME ft;
+    LARGE_INTEGER li;
+
+    GetSystemTimeAsFileTime(&ft);
+    li.LowPart = ft.dwLowDateTime;
+    li.HighPart = ft.dwHighDateTime;
+
+    uint64_t ret = li.QuadPart;
+    ret -= 116444736000000000LL;
+    // From 100 nano seconds (10^-7) to 1 microsecond (10^-6) intervals
+    ret /= 10;
+
+    return ret;
+}
 #endif
 
 /* Character decoding */
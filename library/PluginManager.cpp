@@ -42,18 +42,46 @@ using namespace DFHack;
 #include <string>
 #include <vector>
 #include <map>
+#include <fstream>
+#include <sstream>
 using namespace std;
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include "tinythread.h"
 using namespace tthread;
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline long atomic_inc(volatile long *p) { return _InterlockedIncrement(p); }
+static inline long atomic_dec(volatile long *p) { return _InterlockedDecrement(p); }
+#else
+static inline long atomic_inc(volatile long *p) { return __sync_add_and_fetch(p, 1); }
+static inline long atomic_dec(volatile long *p) { return __sync_sub_and_fetch(p, 1); }
+#endif
 
+/*
+ * The reference count is atomic so that the per-frame on_update call can
+ * take a reference without touching the mutex (lock_add_fast). Everything
+ * else takes references under the mutex.
+ *
+ * Unload sets the state to PS_UNLOADING before waiting for the count to
+ * drop to zero, so a reference taken after that sees the new state. Every
+ * caller must check the state after taking a reference, and not call into
+ * the plugin unless it is still loaded.
+ */
 struct Plugin::RefLock
 {
     RefLock()
     {
         refcount = 0;
+        waiters = 0;
         wakeup = new condition_variable();
         mut = new mutex();
     }
@@ -73,26 +101,40 @@ struct Plugin::RefLock
     void lock_add()
     {
         mut->lock();
-        refcount ++;
+        atomic_inc(&refcount);
         mut->unlock();
     }
+    // The increment is a full barrier: either wait() sees it, or the
+    // caller sees the state set before wait() was called.
+    void lock_add_fast()
+    {
+        atomic_inc(&refcount);
+    }
     void lock_sub()
     {
-        mut->lock();
-        if (--refcount == 0)
-            wakeup->notify_one();
-        mut->unlock();
+        // Both atomics are full barriers, so either wait() sees the zero
+        // count, or we see the waiter and wake it under the mutex.
+        if (atomic_dec(&refcount) == 0 && waiters)
+        {
+            mut->lock();
+            wakeup->notify_all();
+            mut->unlock();
+        }
     }
+    // Called with the mutex held
     void wait()
     {
+        atomic_inc(&waiters);
         while(refcount)
         {
             wakeup->wait(*mut);
         }
+        atomic_dec(&waiters);
     }
     condition_variable * wakeup;
     mutex * mut;
-    int refcount;
+    volatile long refcount;
+    volatile long waiters;
 };
 
 struct Plugin::RefAutolock
@@ -143,12 +185,12 @@ struct Plugin::LuaEvent : public Lua::Event::Owner {
     void on_count_changed(int new_cnt, int delta) {
         RefAutoinc lock(handler.owner->access);
         count = new_cnt;
-        if (event)
+        if (event && handler.owner->state != PS_UNLOADING)
             event->on_count_changed(new_cnt, delta);
     }
     void on_invoked(lua_State *state, int nargs, bool from_c) {
         RefAutoinc lock(handler.owner->access);
-        if (event)
+        if (event && handler.owner->state != PS_UNLOADING)
             event->on_invoked(state, nargs, from_c);
     }
 };
@@ -174,7 +216,10 @@ Plugin::Plugin(Core * core, const std::string & filepath, const std::string & _f
     plugin_rpcconnect = 0;
     plugin_enable = 0;
     plugin_is_enabled = 0;
+    plugin_lazy_load = 0;
     state = PS_UNLOADED;
+    deferred = false;
+    load_us = 0;
     access = new RefLock();
 }
 
@@ -201,6 +246,7 @@ bool Plugin::load(color_ostream &con)
         }
         state = PS_LOADING;
     }
+    uint64_t load_start = GetTimeUs64();
     // enter suspend
     CoreSuspender suspend;
     // open the library, etc
@@ -249,15 +295,26 @@ bool Plugin::load(color_ostream &con)
     plugin_rpcconnect = (RPCService* (*)(color_ostream &)) LookupPlugin(plug, "plugin_rpcconnect");
     plugin_enable = (command_result (*)(color_ostream &,bool)) LookupPlugin(plug, "plugin_enable");
     plugin_is_enabled = (bool*) LookupPlugin(plug, "plugin_is_enabled");
+    plugin_lazy_load = (bool*) LookupPlugin(plug, "plugin_lazy_load");
     plugin_eval_ruby = (command_result (*)(color_ostream &, const char*)) LookupPlugin(plug, "plugin_eval_ruby");
     index_lua(plug);
     this->name = *plug_name;
     plugin_lib = plug;
+    if (deferred)
+    {
+        // drop the commands listed from the manifest
+        parent->unregisterCommands(this);
+        deferred = false;
+    }
     commands.clear();
-    if(plugin_init(con,commands) == CR_OK)
+    command_result init_result = plugin_init(con,commands);
+    load_us = GetTimeUs64() - load_start;
+    if(init_result == CR_OK)
     {
         state = PS_LOADED;
+        update_profile.reset();
         parent->registerCommands(this);
+        parent->updateDispatchList();
         if ((plugin_onupdate || plugin_enable) && !plugin_is_enabled)
             con.printerr("Plugin %s has no enabled var!\n", name.c_str());
         return true;
@@ -266,6 +323,7 @@ bool Plugin::load(color_ostream &con)
     {
         con.printerr("Plugin %s has failed to initialize properly.\n", filename.c_str());
         plugin_is_enabled = 0;
+        plugin_lazy_load = 0;
         plugin_onupdate = 0;
         reset_lua();
         ClosePlugin(plugin_lib);
@@ -290,9 +348,9 @@ bool Plugin::unload(color_ostream &con)
             access->unlock();
             return false;
         }
-        // wait for all calls to finish
-        access->wait();
+        // refuse new calls, then wait for running ones to finish
         state = PS_UNLOADING;
+        access->wait();
         access->unlock();
         // enter suspend
         CoreSuspender suspend;
@@ -303,7 +361,9 @@ bool Plugin::unload(color_ostream &con)
             cr = plugin_shutdown(con);
         // cleanup...
         plugin_is_enabled = 0;
+        plugin_lazy_load = 0;
         plugin_onupdate = 0;
+        parent->updateDispatchList();
         reset_lua();
         parent->unregisterCommands(this);
         commands.clear();
@@ -324,6 +384,12 @@ bool Plugin::unload(color_ostream &con)
     }
     else if(state == PS_UNLOADED)
     {
+        if (deferred)
+        {
+            parent->unregisterCommands(this);
+            commands.clear();
+            deferred = false;
+        }
         access->unlock();
         return true;
     }
@@ -331,6 +397,16 @@ bool Plugin::unload(color_ostream &con)
     return false;
 }
 
+bool Plugin::load_deferred(color_ostream &out)
+{
+    {
+        RefAutolock lock(access);
+        if (!deferred)
+            return true;
+    }
+    return load(out);
+}
+
 bool Plugin::reload(color_ostream &out)
 {
     if(state != PS_LOADED)
@@ -347,6 +423,7 @@ command_result Plugin::invoke(color_ostream &out, const std::string & command, s
     Core & c = Core::getInstance();
     command_result cr = CR_NOT_IMPLEMENTED;
     access->lock_add();
+    std::string old_owner = c.setSuspendOwner(name);
     if(state == PS_LOADED)
     {
         for (size_t i = 0; i < commands.size();i++)
@@ -386,6 +463,7 @@ command_result Plugin::invoke(color_ostream &out, const std::string & command, s
             }
         }
     }
+    c.setSuspendOwner(old_owner);
     access->lock_sub();
     return cr;
 }
@@ -394,6 +472,20 @@ bool Plugin::can_invoke_hotkey(const std::string & command, df::viewscreen *top
 {
     Core & c = Core::getInstance();
     bool cr = false;
+    {
+        // a deferred plugin answers from its manifest entry; it is loaded
+        // when invoked, and load() changes commands with this lock held
+        RefAutolock lock(access);
+        if (deferred)
+        {
+            for (size_t i = 0; i < commands.size();i++)
+            {
+                if(commands[i].name == command)
+                    return commands[i].guard ? commands[i].guard(top) : Gui::default_hotkey(top);
+            }
+            return false;
+        }
+    }
     access->lock_add();
     if(state == PS_LOADED)
     {
@@ -425,16 +517,69 @@ command_result Plugin::on_update(color_ostream &out)
         return CR_OK;
     // Grab mutex and call the thing
     command_result cr = CR_NOT_IMPLEMENTED;
-    access->lock_add();
+    access->lock_add_fast();
     if(state == PS_LOADED && plugin_onupdate)
     {
-        cr = plugin_onupdate(out);
+        if (parent->profile_updates)
+        {
+            uint64_t start = GetTimeUs64();
+            cr = plugin_onupdate(out);
+            update_profile.add(GetTimeUs64() - start);
+        }
+        else
+            cr = plugin_onupdate(out);
         Lua::Core::Reset(out, "plugin_onupdate");
     }
     access->lock_sub();
     return cr;
 }
 
+void PluginUpdateProfile::reset()
+{
+    calls = total_us = max_us = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+static int profile_bucket(uint64_t us)
+{
+    if (us < 8)
+        return int(us);
+    int e = 3;
+    while ((us >> (e+1)) != 0)
+        e++;
+    int idx = 8 + (e-3)*4 + int((us >> (e-2)) & 3);
+    return std::min(idx, PluginUpdateProfile::NUM_BUCKETS-1);
+}
+
+static uint64_t profile_bucket_limit(int idx)
+{
+    if (idx < 8)
+        return idx+1;
+    int e = 3 + (idx-8)/4;
+    return uint64_t(5 + (idx-8)%4) << (e-2);
+}
+
+void PluginUpdateProfile::add(uint64_t us)
+{
+    calls++;
+    total_us += us;
+    max_us = std::max(max_us, us);
+    buckets[profile_bucket(us)]++;
+}
+
+uint64_t PluginUpdateProfile::percentile(double fraction) const
+{
+    uint64_t target = uint64_t(calls * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (buckets[i] && seen >= target)
+            return std::min(profile_bucket_limit(i), max_us);
+    }
+    return max_us;
+}
+
 command_result Plugin::set_enabled(color_ostream &out, bool enable)
 {
     command_result cr = CR_NOT_IMPLEMENTED;
@@ -592,7 +737,7 @@ int Plugin::lua_cmd_wrapper(lua_State *state)
 
     RefAutoinc lock(cmd->owner->access);
 
-    if (!cmd->command)
+    if (!cmd->command || cmd->owner->state == PS_UNLOADING)
         luaL_error(state, "plugin command %s() has been unloaded",
                    (cmd->owner->name+"."+cmd->name).c_str());
 
@@ -605,7 +750,7 @@ int Plugin::lua_fun_wrapper(lua_State *state)
 
     RefAutoinc lock(cmd->owner->access);
 
-    if (!cmd->identity)
+    if (!cmd->identity || cmd->owner->state == PS_UNLOADING)
     {
         if (cmd->silent)
             return 0;
@@ -676,10 +821,122 @@ void Plugin::push_function(lua_State *state, LuaFunction *fn)
     lua_pushcclosure(state, lua_fun_wrapper, 4);
 }
 
+/*
+ * The manifest records, for each plugin file, the commands it registered and
+ * whether it has to be loaded at startup. Only plugins that opt in with
+ * DFHACK_PLUGIN_LAZY_LOAD, register commands and export no update, state
+ * change, enable or ruby hooks may be deferred; anything else might do work
+ * in plugin_init that nothing would trigger later. With lazy loading, a
+ * deferrable plugin with an up to date entry is not loaded: its commands are
+ * listed from the manifest, and it is loaded the first time one of them is
+ * invoked, or it is enabled, opened from Lua or bound over RPC.
+ */
+static const char *MANIFEST_FORMAT = "manifest 2";
+struct PluginManager::ManifestEntry
+{
+    long long size;
+    long long mtime;
+    bool eager;
+    // names and descriptions only, no functions
+    std::vector<PluginCommand> commands;
+};
+
+static bool statPlugin(const std::string &path, long long *size, long long *mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+void PluginManager::loadManifest(const std::string &file)
+{
+    std::ifstream in(file.c_str());
+    ManifestEntry *entry = NULL;
+    std::string line;
+    // older manifests decided eagerness differently
+    if (!std::getline(in, line) || line != MANIFEST_FORMAT)
+        return;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string kind, name;
+        fields >> kind >> name;
+        if (kind == "plugin")
+        {
+            int eager = 1;
+            entry = new ManifestEntry();
+            fields >> entry->size >> entry->mtime >> eager;
+            entry->eager = (eager != 0);
+            if (fields.fail() || manifest.count(name))
+            {
+                delete entry;
+                entry = NULL;
+                continue;
+            }
+            manifest[name] = entry;
+        }
+        else if (kind == "command" && entry)
+        {
+            int hotkey = 0;
+            std::string description;
+            fields >> hotkey;
+            std::getline(fields >> std::ws, description);
+            PluginCommand cmd(name.c_str(), description.c_str(), NULL);
+            if (hotkey)
+                cmd.guard = Gui::default_hotkey;
+            entry->commands.push_back(cmd);
+        }
+    }
+}
+
+void PluginManager::saveManifest(const std::string &file)
+{
+    std::ofstream out(file.c_str());
+    if (!out.good())
+        return;
+    out << MANIFEST_FORMAT << "\n";
+    for (size_t i = 0; i < all_plugins.size(); i++)
+    {
+        Plugin *p = all_plugins[i];
+        std::string key = p->filename.substr(p->filename.find_last_of("/\\") + 1);
+        long long size, mtime;
+        bool eager;
+
+        if (p->deferred)
+        {
+            ManifestEntry *entry = manifest[key];
+            size = entry->size;
+            mtime = entry->mtime;
+            eager = entry->eager;
+        }
+        else if (p->state == Plugin::PS_LOADED && statPlugin(p->filename, &size, &mtime))
+            eager = !(p->plugin_lazy_load && *p->plugin_lazy_load) ||
+                    p->commands.empty() ||
+                    p->plugin_onupdate || p->plugin_onstatechange ||
+                    p->plugin_is_enabled || p->plugin_eval_ruby;
+        else
+            continue;
+
+        out << "plugin " << key << " " << size << " " << mtime << " " << (eager ? 1 : 0) << "\n";
+        for (size_t j = 0; j < p->commands.size(); j++)
+        {
+            const PluginCommand &cmd = p->commands[j];
+            std::string description = cmd.description.substr(0, cmd.description.find('\n'));
+            out << "command " << cmd.name << " " << (cmd.isHotkeyCommand() ? 1 : 0)
+                << " " << description << "\n";
+        }
+    }
+}
+
 PluginManager::PluginManager(Core * core)
 {
     cmdlist_mutex = new mutex();
     ruby = NULL;
+    profile_updates = false;
+    lazy_loading = getenv("DFHACK_LAZY_PLUGINS") != NULL;
 }
 
 PluginManager::~PluginManager()
@@ -689,6 +946,9 @@ PluginManager::~PluginManager()
         delete all_plugins[i];
     }
     all_plugins.clear();
+    for (auto it = manifest.begin(); it != manifest.end(); ++it)
+        delete it->second;
+    manifest.clear();
     delete cmdlist_mutex;
 }
 
@@ -705,6 +965,10 @@ void PluginManager::init(Core * core)
     string path = core->getHackPath() + "plugins\\";
     const string searchstr = ".plug.dll";
 #endif
+    string manifest_file = core->getHackPath() + "plugins.manifest";
+    if (lazy_loading)
+        loadManifest(manifest_file);
+
     vector <string> filez;
     getdir(path, filez);
     for(size_t i = 0; i < filez.size();i++)
@@ -713,10 +977,26 @@ void PluginManager::init(Core * core)
         {
             Plugin * p = new Plugin(core, path + filez[i], filez[i], this);
             all_plugins.push_back(p);
+
+            auto it = manifest.find(filez[i]);
+            long long size, mtime;
+            if (it != manifest.end() && !it->second->eager &&
+                !it->second->commands.empty() &&
+                statPlugin(p->filename, &size, &mtime) &&
+                size == it->second->size && mtime == it->second->mtime)
+            {
+                p->commands = it->second->commands;
+                p->deferred = true;
+                registerCommands(p);
+                continue;
+            }
+
             // make all plugins load by default (until a proper design emerges).
             p->load(core->getConsole());
         }
     }
+
+    saveManifest(manifest_file);
 }
 
 Plugin *PluginManager::getPluginByName (const std::string & name)
@@ -743,23 +1023,51 @@ Plugin *PluginManager::getPluginByCommand(const std::string &command)
 command_result PluginManager::InvokeCommand(color_ostream &out, const std::string & command, std::vector <std::string> & parameters)
 {
     Plugin *plugin = getPluginByCommand(command);
+    if (plugin)
+        plugin->load_deferred(out);
     return plugin ? plugin->invoke(out, command, parameters) : CR_NOT_IMPLEMENTED;
 }
 
+// Called on the input thread with HotkeyMutex held: must not load plugins
 bool PluginManager::CanInvokeHotkey(const std::string &command, df::viewscreen *top)
 {
     Plugin *plugin = getPluginByCommand(command);
     return plugin ? plugin->can_invoke_hotkey(command, top) : true;
 }
 
-void PluginManager::OnUpdate(color_ostream &out)
+// Called with the core suspended, like OnUpdate
+void PluginManager::updateDispatchList()
 {
+    update_plugins.clear();
     for(size_t i = 0; i < all_plugins.size(); i++)
     {
-        all_plugins[i]->on_update(out);
+        Plugin *p = all_plugins[i];
+        if (p->state == Plugin::PS_LOADED && p->plugin_onupdate)
+            update_plugins.push_back(p);
     }
 }
 
+void PluginManager::OnUpdate(color_ostream &out)
+{
+    for(size_t i = 0; i < update_plugins.size(); i++)
+    {
+        update_plugins[i]->on_update(out);
+    }
+}
+
+void PluginManager::setProfilingUpdates(bool enable)
+{
+    if (enable && !profile_updates)
+        resetUpdateProfiles();
+    profile_updates = enable;
+}
+
+void PluginManager::resetUpdateProfiles()
+{
+    for(size_t i = 0; i < all_plugins.size(); i++)
+        all_plugins[i]->update_profile.reset();
+}
+
 void PluginManager::OnStateChange(color_ostream &out, state_change_event event)
 {
     for(size_t i = 0; i < all_plugins.size(); i++)
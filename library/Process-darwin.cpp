@@ -28,6 +28,7 @@ distribution.
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 #include <mach-o/dyld.h>
 
@@ -47,6 +48,41 @@ using namespace std;
 #include <string.h>
 using namespace DFHack;
 
+/*
+ * Hashing the whole executable is one of the slower steps of startup, so the
+ * hash of a known version is cached along with the file's identity, and
+ * reused until the file is replaced or modified.
+ */
+static const char *hash_cache_name = "hack/exe-md5.cache";
+
+static bool loadCachedHash(const struct stat &st, string &hash)
+{
+    FILE *f = fopen(hash_cache_name, "r");
+    if (!f)
+        return false;
+    unsigned long long dev, ino, size, mtime;
+    char buf[64];
+    bool ok = fscanf(f, "%llu %llu %llu %llu %63s", &dev, &ino, &size, &mtime, buf) == 5
+        && dev == (unsigned long long)st.st_dev && ino == (unsigned long long)st.st_ino
+        && size == (unsigned long long)st.st_size && mtime == (unsigned long long)st.st_mtime;
+    fclose(f);
+    if (ok)
+        hash = buf;
+    return ok;
+}
+
+static void saveCachedHash(const struct stat &st, const string &hash)
+{
+    FILE *f = fopen(hash_cache_name, "w");
+    if (!f)
+        return;
+    fprintf(f, "%llu %llu %llu %llu %s\n",
+            (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+            (unsigned long long)st.st_size, (unsigned long long)st.st_mtime,
+            hash.c_str());
+    fclose(f);
+}
+
 Process::Process(VersionInfoFactory * known_versions)
 {
     int target_result;
@@ -62,13 +98,24 @@ Process::Process(VersionInfoFactory * known_versions)
     my_descriptor = 0;
 
     md5wrapper md5;
-    uint32_t length;
+    uint32_t length = 0;
     uint8_t first_kb [1024];
     memset(first_kb, 0, sizeof(first_kb));
-    // get hash of the running DF process
-    string hash = md5.getHashFromFile(real_path, length, (char *) first_kb);
+    // get hash of the running DF process, from the cache if it is unchanged
+    string hash;
+    VersionInfo * vinfo = NULL;
+    struct stat exe_stat;
+    bool have_stat = (stat(real_path, &exe_stat) == 0);
+    if (have_stat && loadCachedHash(exe_stat, hash))
+        vinfo = known_versions->getVersionInfoByMD5(hash);
+    if (!vinfo)
+    {
+        hash = md5.getHashFromFile(real_path, length, (char *) first_kb);
+        vinfo = known_versions->getVersionInfoByMD5(hash);
+        if (vinfo && have_stat)
+            saveCachedHash(exe_stat, hash);
+    }
     // create linux process, add it to the vector
-    VersionInfo * vinfo = known_versions->getVersionInfoByMD5(hash);
     if(vinfo)
     {
         my_descriptor = new VersionInfo(*vinfo);
@@ -93,6 +93,7 @@ RemoteClient::RemoteClient(color_ostream *default_output)
     active = false;
     socket = new CActiveSocket();
     suspend_ready = false;
+    batch_ready = false;
 
     if (!p_default_output)
     {
@@ -287,6 +288,76 @@ int RemoteClient::resume_game()
         return -1;
 }
 
+void RemoteBatch::add(RemoteFunctionBase *function, const message_type *input, message_type *output)
+{
+    Call call = { function, input, output, CR_NOT_IMPLEMENTED };
+    calls.push_back(call);
+}
+
+command_result RemoteBatch::execute(color_ostream &out)
+{
+    if (!client || !client->active)
+        return CR_NOT_IMPLEMENTED;
+
+    if (!client->batch_ready) {
+        client->batch_ready = true;
+
+        client->batch_call.bind(out, client, "RunBatch");
+    }
+
+    auto &batch_call = client->batch_call;
+    if (!batch_call.isValid())
+        return CR_NOT_IMPLEMENTED;
+
+    batch_call.reset();
+
+    std::vector<size_t> sent;
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        Call &call = calls[i];
+        call.result = CR_NOT_IMPLEMENTED;
+
+        if (!call.function->isValid() || call.function->p_client != client)
+        {
+            out.printerr("Cannot batch unbound RPC function %s::%s.\n",
+                         call.function->proto.c_str(), call.function->name.c_str());
+            continue;
+        }
+
+        auto item = batch_call.in()->add_calls();
+        item->set_id(call.function->id);
+        item->set_input(call.input->SerializeAsString());
+        sent.push_back(i);
+    }
+
+    command_result rv = batch_call(out);
+
+    for (size_t i = 0; i < sent.size(); i++)
+    {
+        Call &call = calls[sent[i]];
+
+        if (rv != CR_OK)
+            call.result = rv;
+        else if (int(i) >= batch_call.out()->results_size())
+            call.result = CR_LINK_FAILURE;
+        else
+        {
+            auto &result = batch_call.out()->results(i);
+            call.result = command_result(result.code());
+
+            call.output->Clear();
+            if (call.result == CR_OK && !call.output->ParseFromString(result.output()))
+            {
+                out.printerr("In call to %s::%s: error parsing received result.\n",
+                             call.function->proto.c_str(), call.function->name.c_str());
+                call.result = CR_LINK_FAILURE;
+            }
+        }
+    }
+
+    return rv;
+}
+
 void RPCFunctionBase::reset(bool free)
 {
     if (free)
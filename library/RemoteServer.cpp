@@ -57,6 +57,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <sstream>
 
 #include <memory>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/select.h>
+#endif
 
 using namespace DFHack;
 
@@ -67,9 +72,16 @@ using dfproto::CoreTextNotification;
 using dfproto::CoreTextFragment;
 using google::protobuf::MessageLite;
 
-bool readFullBuffer(CSimpleSocket *socket, void *buf, int size);
-bool sendRemoteMessage(CSimpleSocket *socket, int16_t id,
-                        const ::google::protobuf::MessageLite *msg, bool size_ready);
+// Server limits. Clients past MAX_CONNECTIONS are refused; requests are
+// run by WORKER_COUNT pool threads, except that a client holding CoreSuspend
+// is served by a thread of its own until it resumes.
+static const size_t MAX_CONNECTIONS = 32;
+static const int WORKER_COUNT = 4;
+static const int RECEIVE_CHUNK = 64*1024;
+// Stop reading from a client once this much unprocessed input is buffered
+static const size_t MAX_PENDING_INPUT = sizeof(RPCMessageHeader) + RPCMessageHeader::MAX_MESSAGE_SIZE;
+// Block a worker writing to a client with this much unsent output
+static const size_t MAX_PENDING_OUTPUT = 2*RPCMessageHeader::MAX_MESSAGE_SIZE;
 
 
 RPCService::RPCService()
@@ -113,14 +125,30 @@ ServerConnection::ServerConnection(CActiveSocket *socket)
 {
     in_error = false;
 
+    io_mutex = new mutex();
+    io_cond = new condition_variable();
+    handshake_done = false;
+    busy = false;
+    closing = false;
+    out_pos = 0;
+    pinned = NULL;
+
+    socket->SetNonblocking();
+
     core_service = new CoreService();
     core_service->finalize(this, &functions);
-
-    thread = new tthread::thread(threadFn, (void*)this);
+    suspend_id = core_service->getFunction("CoreSuspend")->getId();
 }
 
 ServerConnection::~ServerConnection()
 {
+    // Not busy any more, so the pinned thread is at most returning
+    if (pinned)
+    {
+        pinned->join();
+        delete pinned;
+    }
+
     in_error = true;
     socket->Close();
     delete socket;
@@ -129,6 +157,9 @@ ServerConnection::~ServerConnection()
         delete it->second;
 
     delete core_service;
+
+    delete io_cond;
+    delete io_mutex;
 }
 
 ServerFunctionBase *ServerConnection::findFunction(color_ostream &out, const std::string &plugin, const std::string &name)
@@ -150,6 +181,8 @@ ServerFunctionBase *ServerConnection::findFunction(color_ostream &out, const std
                 return NULL;
             }
 
+            plug->load_deferred(out);
+
             svc = plug->rpc_connect(out);
             if (!svc)
             {
@@ -188,175 +221,393 @@ void ServerConnection::connection_ostream::flush_proxy()
 
     buffer.clear();
 
-    if (!sendRemoteMessage(owner->socket, RPC_REPLY_TEXT, &msg, false))
+    if (!owner->queueMessage(RPC_REPLY_TEXT, &msg, false))
     {
         owner->in_error = true;
         Core::printerr("Error writing text into client socket.\n");
     }
 }
 
-void ServerConnection::threadFn(void *arg)
+/*
+ * Connection I/O. The server thread owns reading: it fills in_buf and
+ * hands the connection to a worker once a complete request is there.
+ * Output is appended to out_buf by whoever produces it and sent as far
+ * as the socket accepts; the server thread drains the rest.
+ */
+
+// Server thread: read whatever the socket has; false on EOF or error.
+bool ServerConnection::readInput()
 {
-    ServerConnection *me = (ServerConnection*)arg;
+    int cnt = socket->Receive(RECEIVE_CHUNK);
 
-    me->threadFn();
+    if (cnt <= 0)
+        return (cnt < 0 && socket->GetSocketError() == CSimpleSocket::SocketEwouldblock);
+
+    uint8_t *data = socket->GetData();
 
-    delete me;
+    lock_guard<mutex> lock(*io_mutex);
+    in_buf.insert(in_buf.end(), data, data + cnt);
+    return true;
 }
 
-void ServerConnection::threadFn()
+// Server thread, io_mutex held: process the handshake, and check if
+// the connection needs to be given to a worker.
+bool ServerConnection::checkInput()
 {
-    color_ostream_proxy out(Core::getInstance().getConsole());
-
-    /* Handshake */
-
+    if (!handshake_done)
     {
         RPCHandshakeHeader header;
 
-        if (!readFullBuffer(socket, &header, sizeof(header)))
-        {
-            out << "In RPC server: could not read handshake header." << endl;
-            return;
-        }
+        if (in_buf.size() < sizeof(header))
+            return false;
+
+        memcpy(&header, &in_buf[0], sizeof(header));
+        in_buf.erase(in_buf.begin(), in_buf.begin() + sizeof(header));
 
         if (memcmp(header.magic, RPCHandshakeHeader::REQUEST_MAGIC, sizeof(header.magic)) ||
             header.version < 1 || header.version > 255)
         {
-            out << "In RPC server: invalid handshake header." << endl;
-            return;
+            Core::printerr("In RPC server: invalid handshake header.\n");
+            closing = true;
+            return false;
         }
 
         memcpy(header.magic, RPCHandshakeHeader::RESPONSE_MAGIC, sizeof(header.magic));
         header.version = 1;
 
-        if (socket->Send((uint8*)&header, sizeof(header)) != sizeof(header))
+        out_buf.append((const char*)&header, sizeof(header));
+        if (!flushOutput())
+        {
+            Core::printerr("In RPC server: could not send handshake response.\n");
+            return false;
+        }
+
+        handshake_done = true;
+        std::cerr << "Client connection established." << endl;
+    }
+
+    // A worker pinned to this connection is waiting for input
+    if (busy)
+    {
+        io_cond->notify_all();
+        return false;
+    }
+
+    if (closing || !requestReady())
+        return false;
+
+    busy = true;
+    return true;
+}
+
+// io_mutex held: check if in_buf starts with a complete request.
+bool ServerConnection::requestReady()
+{
+    RPCMessageHeader header;
+
+    if (!handshake_done || in_buf.size() < sizeof(header))
+        return false;
+
+    memcpy(&header, &in_buf[0], sizeof(header));
+
+    if ((DFHack::DFHackReplyCode)header.id == RPC_REQUEST_QUIT)
+        return true;
+
+    if (header.size < 0 || header.size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+    {
+        Core::printerr("In RPC server: invalid received size %d.\n", header.size);
+        closing = true;
+        return false;
+    }
+
+    return in_buf.size() >= sizeof(header) + header.size;
+}
+
+// io_mutex held, requestReady() true: remove the request from in_buf.
+void ServerConnection::takeRequest(RPCMessageHeader *header, std::vector<uint8_t> *data)
+{
+    memcpy(header, &in_buf[0], sizeof(*header));
+
+    size_t size = sizeof(*header);
+    if ((DFHack::DFHackReplyCode)header->id != RPC_REQUEST_QUIT)
+        size += header->size;
+
+    data->assign(in_buf.begin() + sizeof(*header), in_buf.begin() + size);
+    in_buf.erase(in_buf.begin(), in_buf.begin() + size);
+}
+
+// io_mutex held: send as much pending output as the socket takes.
+bool ServerConnection::flushOutput()
+{
+    while (out_pos < out_buf.size())
+    {
+        int cnt = socket->Send((const uint8*)out_buf.data() + out_pos, out_buf.size() - out_pos);
+
+        if (cnt <= 0)
         {
-            out << "In RPC server: could not send handshake response." << endl;
-            return;
+            if (cnt < 0 && socket->GetSocketError() == CSimpleSocket::SocketEwouldblock)
+                return true;
+
+            closing = true;
+            return false;
         }
+
+        out_pos += cnt;
     }
 
-    /* Processing */
+    out_buf.clear();
+    out_pos = 0;
+    return true;
+}
+
+bool ServerConnection::queueData(const void *data, size_t size)
+{
+    lock_guard<mutex> lock(*io_mutex);
+
+    // Don't let a client that doesn't read its replies eat memory
+    while (!closing && pendingOutput() > MAX_PENDING_OUTPUT)
+        io_cond->wait(*io_mutex);
+
+    if (closing)
+        return false;
 
-    std::cerr << "Client connection established." << endl;
+    out_buf.append((const char*)data, size);
+    return flushOutput();
+}
+
+bool ServerConnection::queueMessage(int16_t id, const MessageLite *msg, bool size_ready)
+{
+    int size = size_ready ? msg->GetCachedSize() : msg->ByteSize();
+    std::string buf(sizeof(RPCMessageHeader) + size, '\0');
 
-    while (!in_error) {
-        // Read the message
+    RPCMessageHeader header;
+    header.id = id;
+    header.size = size;
+    memcpy(&buf[0], &header, sizeof(header));
+
+    if (size > 0)
+        msg->SerializeWithCachedSizesToArray((uint8*)&buf[sizeof(header)]);
+
+    return queueData(buf.data(), buf.size());
+}
+
+// io_mutex held, requestReady() true: check if the request is CoreSuspend.
+bool ServerConnection::suspendRequested()
+{
+    RPCMessageHeader header;
+    memcpy(&header, &in_buf[0], sizeof(header));
+    return header.id == suspend_id;
+}
+
+void ServerConnection::pinnedFn(void *arg)
+{
+    ServerConnection *me = (ServerConnection*)arg;
+
+    while (me->process(true)) {}
+}
+
+// Worker or pinned thread: handle requests for a connection marked busy.
+// Returns true if more requests are ready and the connection should be
+// queued again.
+bool ServerConnection::process(bool is_pinned)
+{
+    for (;;)
+    {
         RPCMessageHeader header;
+        std::vector<uint8_t> data;
+        bool have_request = false;
+        bool pin = false;
 
-        if (!readFullBuffer(socket, &header, sizeof(header)))
         {
-            out.printerr("In RPC server: I/O error in receive header.\n");
-            break;
+            lock_guard<mutex> lock(*io_mutex);
+
+            // A client that suspended the core via CoreSuspend has to be
+            // served by this thread until it resumes, so wait for it here.
+            while (!closing)
+            {
+                if (requestReady())
+                {
+                    // Pool workers hand suspending clients to their own thread
+                    if (!is_pinned && suspendRequested())
+                    {
+                        pin = true;
+                        break;
+                    }
+
+                    takeRequest(&header, &data);
+                    have_request = true;
+                    break;
+                }
+
+                if (!core_service->isSuspending())
+                    break;
+
+                io_cond->wait(*io_mutex);
+            }
+
+            if (!have_request && !closing && !pin)
+            {
+                busy = false;
+                return false;
+            }
         }
 
-        if ((DFHack::DFHackReplyCode)header.id == RPC_REQUEST_QUIT)
-            break;
+        if (pin)
+        {
+            // Still busy: the connection now belongs to the new thread. The
+            // previous one cleared busy before returning, so joining is short.
+            if (pinned)
+            {
+                pinned->join();
+                delete pinned;
+            }
+            pinned = new tthread::thread(pinnedFn, this);
+            return false;
+        }
 
-        if (header.size < 0 || header.size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+        if (have_request)
         {
-            out.printerr("In RPC server: invalid received size %d.\n", header.size);
-            break;
+            if ((DFHack::DFHackReplyCode)header.id == RPC_REQUEST_QUIT)
+                in_error = true;
+            else
+                handleCall(header, data);
         }
 
-        std::auto_ptr<uint8_t> buf(new uint8_t[header.size]);
+        bool done = false;
 
-        if (!readFullBuffer(socket, buf.get(), header.size))
         {
-            out.printerr("In RPC server: I/O error in receive %d bytes of data.\n", header.size);
-            break;
+            lock_guard<mutex> lock(*io_mutex);
+
+            if (in_error)
+                closing = true;
+
+            if (!closing)
+            {
+                if (core_service->isSuspending())
+                    continue;
+                if (requestReady())
+                    return true;
+
+                busy = false;
+                return false;
+            }
+
+            done = true;
         }
 
-        //out.print("Handling %d:%d\n", header.id, header.size);
+        if (done)
+        {
+            // Closing: the server thread deletes the connection once it is
+            // no longer busy, but suspends must be undone by this thread.
+            core_service->releaseSuspend();
 
-        // Find and call the function
-        int in_size = header.size;
+            lock_guard<mutex> lock(*io_mutex);
+            busy = false;
+            return false;
+        }
+    }
+}
 
-        ServerFunctionBase *fn = vector_get(functions, header.id);
-        MessageLite *reply = NULL;
-        command_result res = CR_FAILURE;
+void ServerConnection::handleCall(const RPCMessageHeader &header, std::vector<uint8_t> &data)
+{
+    color_ostream_proxy out(Core::getInstance().getConsole());
+
+    //out.print("Handling %d:%d\n", header.id, header.size);
+
+    // Find and call the function
+    int in_size = header.size;
 
-        if (!fn)
+    ServerFunctionBase *fn = vector_get(functions, header.id);
+    MessageLite *reply = NULL;
+    command_result res = CR_FAILURE;
+
+    if (!fn)
+    {
+        stream.printerr("RPC call of invalid id %d\n", header.id);
+    }
+    else
+    {
+        if (!fn->in()->ParseFromArray(data.empty() ? NULL : &data[0], header.size))
         {
-            stream.printerr("RPC call of invalid id %d\n", header.id);
+            stream.printerr("In call to %s: could not decode input args.\n", fn->name);
         }
         else
         {
-            if (!fn->in()->ParseFromArray(buf.get(), header.size))
+            std::vector<uint8_t>().swap(data);
+
+            reply = fn->out();
+
+            if (fn->flags & SF_DONT_SUSPEND)
             {
-                stream.printerr("In call to %s: could not decode input args.\n", fn->name);
+                res = fn->execute(stream);
             }
             else
             {
-                buf.reset();
-
-                reply = fn->out();
-
-                if (fn->flags & SF_DONT_SUSPEND)
+                Core &core = Core::getInstance();
+                std::string old_owner = core.setSuspendOwner(std::string("rpc:") + fn->name);
                 {
+                    CoreSuspender suspend(&core);
                     res = fn->execute(stream);
                 }
-                else
-                {
-                    CoreSuspender suspend;
-                    res = fn->execute(stream);
-                }
+                core.setSuspendOwner(old_owner);
             }
         }
+    }
 
-        // Flush all text output
-        if (in_error)
-            break;
+    // Flush all text output
+    if (in_error)
+        return;
 
-        //out.print("Answer %d:%d\n", res, reply);
+    //out.print("Answer %d:%d\n", res, reply);
 
-        // Send reply
-        int out_size = (reply ? reply->ByteSize() : 0);
+    // Send reply
+    int out_size = (reply ? reply->ByteSize() : 0);
 
-        if (out_size > RPCMessageHeader::MAX_MESSAGE_SIZE)
-        {
-            stream.printerr("In call to %s: reply too large: %d.\n",
-                                (fn ? fn->name : "UNKNOWN"), out_size);
-            res = CR_LINK_FAILURE;
-        }
+    if (out_size > RPCMessageHeader::MAX_MESSAGE_SIZE)
+    {
+        stream.printerr("In call to %s: reply too large: %d.\n",
+                            (fn ? fn->name : "UNKNOWN"), out_size);
+        res = CR_LINK_FAILURE;
+    }
 
-        stream.flush();
+    stream.flush();
 
-        if (res == CR_OK && reply)
-        {
-            if (!sendRemoteMessage(socket, RPC_REPLY_RESULT, reply, true))
-            {
-                out.printerr("In RPC server: I/O error in send result.\n");
-                break;
-            }
-        }
-        else
+    if (res == CR_OK && reply)
+    {
+        if (!queueMessage(RPC_REPLY_RESULT, reply, true))
         {
-            header.id = RPC_REPLY_FAIL;
-            header.size = res;
-
-            if (socket->Send((uint8_t*)&header, sizeof(header)) != sizeof(header))
-            {
-                out.printerr("In RPC server: I/O error in send failure code.\n");
-                break;
-            }
+            out.printerr("In RPC server: I/O error in send result.\n");
+            in_error = true;
         }
+    }
+    else
+    {
+        RPCMessageHeader fail;
+        fail.id = RPC_REPLY_FAIL;
+        fail.size = res;
 
-        // Cleanup
-        if (fn)
+        if (!queueData(&fail, sizeof(fail)))
         {
-            fn->reset((fn->flags & SF_CALLED_ONCE) ||
-                      (out_size > 128*1024 || in_size > 32*1024));
+            out.printerr("In RPC server: I/O error in send failure code.\n");
+            in_error = true;
         }
     }
 
-    std::cerr << "Shutting down client connection." << endl;
+    // Cleanup
+    if (fn)
+    {
+        fn->reset((fn->flags & SF_CALLED_ONCE) ||
+                  (out_size > 128*1024 || in_size > 32*1024));
+    }
 }
 
 ServerMain::ServerMain()
 {
     socket = new CPassiveSocket();
     thread = NULL;
+
+    queue_mutex = new mutex();
+    queue_cond = new condition_variable();
 }
 
 ServerMain::~ServerMain()
@@ -375,17 +626,163 @@ bool ServerMain::listen(int port)
     if (!socket->Listen((const uint8 *)"127.0.0.1", port))
         return false;
 
+    for (int i = 0; i < WORKER_COUNT; i++)
+        workers.push_back(new tthread::thread(workerFn, this));
+
     thread = new tthread::thread(threadFn, this);
     return true;
 }
 
+void ServerMain::enqueue(ServerConnection *conn)
+{
+    lock_guard<mutex> lock(*queue_mutex);
+    queue.push_back(conn);
+    queue_cond->notify_one();
+}
+
+void ServerMain::workerFn(void *arg)
+{
+    ServerMain *me = (ServerMain*)arg;
+
+    me->workerFn();
+}
+
+void ServerMain::workerFn()
+{
+    for (;;)
+    {
+        ServerConnection *conn;
+
+        {
+            lock_guard<mutex> lock(*queue_mutex);
+
+            while (queue.empty())
+                queue_cond->wait(*queue_mutex);
+
+            conn = queue.front();
+            queue.pop_front();
+        }
+
+        // Round-robin between clients with pipelined requests
+        if (conn->process(false))
+            enqueue(conn);
+    }
+}
+
+void ServerMain::acceptClient()
+{
+    CActiveSocket *client = socket->Accept();
+    if (!client)
+        return;
+
+    if (connections.size() >= MAX_CONNECTIONS)
+    {
+        Core::printerr("In RPC server: too many connections, refusing client.\n");
+        client->Close();
+        delete client;
+        return;
+    }
+
+    connections.push_back(new ServerConnection(client));
+}
+
 void ServerMain::threadFn(void *arg)
 {
     ServerMain *me = (ServerMain*)arg;
-    CActiveSocket *client;
 
-    while ((client = me->socket->Accept()) != NULL)
+    me->threadFn();
+}
+
+void ServerMain::threadFn()
+{
+    while (socket->IsSocketValid())
     {
-        new ServerConnection(client);
+        fd_set rd_set, wr_set;
+        FD_ZERO(&rd_set);
+        FD_ZERO(&wr_set);
+
+        SOCKET listen_fd = socket->GetSocketDescriptor();
+        SOCKET max_fd = listen_fd;
+        FD_SET(listen_fd, &rd_set);
+
+        for (size_t i = 0; i < connections.size();)
+        {
+            ServerConnection *conn = connections[i];
+            bool dead;
+
+            {
+                lock_guard<mutex> lock(*conn->io_mutex);
+
+                dead = conn->closing && !conn->busy;
+
+                if (!dead)
+                {
+                    SOCKET fd = conn->socket->GetSocketDescriptor();
+
+                    // Backpressure: leave data in the kernel buffers
+                    // while the pending requests are being processed.
+                    if (!conn->closing && conn->in_buf.size() < MAX_PENDING_INPUT)
+                        FD_SET(fd, &rd_set);
+                    if (conn->pendingOutput() > 0)
+                        FD_SET(fd, &wr_set);
+
+                    max_fd = std::max(max_fd, fd);
+                }
+            }
+
+            if (dead)
+            {
+                std::cerr << "Shutting down client connection." << endl;
+                delete conn;
+                connections.erase(connections.begin() + i);
+            }
+            else
+                i++;
+        }
+
+        // Time out to pick up closures and output queued by the workers
+        timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 10000;
+
+        if (select(int(max_fd) + 1, &rd_set, &wr_set, NULL, &timeout) <= 0)
+            continue;
+
+        if (FD_ISSET(listen_fd, &rd_set))
+            acceptClient();
+
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            ServerConnection *conn = connections[i];
+            SOCKET fd = conn->socket->GetSocketDescriptor();
+
+            if (FD_ISSET(fd, &rd_set))
+            {
+                bool ok = conn->readInput();
+                bool ready;
+
+                {
+                    lock_guard<mutex> lock(*conn->io_mutex);
+
+                    if (!ok)
+                    {
+                        conn->closing = true;
+                        conn->io_cond->notify_all();
+                    }
+
+                    ready = conn->checkInput();
+                }
+
+                if (ready)
+                    enqueue(conn);
+            }
+
+            if (FD_ISSET(fd, &wr_set))
+            {
+                lock_guard<mutex> lock(*conn->io_mutex);
+                conn->flushOutput();
+                conn->io_cond->notify_all();
+            }
+        }
     }
 }
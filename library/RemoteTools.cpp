@@ -649,6 +649,7 @@ static command_result SetUnitLabors(color_ostream &stream, const SetUnitLaborsIn
 
 CoreService::CoreService() {
     suspend_depth = 0;
+    in_batch = false;
 
     // These 2 methods must be first, so that they get id 0 and 1
     addMethod("BindMethod", &CoreService::BindMethod, SF_DONT_SUSPEND);
@@ -659,6 +660,7 @@ CoreService::CoreService() {
     addMethod("CoreResume", &CoreService::CoreResume, SF_DONT_SUSPEND);
 
     addMethod("RunLua", &CoreService::RunLua);
+    addMethod("RunBatch", &CoreService::RunBatch, SF_DONT_SUSPEND);
 
     // Functions:
     addFunction("GetVersion", GetVersion, SF_DONT_SUSPEND);
@@ -678,7 +680,12 @@ CoreService::CoreService() {
 
 CoreService::~CoreService()
 {
-    while (suspend_depth-- > 0)
+    releaseSuspend();
+}
+
+void CoreService::releaseSuspend()
+{
+    for (; suspend_depth > 0; suspend_depth--)
         Core::getInstance().Resume();
 }
 
@@ -735,6 +742,80 @@ command_result CoreService::CoreResume(color_ostream &stream, const EmptyMessage
     return CR_OK;
 }
 
+command_result CoreService::RunBatch(color_ostream &stream,
+                                     const dfproto::CoreBatchRequest *in,
+                                     dfproto::CoreBatchReply *out)
+{
+    if (in_batch)
+    {
+        stream.printerr("RunBatch cannot be nested.\n");
+        return CR_WRONG_USAGE;
+    }
+
+    in_batch = true;
+
+    // Consecutive calls that would each suspend the core share one suspend.
+    Core &core = Core::getInstance();
+    std::string old_owner = core.setSuspendOwner("rpc:RunBatch");
+    CoreSuspender *suspend = NULL;
+
+    // Parsing into RunBatch itself would overwrite the request being run,
+    // and the suspend calls would fight with the batch's own suspend.
+    ServerFunctionBase *fn_batch = getFunction("RunBatch");
+    ServerFunctionBase *fn_suspend = getFunction("CoreSuspend");
+    ServerFunctionBase *fn_resume = getFunction("CoreResume");
+
+    for (int i = 0; i < in->calls_size(); i++)
+    {
+        auto &call = in->calls(i);
+        auto result = out->add_results();
+        ServerFunctionBase *fn = connection()->getFunction(call.id());
+
+        if (!fn)
+        {
+            stream.printerr("RPC call of invalid id %d in batch\n", call.id());
+            result->set_code(CR_NOT_FOUND);
+            continue;
+        }
+
+        if (fn == fn_batch || fn == fn_suspend || fn == fn_resume)
+        {
+            stream.printerr("%s cannot be called in a batch.\n", fn->name);
+            result->set_code(CR_WRONG_USAGE);
+            continue;
+        }
+
+        if (!fn->in()->ParseFromString(call.input()))
+        {
+            stream.printerr("In call to %s: could not decode input args.\n", fn->name);
+            result->set_code(CR_FAILURE);
+            continue;
+        }
+
+        if (fn->flags & SF_DONT_SUSPEND)
+        {
+            delete suspend;
+            suspend = NULL;
+        }
+        else if (!suspend)
+            suspend = new CoreSuspender(&core);
+
+        command_result res = fn->execute(stream);
+
+        result->set_code(res);
+        if (res == CR_OK)
+            result->set_output(fn->out()->SerializeAsString());
+
+        fn->reset((fn->flags & SF_CALLED_ONCE) != 0);
+    }
+
+    delete suspend;
+    core.setSuspendOwner(old_owner);
+    in_batch = false;
+
+    return CR_OK;
+}
+
 namespace {
     struct LuaFunctionData {
         command_result rv;
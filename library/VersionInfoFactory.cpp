@@ -29,8 +29,13 @@ distribution.
 #include <algorithm>
 #include <map>
 #include <iostream>
+#include <cstdio>
+#include <cstring>
 using namespace std;
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include "VersionInfoFactory.h"
 #include "VersionInfo.h"
 #include "Error.h"
@@ -56,6 +61,7 @@ void VersionInfoFactory::clear()
         delete versions[i];
     }
     versions.clear();
+    cached_tables.clear();
     error = false;
 }
 
@@ -64,7 +70,7 @@ VersionInfo * VersionInfoFactory::getVersionInfoByMD5(string hash)
     for(size_t i = 0; i < versions.size();i++)
     {
         if(versions[i]->hasMD5(hash))
-            return versions[i];
+            return loadCachedSymbols(i) ? versions[i] : 0;
     }
     return 0;
 }
@@ -74,11 +80,225 @@ VersionInfo * VersionInfoFactory::getVersionInfoByPETimestamp(uint32_t timestamp
     for(size_t i = 0; i < versions.size();i++)
     {
         if(versions[i]->hasPE(timestamp))
-            return versions[i];
+            return loadCachedSymbols(i) ? versions[i] : 0;
     }
     return 0;
 }
 
+/*
+ * Symbol table cache
+ *
+ * symbols.xml holds the symbols of every DF version, but only one of them is
+ * ever used. The parsed tables are saved next to it in a binary file, which
+ * is used as long as the size and mtime of symbols.xml match its header:
+ *
+ *   header: magic, format, xml size, xml mtime, table count
+ *   index:  per table name, OS, base, md5 hashes, PE timestamps,
+ *           and the offset and size of its symbols
+ *   tables: addresses, then vtables, as (name, value) pairs
+ *
+ * Loading the cache only reads the header and the index. The symbols of a
+ * table are read from the file when its version is looked up.
+ */
+static const uint32_t SYMBOL_CACHE_MAGIC = 0x53484644; // "DFHS"
+static const uint32_t SYMBOL_CACHE_FORMAT = 1;
+
+namespace {
+    struct CacheWriter
+    {
+        std::string data;
+
+        void u32(uint32_t v) { data.append((const char*)&v, sizeof(v)); }
+        void i64(int64_t v) { data.append((const char*)&v, sizeof(v)); }
+        void str(const std::string &s)
+        {
+            uint16_t len = (uint16_t)std::min<size_t>(s.size(), 0xFFFF);
+            data.append((const char*)&len, sizeof(len));
+            data.append(s.data(), len);
+        }
+        void symbols(const std::map<std::string, uint32_t> &syms)
+        {
+            u32(syms.size());
+            for (auto it = syms.begin(); it != syms.end(); ++it)
+            {
+                str(it->first);
+                u32(it->second);
+            }
+        }
+    };
+
+    struct CacheReader
+    {
+        const char *pos, *end;
+        bool ok;
+
+        CacheReader(const char *data, size_t size) : pos(data), end(data + size), ok(true) {}
+
+        bool raw(void *out, size_t size)
+        {
+            if (!ok || size_t(end - pos) < size)
+                return ok = false;
+            memcpy(out, pos, size);
+            pos += size;
+            return true;
+        }
+        uint32_t u32() { uint32_t v = 0; raw(&v, sizeof(v)); return v; }
+        int64_t i64() { int64_t v = 0; raw(&v, sizeof(v)); return v; }
+        std::string str()
+        {
+            uint16_t len = 0;
+            if (!raw(&len, sizeof(len)) || size_t(end - pos) < len)
+            {
+                ok = false;
+                return std::string();
+            }
+            std::string s(pos, len);
+            pos += len;
+            return s;
+        }
+        bool symbols(std::map<std::string, uint32_t> &syms)
+        {
+            uint32_t count = u32();
+            for (uint32_t i = 0; ok && i < count; i++)
+            {
+                std::string key = str();
+                syms[key] = u32();
+            }
+            return ok;
+        }
+    };
+}
+
+static bool readFileRange(const std::string &path, uint32_t offset, uint32_t size, std::string &out)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    out.resize(size);
+    bool ok = fseek(f, offset, SEEK_SET) == 0 &&
+              (size == 0 || fread(&out[0], 1, size, f) == size);
+    fclose(f);
+    return ok;
+}
+
+bool VersionInfoFactory::loadCache(const std::string &path_to_cache, int64_t xml_size, int64_t xml_mtime)
+{
+    std::string header;
+    const size_t header_size = 4 * sizeof(uint32_t) + 2 * sizeof(int64_t);
+    if (!readFileRange(path_to_cache, 0, header_size, header))
+        return false;
+
+    CacheReader hr(header.data(), header.size());
+    if (hr.u32() != SYMBOL_CACHE_MAGIC || hr.u32() != SYMBOL_CACHE_FORMAT ||
+        hr.i64() != xml_size || hr.i64() != xml_mtime || !hr.ok)
+        return false;
+    uint32_t count = hr.u32();
+    uint32_t index_size = hr.u32();
+
+    std::string index;
+    if (!readFileRange(path_to_cache, header_size, index_size, index))
+        return false;
+
+    clear();
+    CacheReader r(index.data(), index.size());
+    for (uint32_t i = 0; r.ok && i < count; i++)
+    {
+        VersionInfo *version = new VersionInfo();
+        version->setVersion(r.str());
+        version->setOS((OSType)r.u32());
+        version->setBase(r.u32());
+        uint32_t md5_count = r.u32();
+        for (uint32_t j = 0; r.ok && j < md5_count; j++)
+            version->addMD5(r.str());
+        uint32_t pe_count = r.u32();
+        for (uint32_t j = 0; r.ok && j < pe_count; j++)
+            version->addPE(r.u32());
+        CachedTable table;
+        table.offset = header_size + index_size + r.u32();
+        table.size = r.u32();
+        versions.push_back(version);
+        cached_tables.push_back(table);
+    }
+
+    if (!r.ok)
+    {
+        clear();
+        return false;
+    }
+    cache_path = path_to_cache;
+    return true;
+}
+
+void VersionInfoFactory::saveCache(const std::string &path_to_cache, int64_t xml_size, int64_t xml_mtime)
+{
+    CacheWriter index, tables;
+    for (size_t i = 0; i < versions.size(); i++)
+    {
+        VersionInfo *version = versions[i];
+        index.str(version->version);
+        index.u32(version->OS);
+        index.u32(version->base);
+        index.u32(version->md5_list.size());
+        for (size_t j = 0; j < version->md5_list.size(); j++)
+            index.str(version->md5_list[j]);
+        index.u32(version->PE_list.size());
+        for (size_t j = 0; j < version->PE_list.size(); j++)
+            index.u32(version->PE_list[j]);
+
+        size_t start = tables.data.size();
+        tables.symbols(version->Addresses);
+        tables.symbols(version->VTables);
+        index.u32(start);
+        index.u32(tables.data.size() - start);
+    }
+
+    CacheWriter header;
+    header.u32(SYMBOL_CACHE_MAGIC);
+    header.u32(SYMBOL_CACHE_FORMAT);
+    header.i64(xml_size);
+    header.i64(xml_mtime);
+    header.u32(versions.size());
+    header.u32(index.data.size());
+
+    // write to a temporary file, so that a partial write is never used
+    std::string tmp_path = path_to_cache + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "wb");
+    if (!f)
+        return;
+    bool ok = fwrite(header.data.data(), 1, header.data.size(), f) == header.data.size() &&
+              fwrite(index.data.data(), 1, index.data.size(), f) == index.data.size() &&
+              fwrite(tables.data.data(), 1, tables.data.size(), f) == tables.data.size();
+    ok = (fclose(f) == 0) && ok;
+    remove(path_to_cache.c_str());
+    if (!ok || rename(tmp_path.c_str(), path_to_cache.c_str()) != 0)
+        remove(tmp_path.c_str());
+}
+
+bool VersionInfoFactory::loadCachedSymbols(size_t index)
+{
+    if (index >= cached_tables.size() || !cached_tables[index].offset)
+        return true;
+
+    CachedTable &table = cached_tables[index];
+    VersionInfo *version = versions[index];
+    std::string data;
+    if (!readFileRange(cache_path, table.offset, table.size, data))
+    {
+        cerr << "Could not read symbols of " << version->getVersion()
+             << " from " << cache_path << endl;
+        return false;
+    }
+
+    CacheReader r(data.data(), data.size());
+    if (!r.symbols(version->Addresses) || !r.symbols(version->VTables))
+    {
+        cerr << "Corrupt symbol cache " << cache_path << endl;
+        return false;
+    }
+    table.offset = 0;
+    return true;
+}
+
 void VersionInfoFactory::ParseVersion (TiXmlElement* entry, VersionInfo* mem)
 {
     TiXmlElement* pMemEntry;
@@ -162,6 +382,17 @@ void VersionInfoFactory::ParseVersion (TiXmlElement* entry, VersionInfo* mem)
 // load the XML file with offsets
 bool VersionInfoFactory::loadFile(string path_to_xml)
 {
+    string path_to_cache = path_to_xml + ".cache";
+    struct stat xml_stat;
+    bool have_stat = (stat(path_to_xml.c_str(), &xml_stat) == 0);
+    if (have_stat && loadCache(path_to_cache, xml_stat.st_size, xml_stat.st_mtime))
+    {
+        std::cerr << "Loaded " << versions.size() << " DF symbol tables from "
+                  << path_to_cache << "." << std::endl;
+        error = false;
+        return true;
+    }
+
     TiXmlDocument doc( path_to_xml.c_str() );
     std::cerr << "Loading " << path_to_xml << " ... ";
     //bool loadOkay = doc.LoadFile();
@@ -215,5 +446,7 @@ bool VersionInfoFactory::loadFile(string path_to_xml)
     }
     error = false;
     std::cerr << "Loaded " << versions.size() << " DF symbol tables." << std::endl;
+    if (have_stat)
+        saveCache(path_to_cache, xml_stat.st_size, xml_stat.st_mtime);
     return true;
 }
@@ -154,6 +154,9 @@ namespace  DFHack
         //void beep (void);
         /// A simple line edit (raw mode)
         int lineedit(const std::string& prompt, std::string& output, CommandHistory & history );
+        /// Mirror console output to a file, rotated once it grows past max_size
+        /// bytes (0 = never), keeping that many old copies. An empty path stops it.
+        bool setLogFile(const std::string &path, size_t max_size, int backups);
         bool isInited (void) { return inited; };
 
         bool is_console() { return true; }
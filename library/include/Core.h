@@ -116,6 +116,9 @@ namespace DFHack
         void Suspend(void);
         /// return activity lock
         void Resume(void);
+        /// attribute suspends made by the calling thread to a tool in suspend-stats.
+        /// returns the previous attribution, which the caller should restore.
+        std::string setSuspendOwner(const std::string &owner);
         /// Is everything OK?
         bool isValid(void) { return !errorstate; }
 
@@ -196,6 +199,13 @@ namespace DFHack
         bool errorstate;
         // regulate access to DF
         struct Cond;
+        void printSuspendStats(color_ostream &out);
+        void resetSuspendStats();
+        void printPluginProfile(color_ostream &out);
+        // time spent in each step of Init, in order
+        std::vector<std::pair<std::string, uint64_t> > startup_phases;
+        void addStartupPhase(const char *name, uint64_t &start);
+        void printStartupProfile(color_ostream &out);
 
         // FIXME: shouldn't be kept around like this
         DFHack::VersionInfoFactory * vif;
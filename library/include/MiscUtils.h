@@ -29,6 +29,8 @@ distribution.
 #include <climits>
 #include <stdint.h>
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include <sstream>
 #include <cstdio>
 
@@ -120,6 +122,59 @@ int linear_index(const std::vector<CT*> &vec, FT CT::*field, FT key)
     return -1;
 }
 
+/*
+ * Hash table from a string field of the objects in an array to their
+ * index, for repeated token lookups in the raws. It is rebuilt on lookup
+ * if the array has changed size; owners call clear() when the array may
+ * have been replaced, e.g. on world unload. The first of several objects
+ * with the same token wins, as with linear_index. NULL entries are skipped.
+ */
+class token_index {
+    bool valid;
+    size_t size;
+    std::unordered_map<std::string, int> table;
+
+    template <typename CT>
+    void rebuild(CT *const *data, size_t count, std::string CT::*field)
+    {
+        table.clear();
+        for (size_t i = count; i-- > 0; )
+            if (data[i])
+                table[data[i]->*field] = (int)i;
+        size = count;
+        valid = true;
+    }
+
+public:
+    token_index() : valid(false), size(0) {}
+
+    void clear() { valid = false; table.clear(); }
+
+    template <typename CT>
+    int find(CT *const *data, size_t count, std::string CT::*field, const std::string &key)
+    {
+        if (!valid || size != count)
+            rebuild(data, count, field);
+
+        auto it = table.find(key);
+        if (it == table.end())
+            return -1;
+        if (data[it->second] && data[it->second]->*field == key)
+            return it->second;
+
+        // Objects were renamed or reordered behind our back
+        rebuild(data, count, field);
+        it = table.find(key);
+        return (it != table.end()) ? it->second : -1;
+    }
+
+    template <typename CT>
+    int find(const std::vector<CT*> &vec, std::string CT::*field, const std::string &key)
+    {
+        return find(vec.data(), vec.size(), field, key);
+    }
+};
+
 template <typename CT, typename FT>
 int binsearch_index(const std::vector<CT*> &vec, FT CT::*field, FT key, bool exact = true)
 {
@@ -342,6 +397,11 @@ DFHACK_EXPORT int random_int(int max);
  */
 DFHACK_EXPORT uint64_t GetTimeMs64();
 
+/**
+ * Same as GetTimeMs64, but in microseconds. Meant for measuring short intervals.
+ */
+DFHACK_EXPORT uint64_t GetTimeUs64();
+
 DFHACK_EXPORT std::string stl_sprintf(const char *fmt, ...);
 DFHACK_EXPORT std::string stl_vsprintf(const char *fmt, va_list args);
 
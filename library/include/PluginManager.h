@@ -119,6 +119,27 @@ namespace DFHack
         command_hotkey_guard guard;
         std::string usage;
     };
+    /// Distribution of the time a plugin spends in plugin_onupdate, per frame.
+    struct DFHACK_EXPORT PluginUpdateProfile
+    {
+        // Durations in microseconds: exact below 8, then 4 buckets per power of 2.
+        static const int NUM_BUCKETS = 88;
+
+        uint64_t calls;
+        uint64_t total_us;
+        uint64_t max_us;
+        uint32_t buckets[NUM_BUCKETS];
+
+        PluginUpdateProfile() { reset(); }
+
+        void reset();
+        void add(uint64_t us);
+
+        double mean() const { return calls ? double(total_us) / calls : 0.0; }
+        /// Upper bound of the bucket holding the given fraction of calls, e.g. 0.99
+        uint64_t percentile(double fraction) const;
+    };
+
     class Plugin
     {
         struct RefLock;
@@ -170,6 +191,16 @@ namespace DFHack
 
         void open_lua(lua_State *state, int table);
 
+        bool has_update_hook() { return plugin_onupdate != 0; }
+        const PluginUpdateProfile &getUpdateProfile() const { return update_profile; }
+
+        /// Deferred plugins list their commands from the manifest, but are
+        /// only loaded when something needs them.
+        bool is_deferred() const { return deferred; }
+        bool load_deferred(color_ostream &out);
+        /// Time taken by the last load, including plugin_init.
+        uint64_t getLoadTime() const { return load_us; }
+
         command_result eval_ruby(color_ostream &out, const char* cmd) {
             if (!plugin_eval_ruby || !is_enabled())
                 return CR_FAILURE;
@@ -178,6 +209,9 @@ namespace DFHack
 
     private:
         RefLock * access;
+        PluginUpdateProfile update_profile;
+        bool deferred;
+        uint64_t load_us;
         std::vector <PluginCommand> commands;
         std::vector <RPCService*> services;
         std::string filename;
@@ -205,6 +239,7 @@ namespace DFHack
         void reset_lua();
 
         bool *plugin_is_enabled;
+        bool *plugin_lazy_load;
         command_result (*plugin_init)(color_ostream &, std::vector <PluginCommand> &);
         command_result (*plugin_status)(color_ostream &, std::string &);
         command_result (*plugin_shutdown)(color_ostream &);
@@ -226,8 +261,19 @@ namespace DFHack
         void OnStateChange(color_ostream &out, state_change_event event);
         void registerCommands( Plugin * p );
         void unregisterCommands( Plugin * p );
+        void updateDispatchList();
+        void loadManifest(const std::string &file);
+        void saveManifest(const std::string &file);
     // PUBLIC METHODS
     public:
+        /// Set DFHACK_LAZY_PLUGINS to defer loading plugins without hooks.
+        bool isLazyLoading() { return lazy_loading; }
+
+        /// Per-plugin plugin_onupdate timing, off by default.
+        bool isProfilingUpdates() { return profile_updates; }
+        void setProfilingUpdates(bool enable);
+        void resetUpdateProfiles();
+
         Plugin *getPluginByName (const std::string & name);
         Plugin *getPluginByCommand (const std::string &command);
         command_result InvokeCommand(color_ostream &out, const std::string & command, std::vector <std::string> & parameters);
@@ -248,6 +294,12 @@ namespace DFHack
         tthread::mutex * cmdlist_mutex;
         std::map <std::string, Plugin *> belongs;
         std::vector <Plugin *> all_plugins;
+        // loaded plugins that have plugin_onupdate, called each frame
+        std::vector <Plugin *> update_plugins;
+        bool profile_updates;
+        bool lazy_loading;
+        struct ManifestEntry;
+        std::map <std::string, ManifestEntry *> manifest;
         std::string plugin_path;
     };
 
@@ -270,6 +322,11 @@ namespace DFHack
     DFhackDataExport bool plugin_is_enabled = false; \
     bool &varname = plugin_is_enabled;
 
+/// Allows DFHACK_LAZY_PLUGINS to defer loading the plugin until one of its
+/// commands is used. Only for plugins whose plugin_init just registers commands.
+#define DFHACK_PLUGIN_LAZY_LOAD \
+    DFhackDataExport bool plugin_lazy_load = true;
+
 #define DFHACK_PLUGIN_LUA_COMMANDS \
     DFhackCExport const DFHack::CommandReg plugin_lua_commands[] =
 #define DFHACK_PLUGIN_LUA_FUNCTIONS \
@@ -102,6 +102,11 @@ namespace  DFHack
      *   of the function if it succeeded, or RPC_REPLY_FAIL with the
      *   error code if it did not.
      *
+     *   Calls are processed strictly in order, so a client may send
+     *   several requests before reading the replies. The RunBatch
+     *   method goes further and executes a list of calls in one
+     *   message, sharing a single core suspend between them.
+     *
      * 3. Disconnect
      *
      *   The client terminates the connection by sending an
@@ -110,6 +115,7 @@ namespace  DFHack
      */
 
     class DFHACK_EXPORT RemoteClient;
+    class DFHACK_EXPORT RemoteBatch;
 
     class DFHACK_EXPORT RPCFunctionBase {
     public:
@@ -159,6 +165,7 @@ namespace  DFHack
 
     protected:
         friend class RemoteClient;
+        friend class RemoteBatch;
 
         RemoteFunctionBase(const message_type *in, const message_type *out)
             : RPCFunctionBase(in, out), p_client(NULL), id(-1)
@@ -225,6 +232,7 @@ namespace  DFHack
     class DFHACK_EXPORT RemoteClient
     {
         friend class RemoteFunctionBase;
+        friend class RemoteBatch;
 
         bool bind(color_ostream &out, RemoteFunctionBase *function,
                   const std::string &name, const std::string &proto);
@@ -261,6 +269,9 @@ namespace  DFHack
 
         bool suspend_ready;
         RemoteFunction<EmptyMessage, IntMessage> suspend_call, resume_call;
+
+        bool batch_ready;
+        RemoteFunction<dfproto::CoreBatchRequest, dfproto::CoreBatchReply> batch_call;
     };
 
     inline color_ostream &RemoteFunctionBase::default_ostream() {
@@ -272,6 +283,46 @@ namespace  DFHack
         return bind(client->default_output(), client, name, proto);
     }
 
+    /*
+     * Collects calls to bound functions and runs them in a single
+     * round trip. The server executes them in order under one core
+     * suspend; the results and outputs are filled in by execute().
+     */
+    class DFHACK_EXPORT RemoteBatch {
+    public:
+        typedef RPCFunctionBase::message_type message_type;
+
+        RemoteBatch(RemoteClient *client) : client(client) {}
+
+        void add(RemoteFunctionBase *function, const message_type *input, message_type *output);
+
+        template<typename In, typename Out>
+        void add(RemoteFunction<In,Out> &function) {
+            add(&function, function.in(), function.out());
+        }
+
+        size_t size() { return calls.size(); }
+        void clear() { calls.clear(); }
+
+        command_result execute() {
+            return client ? execute(client->default_output()) : CR_NOT_IMPLEMENTED;
+        }
+        command_result execute(color_ostream &out);
+
+        command_result result(size_t idx) { return calls[idx].result; }
+
+    private:
+        struct Call {
+            RemoteFunctionBase *function;
+            const message_type *input;
+            message_type *output;
+            command_result result;
+        };
+
+        RemoteClient *client;
+        std::vector<Call> calls;
+    };
+
     class RemoteSuspender {
         RemoteClient *client;
     public:
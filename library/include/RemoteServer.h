@@ -28,6 +28,8 @@ distribution.
 #include "RemoteClient.h"
 #include "Core.h"
 
+#include <deque>
+
 class CPassiveSocket;
 class CActiveSocket;
 class CSimpleSocket;
@@ -218,6 +220,8 @@ namespace  DFHack
             connection_ostream(ServerConnection *owner) : owner(owner) {}
         };
 
+        friend class ServerMain;
+
         bool in_error;
         CActiveSocket *socket;
         connection_ostream stream;
@@ -227,15 +231,50 @@ namespace  DFHack
         CoreService *core_service;
         std::map<std::string, RPCService*> plugin_services;
 
-        tthread::thread *thread;
-        static void threadFn(void *);
-        void threadFn();
+        // State shared between the server I/O thread and the worker
+        // handling this connection; guarded by io_mutex.
+        tthread::mutex *io_mutex;
+        tthread::condition_variable *io_cond;
+
+        bool handshake_done;
+        bool busy;      // queued for or owned by a worker or the pinned thread
+        bool closing;   // no further requests will be handled
+
+        std::vector<uint8_t> in_buf;
+        std::string out_buf;
+        size_t out_pos;
+
+        size_t pendingOutput() { return out_buf.size() - out_pos; }
+
+        bool readInput();
+        bool checkInput();
+        bool requestReady();
+        void takeRequest(RPCMessageHeader *header, std::vector<uint8_t> *data);
+        bool flushOutput();
+
+        bool queueData(const void *data, size_t size);
+        bool queueMessage(int16_t id, const ::google::protobuf::MessageLite *msg, bool size_ready);
+
+        // Thread of its own serving the connection while it holds CoreSuspend,
+        // so the client does not tie up a pool worker; owned by whoever has busy set.
+        tthread::thread *pinned;
+        int16_t suspend_id;
+
+        bool suspendRequested();
+        static void pinnedFn(void *);
+
+        bool process(bool is_pinned);
+        void handleCall(const RPCMessageHeader &header, std::vector<uint8_t> &data);
 
     public:
         ServerConnection(CActiveSocket *socket);
         ~ServerConnection();
 
         ServerFunctionBase *findFunction(color_ostream &out, const std::string &plugin, const std::string &name);
+
+        ServerFunctionBase *getFunction(int id) {
+            return (id >= 0 && size_t(id) < functions.size()) ? functions[id] : NULL;
+        }
     };
 
     class ServerMain {
@@ -243,6 +282,21 @@ namespace  DFHack
 
         tthread::thread *thread;
         static void threadFn(void *);
+        void threadFn();
+
+        std::vector<ServerConnection*> connections;
+
+        // Worker pool executing the requests
+        tthread::mutex *queue_mutex;
+        tthread::condition_variable *queue_cond;
+        std::deque<ServerConnection*> queue;
+        std::vector<tthread::thread*> workers;
+
+        static void workerFn(void *);
+        void workerFn();
+        void enqueue(ServerConnection *conn);
+
+        void acceptClient();
     public:
         ServerMain();
         ~ServerMain();
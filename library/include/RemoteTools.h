@@ -139,6 +139,12 @@ namespace DFHack
         CoreService();
         ~CoreService();
 
+        // True while the client holds the core suspended via CoreSuspend.
+        // Suspends belong to a thread, so the connection must stay on it.
+        bool isSuspending() { return suspend_depth > 0; }
+        // Undo all outstanding CoreSuspend calls; must run on the same thread.
+        void releaseSuspend();
+
         command_result BindMethod(color_ostream &stream,
                                   const dfproto::CoreBindRequest *in,
                                   dfproto::CoreBindReply *out);
@@ -152,5 +158,12 @@ namespace DFHack
         command_result RunLua(color_ostream &stream,
                               const dfproto::CoreRunLuaRequest *in,
                               StringListMessage *out);
+
+        command_result RunBatch(color_ostream &stream,
+                                const dfproto::CoreBatchRequest *in,
+                                dfproto::CoreBatchReply *out);
+
+    private:
+        bool in_batch;
     };
 }
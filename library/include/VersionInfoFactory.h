@@ -27,6 +27,9 @@ distribution.
 
 #include "Pragma.h"
 #include "Export.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 class TiXmlElement;
 namespace DFHack
@@ -46,6 +49,14 @@ namespace DFHack
             void clear();
         private:
             void ParseVersion (TiXmlElement* version, VersionInfo* mem);
+            bool loadCache(const std::string &path_to_cache, int64_t xml_size, int64_t xml_mtime);
+            void saveCache(const std::string &path_to_cache, int64_t xml_size, int64_t xml_mtime);
+            bool loadCachedSymbols(size_t index);
             bool error;
+            // Versions loaded from the cache only get their name, OS and
+            // hashes; the symbols are read in when the version is looked up.
+            std::string cache_path;
+            struct CachedTable { uint32_t offset, size; };
+            std::vector<CachedTable> cached_tables;
     };
 }
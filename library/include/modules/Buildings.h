@@ -117,6 +117,19 @@ DFHACK_EXPORT df::building *findAtTile(df::coord pos);
  */
 DFHACK_EXPORT bool findCivzonesAt(std::vector<df::building_civzonest*> *pvec, df::coord pos);
 
+/**
+ * Find buildings and civzones whose bounding box overlaps the
+ * rectangle between p1 and p2 (inclusive) on level z, ordered by id.
+ */
+DFHACK_EXPORT bool findInRect(std::vector<df::building*> *pvec, df::coord2d p1, df::coord2d p2, int z);
+
+/**
+ * Find the building of the given type (any if NONE) on the same level
+ * whose bounding box is closest to pos, no more than max_dist tiles away.
+ */
+DFHACK_EXPORT df::building *findNearest(df::coord pos, int max_dist,
+                                        df::building_type type = df::building_type::NONE);
+
 /**
  * Allocates a building object using this type and position.
  */
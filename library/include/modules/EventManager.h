@@ -36,10 +36,18 @@ namespace DFHack {
             };
         }
 
+        /*
+         * A handler that is not due when an event is found gets it the next time it is due.
+         * Pointer payloads are then copies kept by the event manager: JOB_COMPLETED gets a
+         * cloned job, CONSTRUCTION, SYNDROME, INVENTORY_CHANGE, UNIT_ATTACK and INTERACTION
+         * get copies of their data, and changes made to them are not seen by the game.
+         * JOB_INITIATED is always delivered live: when any of its handlers is due, all of
+         * them run on that scan and get the game's own job, so they may modify it.
+         **/
         struct EventHandler {
             typedef void (*callback_t)(color_ostream&, void*); //called when the event happens
             callback_t eventHandler;
-            int32_t freq;
+            int32_t freq; //ticks between calls; events found in between are delivered together. for TICK, the absolute tick to fire on
 
             EventHandler(callback_t eventHandlerIn, int32_t freqIn): eventHandler(eventHandlerIn), freq(freqIn) {
             }
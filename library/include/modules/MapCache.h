@@ -625,5 +625,141 @@ private:
     std::map<df::coord2d, df::world_region_details*> region_details;
     std::map<DFCoord, Block *> blocks;
 };
+
+/*
+ * Incremental shortest path search over map tiles (Dijkstra, or A* when
+ * given a heuristic). Edge costs come from a callback, so the same search
+ * serves walking, digging or any other movement model.
+ *
+ * Costs and parents are kept in dense 16x16 arrays for each map block the
+ * search touches, and the open set is a binary heap. run() can be given a
+ * node or time budget and called again on later frames to continue.
+ */
+class DFHACK_EXPORT PathSearch
+{
+public:
+    typedef int64_t cost_t;
+    /// Cost of stepping from a tile to an adjacent one, or negative if impossible.
+    typedef cost_t (*EdgeCostFn)(void *data, df::coord from, df::coord to);
+    /// Estimate of the remaining cost to the nearest goal. It must never
+    /// overestimate, and must not drop by more than an edge cost per step.
+    typedef cost_t (*HeuristicFn)(void *data, df::coord pos);
+
+    enum Status {
+        IDLE,       // no sources
+        RUNNING,    // budget ran out, call run() again to continue
+        FOUND,      // a goal was reached; see foundGoal()
+        EXHAUSTED   // every reachable tile was visited without reaching a goal
+    };
+
+    PathSearch(EdgeCostFn edge_cost, void *data = NULL, HeuristicFn heuristic = NULL);
+    ~PathSearch();
+
+    /// Drops all search state, keeping the callbacks.
+    void clear();
+    void setData(void *data) { this->data = data; }
+
+    void addSource(df::coord pos, cost_t cost = 0);
+    void addGoal(df::coord pos);
+
+    /// Expands at most max_nodes tiles and spends at most max_us microseconds;
+    /// zero means unlimited.
+    Status run(int max_nodes = 0, uint64_t max_us = 0);
+    Status status() { return state; }
+
+    df::coord foundGoal() { return goal; }
+    /// Best known cost to the tile, or -1 if not reached yet.
+    cost_t getCost(df::coord pos);
+    bool isClosed(df::coord pos);
+    /// The tile the best path to pos came from; false for sources and unreached tiles.
+    bool getParent(df::coord pos, df::coord *parent);
+    /// Tiles from the source to pos inclusive; false if pos was not reached.
+    bool getPath(df::coord pos, std::vector<df::coord> *path);
+
+    size_t closedCount() { return closed_count; }
+    size_t edgeCount() { return edge_count; }
+
+private:
+    struct BlockState;
+    struct HeapEntry {
+        cost_t key;
+        df::coord pos;
+        bool operator< (const HeapEntry &other) const { return key > other.key; }
+    };
+
+    BlockState *getBlock(df::coord pos, bool create);
+    void push(df::coord pos, cost_t cost);
+
+    EdgeCostFn edge_cost;
+    HeuristicFn heuristic;
+    void *data;
+
+    Status state;
+    df::coord goal;
+    size_t closed_count;
+    size_t edge_count;
+
+    int32_t x_bmax, y_bmax, z_max;
+    std::vector<int32_t> block_index;
+    std::vector<BlockState*> blocks;
+    std::vector<HeapEntry> heap;
+};
+
+/*
+ * Flood fill over a MapCache. Rows of matching tiles are filled as whole
+ * spans, and visited or rejected tiles are remembered in a pair of tile
+ * bitmasks per map block, so memory stays proportional to the blocks the
+ * region touches rather than to its tile count.
+ */
+class DFHACK_EXPORT FloodFill
+{
+public:
+    /// Whether the tile belongs to the region. Tiles outside the map are never tested.
+    typedef bool (*TestFn)(MapCache &mc, df::coord pos, void *data);
+    /// Whether the fill may move between vertically adjacent tiles of the region.
+    typedef bool (*StepFn)(MapCache &mc, df::coord from, df::coord to, void *data);
+    /// Called once for every tile of the region, span by span.
+    typedef void (*VisitFn)(MapCache &mc, df::coord pos, void *data);
+
+    enum Flags {
+        DIAGONAL = 1,   // 8-connected within a z level instead of 4-connected
+        UP = 2,
+        DOWN = 4,
+        VERTICAL = UP|DOWN
+    };
+
+    FloodFill(MapCache &mc, TestFn test, VisitFn visit, void *data = NULL, int flags = 0);
+    ~FloodFill();
+
+    /// Vertical moves are also subject to this check, if set.
+    void setStep(StepFn step) { this->step = step; }
+
+    /// Fills the region containing start and returns the number of tiles
+    /// visited. Tiles stay visited across calls, so several fills on the
+    /// same object never visit a tile twice.
+    size_t fill(df::coord start);
+
+    bool isVisited(df::coord pos);
+    /// Forgets visited and rejected tiles.
+    void clear();
+
+private:
+    struct BlockMask;
+
+    BlockMask *getMask(df::coord pos);
+    bool accept(df::coord pos);
+    void pushRow(df::coord from, int16_t x0, int16_t x1, int16_t y);
+
+    MapCache &mc;
+    TestFn test;
+    StepFn step;
+    VisitFn visit;
+    void *data;
+    int flags;
+
+    int32_t x_tmax, y_tmax, z_max;
+    std::vector<BlockMask*> masks;
+    std::vector<df::coord> seeds;
+};
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,113 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#pragma once
+#ifndef CL_MOD_MAPCENSUS
+#define CL_MOD_MAPCENSUS
+/*
+ * Counts of materials, liquids and features over the whole map
+ */
+#include "Export.h"
+#include <map>
+#include <stdint.h>
+
+/**
+ * \defgroup grp_mapcensus Map census
+ * @ingroup grp_modules
+ */
+namespace DFHack
+{
+namespace MapCensus
+{
+/// Number of tiles with some property, and the z levels they span.
+/// Levels are global (region) elevations, as the game shows them.
+struct DFHACK_EXPORT Count
+{
+    static const int invalid_z = -30000;
+
+    uint32_t count;
+    int lower_z;
+    int upper_z;
+
+    Count() : count(0), lower_z(invalid_z), upper_z(invalid_z) {}
+
+    void add(int z, uint32_t n = 1);
+    void merge(const Count &other);
+};
+
+typedef std::map<int32_t, Count> CountMap;
+
+struct Options
+{
+    /// Also count tiles that are not revealed yet
+    bool hidden;
+    /// Count shrubs and trees
+    bool plants;
+
+    Options() : hidden(false), plants(true) {}
+    bool operator== (const Options &other) const {
+        return hidden == other.hidden && plants == other.plants;
+    }
+};
+
+struct DFHACK_EXPORT Result
+{
+    /// Wall and fortification tiles, by df::tiletype_material
+    CountMap base;
+    /// Layer stone and soil by inorganic index, including slade
+    CountMap layer;
+    /// Vein minerals and tube walls by inorganic index
+    CountMap vein;
+    /// Plants by plant raw index
+    CountMap shrub;
+    CountMap tree;
+
+    Count water;
+    Count magma;
+    Count aquifer;
+    /// Open tiles inside adamantine tubes that are still unrevealed
+    Count tube;
+
+    bool has_lair;
+    bool has_demon_temple;
+
+    Result() : has_lair(false), has_demon_temple(false) {}
+
+    void merge(const Result &other);
+};
+
+/**
+ * Scans every map block, split across worker threads that each keep their
+ * own totals. Per-block counts are cached, and a block is only read again
+ * when its tiles, designations or plants have changed since the last scan
+ * with the same options. The core must be suspended.
+ * \ingroup grp_mapcensus
+ */
+DFHACK_EXPORT bool scan(Result *result, const Options &options = Options());
+
+/// Drops the per-block cache.
+DFHACK_EXPORT void clearCache();
+}
+}
+#endif
@@ -159,6 +159,8 @@ namespace DFHack
 
         // Store data in fake historical figure names.
         // This ensures that the values are stored in save games.
+        // Added items are moved into the figure vector at the end of
+        // the frame, in one batch.
         DFHACK_EXPORT PersistentDataItem AddPersistentData(const std::string &key);
         DFHACK_EXPORT PersistentDataItem GetPersistentData(const std::string &key);
         DFHACK_EXPORT PersistentDataItem GetPersistentData(int entry_id);
@@ -171,8 +173,15 @@ namespace DFHack
         // Items have alphabetic order by key; same key ordering is undefined.
         DFHACK_EXPORT void GetPersistentData(std::vector<PersistentDataItem> *vec,
                                              const std::string &key, bool prefix = false);
+        // Looks up the first item for each of the keys, in the same order.
+        // If add is true, missing keys are added; otherwise they, like any
+        // other failure, yield an item that is not isValid().
+        DFHACK_EXPORT void GetPersistentData(std::vector<PersistentDataItem> *vec,
+                                             const std::vector<std::string> &keys, bool add);
         // Deletes the item; returns true if success.
         DFHACK_EXPORT bool DeletePersistentData(const PersistentDataItem &item);
+        // Deletes all the items in one pass; returns the number deleted.
+        DFHACK_EXPORT int DeletePersistentData(const std::vector<PersistentDataItem> &items);
 
         DFHACK_EXPORT void ClearPersistentCache();
 
@@ -29,6 +29,7 @@ distribution.
 #include <cstdlib>
 #include <iostream>
 #include <map>
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -88,7 +89,138 @@ struct CoordHash {
     }
 };
 
-static unordered_map<df::coord, int32_t, CoordHash> locationToBuilding;
+/*
+ * Spatial index of building extents. Each z level is cut into cells of
+ * INDEX_CELL x INDEX_CELL tiles, and every building or zone is listed in
+ * the cells its bounding box overlaps. Entries are added and removed by
+ * updateBuildings from the BUILDING event; buildings created since the
+ * last event are picked up via building_next_id before each query, and
+ * ids of deleted ones are skipped when df::building::find fails.
+ */
+static const int INDEX_CELL = 16;
+
+struct IndexedBuilding {
+    df::coord p1, p2;
+};
+
+static unordered_map<int32_t, IndexedBuilding> indexedBuildings;
+static unordered_map<df::coord, vector<int32_t>, CoordHash> buildingCells;
+static int32_t indexNextId = -1;
+static size_t indexVecSize = 0;
+
+static df::coord indexCell(int x, int y, int z)
+{
+    return df::coord(max(x, 0) / INDEX_CELL, max(y, 0) / INDEX_CELL, z);
+}
+
+static void indexRemove(int32_t id)
+{
+    auto it = indexedBuildings.find(id);
+    if (it == indexedBuildings.end())
+        return;
+
+    df::coord c1 = indexCell(it->second.p1.x, it->second.p1.y, it->second.p1.z);
+    df::coord c2 = indexCell(it->second.p2.x, it->second.p2.y, it->second.p1.z);
+
+    for (int cx = c1.x; cx <= c2.x; cx++)
+    {
+        for (int cy = c1.y; cy <= c2.y; cy++)
+        {
+            auto cell = buildingCells.find(df::coord(cx, cy, c1.z));
+            if (cell == buildingCells.end())
+                continue;
+
+            auto &ids = cell->second;
+            ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+            if (ids.empty())
+                buildingCells.erase(cell);
+        }
+    }
+
+    indexedBuildings.erase(it);
+}
+
+static void indexAdd(df::building *bld)
+{
+    indexRemove(bld->id);
+
+    // Not placed on the map
+    if (bld->z < 0 || min(bld->x1, bld->x2) < 0 || min(bld->y1, bld->y2) < 0)
+        return;
+
+    IndexedBuilding &entry = indexedBuildings[bld->id];
+    entry.p1 = df::coord(min(bld->x1, bld->x2), min(bld->y1, bld->y2), bld->z);
+    entry.p2 = df::coord(max(bld->x1, bld->x2), max(bld->y1, bld->y2), bld->z);
+
+    df::coord c1 = indexCell(entry.p1.x, entry.p1.y, bld->z);
+    df::coord c2 = indexCell(entry.p2.x, entry.p2.y, bld->z);
+
+    for (int cx = c1.x; cx <= c2.x; cx++)
+        for (int cy = c1.y; cy <= c2.y; cy++)
+            buildingCells[df::coord(cx, cy, bld->z)].push_back(bld->id);
+}
+
+// Zones and stockpiles can be resized in place, keeping their id, so their
+// few entries are compared with the index on every lookup
+static void indexRefreshResized(df::buildings_other_id other)
+{
+    auto &vec = world->buildings.other[other];
+    for (size_t i = 0; i < vec.size(); i++)
+    {
+        df::building *bld = vec[i];
+        auto it = indexedBuildings.find(bld->id);
+        df::coord p1(min(bld->x1, bld->x2), min(bld->y1, bld->y2), bld->z);
+        df::coord p2(max(bld->x1, bld->x2), max(bld->y1, bld->y2), bld->z);
+
+        // missing ones are not placed yet, and are skipped again if still not
+        if (it == indexedBuildings.end() || it->second.p1 != p1 || it->second.p2 != p2)
+            indexAdd(bld);
+    }
+}
+
+static void indexSync()
+{
+    if (!world || !building_next_id)
+        return;
+
+    auto &vec = df::building::get_vector();
+    if (*building_next_id != indexNextId || vec.size() != indexVecSize)
+    {
+        // The vector is sorted by id, so new buildings are usually at the end.
+        // Ids handed out by allocInstance may reach the vector later and out of
+        // order, so rescan everything if the tail doesn't account for the growth.
+        size_t i = vec.size();
+        while (i > 0 && vec[i-1]->id >= indexNextId)
+            i--;
+        if (vec.size() > indexVecSize && vec.size() - i < vec.size() - indexVecSize)
+            i = 0;
+
+        for (; i < vec.size(); i++)
+        {
+            if (!indexedBuildings.count(vec[i]->id))
+                indexAdd(vec[i]);
+        }
+
+        // Only skip ids actually seen, not ones still waiting to be inserted
+        if (!vec.empty())
+            indexNextId = std::max(indexNextId, vec.back()->id + 1);
+        indexVecSize = vec.size();
+    }
+
+    indexRefreshResized(buildings_other_id::ACTIVITY_ZONE);
+    indexRefreshResized(buildings_other_id::STOCKPILE);
+}
+
+static bool compareBuildingId(df::building *a, df::building *b)
+{
+    return a->id < b->id;
+}
+
+static const vector<int32_t> *indexCellAt(df::coord pos)
+{
+    auto cell = buildingCells.find(indexCell(pos.x, pos.y, pos.z));
+    return (cell != buildingCells.end()) ? &cell->second : NULL;
+}
 
 static uint8_t *getExtentTile(df::building_extents &extent, df::coord2d tile)
 {
@@ -105,16 +237,48 @@ static uint8_t *getExtentTile(df::building_extents &extent, df::coord2d tile)
  * A monitor to work around this bug, in its application to buildings:
  *
  * http://www.bay12games.com/dwarves/mantisbt/view.php?id=1416
+ *
+ * Only construction jobs created through this module are watched: their
+ * buildings are tracked by id from constructWith*, plus whatever is
+ * pending in the job list when the map is loaded, and dropped once the
+ * job is gone or has no item filters left.
  */
 bool buildings_do_onupdate = false;
+static std::set<int32_t> constructingBuildings;
+
+static void trackConstruction(df::building *bld)
+{
+    constructingBuildings.insert(bld->id);
+    buildings_do_onupdate = true;
+}
+
+static df::job *getConstructJob(df::building *bld)
+{
+    for (size_t i = 0; i < bld->jobs.size(); i++)
+    {
+        df::job *job = bld->jobs[i];
+        if (job->job_type == job_type::ConstructBuilding)
+            return job;
+    }
+    return NULL;
+}
 
 void buildings_onStateChange(color_ostream &out, state_change_event event)
 {
     switch (event) {
     case SC_MAP_LOADED:
-        buildings_do_onupdate = true;
+        constructingBuildings.clear();
+        for (df::job_list_link *link = world->job_list.next; link; link = link->next)
+        {
+            df::job *job = link->item;
+            if (job->job_type != job_type::ConstructBuilding || job->job_items.empty())
+                continue;
+            if (auto bld = Job::getHolder(job))
+                trackConstruction(bld);
+        }
         break;
     case SC_MAP_UNLOADED:
+        constructingBuildings.clear();
         buildings_do_onupdate = false;
         break;
     default:
@@ -124,18 +288,17 @@ void buildings_onStateChange(color_ostream &out, state_change_event event)
 
 void buildings_onUpdate(color_ostream &out)
 {
-    buildings_do_onupdate = false;
-
-    df::job_list_link *link = world->job_list.next;
-    for (; link; link = link->next) {
-        df::job *job = link->item;
+    for (auto it = constructingBuildings.begin(); it != constructingBuildings.end(); )
+    {
+        auto bld = df::building::find(*it);
+        df::job *job = bld ? getConstructJob(bld) : NULL;
 
-        if (job->job_type != job_type::ConstructBuilding)
-            continue;
-        if (job->job_items.empty())
+        if (!job || job->job_items.empty())
+        {
+            constructingBuildings.erase(it++);
             continue;
-
-        buildings_do_onupdate = true;
+        }
+        ++it;
 
         for (size_t i = 0; i < job->items.size(); i++)
         {
@@ -151,6 +314,8 @@ void buildings_onUpdate(color_ostream &out)
             iref->job_item_idx = -1;
         }
     }
+
+    buildings_do_onupdate = !constructingBuildings.empty();
 }
 
 uint32_t Buildings::getNumBuildings()
@@ -249,17 +414,21 @@ df::building *Buildings::findAtTile(df::coord pos)
     if (!occ || !occ->bits.building)
         return NULL;
 
-    // Try cache lookup in case it works:
-    auto cached = locationToBuilding.find(pos);
-    if (cached != locationToBuilding.end())
-    {
-        auto building = df::building::find(cached->second);
+    // Try the index; it only misses buildings that moved since they were added
+    indexSync();
 
-        if (building && building->z == pos.z &&
-            building->isSettingOccupancy() &&
-            containsTile(building, pos, false))
+    if (auto ids = indexCellAt(pos))
+    {
+        for (size_t i = 0; i < ids->size(); i++)
         {
-            return building;
+            auto building = df::building::find((*ids)[i]);
+
+            if (building && building->z == pos.z &&
+                building->isSettingOccupancy() &&
+                containsTile(building, pos, false))
+            {
+                return building;
+            }
         }
     }
 
@@ -294,11 +463,15 @@ bool Buildings::findCivzonesAt(std::vector<df::building_civzonest*> *pvec, df::c
 {
     pvec->clear();
 
-    auto &vec = world->buildings.other[buildings_other_id::ANY_ZONE];
+    indexSync();
 
-    for (size_t i = 0; i < vec.size(); i++)
+    auto ids = indexCellAt(pos);
+    if (!ids)
+        return false;
+
+    for (size_t i = 0; i < ids->size(); i++)
     {
-        auto bld = strict_virtual_cast<df::building_civzonest>(vec[i]);
+        auto bld = strict_virtual_cast<df::building_civzonest>(df::building::find((*ids)[i]));
 
         if (!bld || bld->z != pos.z || !containsTile(bld, pos))
             continue;
@@ -306,9 +479,102 @@ bool Buildings::findCivzonesAt(std::vector<df::building_civzonest*> *pvec, df::c
         pvec->push_back(bld);
     }
 
+    std::sort(pvec->begin(), pvec->end(), compareBuildingId);
+
+    return !pvec->empty();
+}
+
+bool Buildings::findInRect(std::vector<df::building*> *pvec, df::coord2d p1, df::coord2d p2, int z)
+{
+    pvec->clear();
+
+    indexSync();
+
+    df::coord c1 = indexCell(min(p1.x, p2.x), min(p1.y, p2.y), z);
+    df::coord c2 = indexCell(max(p1.x, p2.x), max(p1.y, p2.y), z);
+
+    vector<int32_t> ids;
+    for (int cx = c1.x; cx <= c2.x; cx++)
+    {
+        for (int cy = c1.y; cy <= c2.y; cy++)
+        {
+            auto cell = buildingCells.find(df::coord(cx, cy, z));
+            if (cell != buildingCells.end())
+                ids.insert(ids.end(), cell->second.begin(), cell->second.end());
+        }
+    }
+
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        auto bld = df::building::find(ids[i]);
+
+        if (!bld || bld->z != z ||
+            max(bld->x1, bld->x2) < min(p1.x, p2.x) || min(bld->x1, bld->x2) > max(p1.x, p2.x) ||
+            max(bld->y1, bld->y2) < min(p1.y, p2.y) || min(bld->y1, bld->y2) > max(p1.y, p2.y))
+            continue;
+
+        pvec->push_back(bld);
+    }
+
     return !pvec->empty();
 }
 
+df::building *Buildings::findNearest(df::coord pos, int max_dist, df::building_type type)
+{
+    indexSync();
+
+    df::building *best = NULL;
+    int best_dist = max_dist + 1;
+
+    df::coord center = indexCell(pos.x, pos.y, pos.z);
+    int max_ring = max_dist / INDEX_CELL + 1;
+
+    for (int r = 0; r <= max_ring; r++)
+    {
+        // Every tile in ring r is at least this far away
+        if (r > 0 && (r - 1) * INDEX_CELL + 1 > best_dist)
+            break;
+
+        for (int cx = center.x - r; cx <= center.x + r; cx++)
+        {
+            for (int cy = center.y - r; cy <= center.y + r; cy++)
+            {
+                if (max(abs(cx - center.x), abs(cy - center.y)) != r)
+                    continue;
+
+                auto cell = buildingCells.find(df::coord(cx, cy, pos.z));
+                if (cell == buildingCells.end())
+                    continue;
+
+                auto &ids = cell->second;
+                for (size_t i = 0; i < ids.size(); i++)
+                {
+                    auto bld = df::building::find(ids[i]);
+                    if (!bld || bld->z != pos.z)
+                        continue;
+                    if (type != building_type::NONE && bld->getType() != type)
+                        continue;
+
+                    int dx = max(0, max(min(bld->x1, bld->x2) - pos.x, pos.x - max(bld->x1, bld->x2)));
+                    int dy = max(0, max(min(bld->y1, bld->y2) - pos.y, pos.y - max(bld->y1, bld->y2)));
+                    int dist = max(dx, dy);
+
+                    if (dist < best_dist || (dist == best_dist && best && bld->id < best->id))
+                    {
+                        best = bld;
+                        best_dist = dist;
+                    }
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
 df::building *Buildings::allocInstance(df::coord pos, df::building_type type, int subtype, int custom)
 {
     if (!building_next_id)
@@ -995,6 +1261,8 @@ bool Buildings::constructWithItems(df::building *bld, std::vector<df::item*> ite
             bld->mat_index = items[i]->getMaterialIndex();
     }
 
+    trackConstruction(bld);
+
     createDesign(bld, rough);
     return true;
 }
@@ -1039,7 +1307,7 @@ bool Buildings::constructWithFilters(df::building *bld, std::vector<df::job_item
             bld->mat_index = items[i]->mat_index;
     }
 
-    buildings_do_onupdate = true;
+    trackConstruction(bld);
 
     createDesign(bld, rough);
     return true;
@@ -1105,13 +1373,11 @@ bool Buildings::deconstruct(df::building *bld)
     return true;
 }
 
-static unordered_map<int32_t, df::coord> corner1;
-static unordered_map<int32_t, df::coord> corner2;
-
 void Buildings::clearBuildings(color_ostream& out) {
-    corner1.clear();
-    corner2.clear();
-    locationToBuilding.clear();
+    indexedBuildings.clear();
+    buildingCells.clear();
+    indexNextId = -1;
+    indexVecSize = 0;
 }
 
 void Buildings::updateBuildings(color_ostream& out, void* ptr)
@@ -1121,46 +1387,16 @@ void Buildings::updateBuildings(color_ostream& out, void* ptr)
 
     if (building)
     {
-        // Already cached -> weird, so bail out
-        if (corner1.count(id))
-            return;
-        // Civzones cannot be cached because they can
-        // overlap each other and normal buildings.
-        if (!building->isSettingOccupancy())
+        // Already picked up by indexSync
+        if (indexedBuildings.count(id))
             return;
 
-        df::coord p1(min(building->x1, building->x2), min(building->y1,building->y2), building->z);
-        df::coord p2(max(building->x1, building->x2), max(building->y1,building->y2), building->z);
-
-        corner1[id] = p1;
-        corner2[id] = p2;
-
-        for ( int32_t x = p1.x; x <= p2.x; x++ ) {
-            for ( int32_t y = p1.y; y <= p2.y; y++ ) {
-                df::coord pt(x,y,building->z);
-                if (containsTile(building, pt, false))
-                    locationToBuilding[pt] = id;
-            }
-        }
+        indexAdd(building);
     }
-    else if (corner1.count(id))
+    else
     {
         //existing building: destroy it
-        df::coord p1 = corner1[id];
-        df::coord p2 = corner2[id];
-
-        for ( int32_t x = p1.x; x <= p2.x; x++ ) {
-            for ( int32_t y = p1.y; y <= p2.y; y++ ) {
-                df::coord pt(x,y,p1.z);
-
-                auto cur = locationToBuilding.find(pt);
-                if (cur != locationToBuilding.end() && cur->second == id)
-                    locationToBuilding.erase(cur);
-            }
-        }
-
-        corner1.erase(id);
-        corner2.erase(id);
+        indexRemove(id);
     }
 }
 
@@ -23,6 +23,7 @@
 #include "df/item_crafted.h"
 #include "df/item_weaponst.h"
 #include "df/job.h"
+#include "df/job_item_ref.h"
 #include "df/job_list_link.h"
 #include "df/report.h"
 #include "df/ui.h"
@@ -56,12 +57,14 @@ static multimap<int32_t, EventHandler> tickQueue;
 
 //TODO: consider unordered_map of pairs, or unordered_map of unordered_set, or whatever
 static multimap<Plugin*, EventHandler> handlers[EventType::EVENT_MAX];
+static bool scheduleDirty[EventType::EVENT_MAX];
 static int32_t eventLastTick[EventType::EVENT_MAX];
 
 static const int32_t ticksPerYear = 403200;
 
 void DFHack::EventManager::registerListener(EventType::EventType e, EventHandler handler, Plugin* plugin) {
     handlers[e].insert(pair<Plugin*, EventHandler>(plugin, handler));
+    scheduleDirty[e] = true;
 }
 
 int32_t DFHack::EventManager::registerTick(EventHandler handler, int32_t when, Plugin* plugin, bool absolute) {
@@ -102,6 +105,7 @@ void DFHack::EventManager::unregister(EventType::EventType e, EventHandler handl
             continue;
         }
         i = handlers[e].erase(i);
+        scheduleDirty[e] = true;
         if ( e == EventType::TICK )
             removeFromTickQueue(handler);
     }
@@ -115,7 +119,8 @@ void DFHack::EventManager::unregisterAll(Plugin* plugin) {
         removeFromTickQueue((*i).second);
     }
     for ( size_t a = 0; a < (size_t)EventType::EVENT_MAX; a++ ) {
-        handlers[a].erase(plugin);
+        if ( handlers[a].erase(plugin) > 0 )
+            scheduleDirty[a] = true;
     }
     return;
 }
@@ -154,26 +159,319 @@ static const eventManager_t eventManager[] = {
     manageInteractionEvent,
 };
 
+/*
+ * Per-handler scheduling.
+ *
+ * Every non-tick handler has its own due tick. A collection scan for an event
+ * type runs only when at least one of its handlers is due, and then serves all
+ * handlers that are due on that tick. Events found while some handlers are
+ * still waiting are copied into a per-type backlog, which each handler drains
+ * the next time it is due, so a slow handler sees every event in one batch
+ * instead of forcing everyone else to run at its rate.
+ **/
+struct PendingEvent {
+    void* data;
+    void (*release)(void*);
+};
+
+struct Schedule {
+    Plugin* plugin;
+    EventHandler handler;
+    int32_t due;
+    size_t cursor; //absolute index of the next backlog entry to deliver
+    Schedule(Plugin* plugin_in, EventHandler handler_in, int32_t due_in, size_t cursor_in): plugin(plugin_in), handler(handler_in), due(due_in), cursor(cursor_in) {
+    }
+};
+
+static vector<Schedule> schedules[EventType::EVENT_MAX];
+static vector<size_t> dueNow[EventType::EVENT_MAX];
+static size_t waiting[EventType::EVENT_MAX];
+static int32_t nextDue[EventType::EVENT_MAX];
+static vector<PendingEvent> backlog[EventType::EVENT_MAX];
+static size_t backlogBase[EventType::EVENT_MAX];
+
+static PendingEvent keepValue(void* data) {
+    PendingEvent result = { data, NULL };
+    return result;
+}
+
+template<class T> static void releaseCopy(void* data) {
+    delete (T*)data;
+}
+
+template<class T> static PendingEvent keepCopy(void* data) {
+    PendingEvent result = { (void*)new T(*(T*)data), releaseCopy<T> };
+    return result;
+}
+
+static void releaseJob(void* data) {
+    Job::deleteJobStruct((df::job*)data, true);
+}
+
+static PendingEvent keepJob(void* data) {
+    PendingEvent result = { (void*)Job::cloneJobStruct((df::job*)data, true), releaseJob };
+    return result;
+}
+
+static void releaseInventoryChange(void* data) {
+    InventoryChangeData* change = (InventoryChangeData*)data;
+    delete change->item_old;
+    delete change->item_new;
+    delete change;
+}
+
+static PendingEvent keepInventoryChange(void* data) {
+    InventoryChangeData* change = (InventoryChangeData*)data;
+    InventoryChangeData* result = new InventoryChangeData(change->unitId,
+        change->item_old ? new InventoryItem(*change->item_old) : NULL,
+        change->item_new ? new InventoryItem(*change->item_new) : NULL);
+    PendingEvent pending = { (void*)result, releaseInventoryChange };
+    return pending;
+}
+
+typedef PendingEvent (*keeper_t)(void*);
+
+//how to keep each event's payload alive until a waiting handler is due
+static const keeper_t eventKeeper[] = {
+    keepValue, //TICK
+    keepValue, //JOB_INITIATED: never kept, see deliverLive
+    keepJob, //JOB_COMPLETED
+    keepValue, //UNIT_DEATH
+    keepValue, //ITEM_CREATED
+    keepValue, //BUILDING
+    keepCopy<df::construction>, //CONSTRUCTION
+    keepCopy<SyndromeData>, //SYNDROME
+    keepValue, //INVASION
+    keepInventoryChange, //INVENTORY_CHANGE
+    keepValue, //REPORT
+    keepCopy<UnitAttackData>, //UNIT_ATTACK
+    keepValue, //UNLOAD
+    keepCopy<InteractionData>, //INTERACTION
+};
+
+static void clearBacklog(size_t e) {
+    for ( size_t a = 0; a < backlog[e].size(); a++ ) {
+        if ( backlog[e][a].release )
+            backlog[e][a].release(backlog[e][a].data);
+    }
+    backlogBase[e] += backlog[e].size();
+    backlog[e].clear();
+}
+
+static void resetSchedules() {
+    for ( size_t e = 0; e < EventType::EVENT_MAX; e++ ) {
+        clearBacklog(e);
+        for ( size_t a = 0; a < schedules[e].size(); a++ ) {
+            schedules[e][a].due = -1;
+            schedules[e][a].cursor = backlogBase[e];
+        }
+        nextDue[e] = -1;
+    }
+}
+
+//resynchronize with handlers[e], keeping the state of handlers that are still registered
+static void rebuildSchedule(size_t e, int32_t tick) {
+    vector<Schedule> old;
+    old.swap(schedules[e]);
+    for ( auto a = handlers[e].begin(); a != handlers[e].end(); a++ ) {
+        Schedule s((*a).first, (*a).second, tick, backlogBase[e] + backlog[e].size());
+        for ( size_t b = 0; b < old.size(); b++ ) {
+            if ( old[b].plugin != s.plugin || old[b].handler != s.handler )
+                continue;
+            s = old[b];
+            old.erase(old.begin()+b);
+            break;
+        }
+        schedules[e].push_back(s);
+    }
+    if ( schedules[e].empty() )
+        clearBacklog(e);
+    nextDue[e] = tick;
+    scheduleDirty[e] = false;
+}
+
+//events whose handlers are expected to modify the live object; when any of
+//their handlers is due, all of them are run on the same scan
+static bool deliverLive(size_t e) {
+    return e == EventType::JOB_INITIATED;
+}
+
+//returns true if any handler of this type is due on this tick
+static bool collectDue(size_t e, int32_t tick) {
+    if ( tick < nextDue[e] && tick >= eventLastTick[e] )
+        return false;
+    dueNow[e].clear();
+    waiting[e] = 0;
+    for ( size_t a = 0; a < schedules[e].size(); a++ ) {
+        Schedule& s = schedules[e][a];
+        //a save may have been loaded with an earlier frame counter
+        if ( tick >= s.due || tick < s.due - s.handler.freq )
+            dueNow[e].push_back(a);
+        else
+            waiting[e]++;
+    }
+    if ( dueNow[e].empty() )
+        return false;
+    if ( deliverLive(e) && waiting[e] > 0 ) {
+        dueNow[e].clear();
+        for ( size_t a = 0; a < schedules[e].size(); a++ )
+            dueNow[e].push_back(a);
+        waiting[e] = 0;
+    }
+    return true;
+}
+
+static void dispatch(color_ostream& out, EventType::EventType e, void* data) {
+    for ( size_t a = 0; a < dueNow[e].size(); a++ ) {
+        EventHandler handle = schedules[e][dueNow[e][a]].handler;
+        handle.eventHandler(out, data);
+    }
+    if ( waiting[e] > 0 )
+        backlog[e].push_back(eventKeeper[e](data));
+}
+
+//deliver what due handlers missed while they were waiting
+static void flushBacklog(color_ostream& out, size_t e) {
+    for ( size_t a = 0; a < dueNow[e].size(); a++ ) {
+        Schedule& s = schedules[e][dueNow[e][a]];
+        EventHandler handle = s.handler;
+        for ( size_t b = s.cursor - backlogBase[e]; b < backlog[e].size(); b++ ) {
+            handle.eventHandler(out, backlog[e][b].data);
+        }
+    }
+}
+
+static void finishDue(size_t e, int32_t tick) {
+    size_t end = backlogBase[e] + backlog[e].size();
+    for ( size_t a = 0; a < dueNow[e].size(); a++ ) {
+        Schedule& s = schedules[e][dueNow[e][a]];
+        s.due = tick + (s.handler.freq > 0 ? s.handler.freq : 1);
+        s.cursor = end;
+    }
+    dueNow[e].clear();
+    waiting[e] = 0;
+
+    size_t oldest = end;
+    nextDue[e] = -1;
+    for ( size_t a = 0; a < schedules[e].size(); a++ ) {
+        Schedule& s = schedules[e][a];
+        if ( s.cursor < oldest )
+            oldest = s.cursor;
+        if ( nextDue[e] == -1 || s.due < nextDue[e] )
+            nextDue[e] = s.due;
+    }
+    size_t drop = oldest - backlogBase[e];
+    if ( drop == 0 )
+        return;
+    for ( size_t a = 0; a < drop; a++ ) {
+        if ( backlog[e][a].release )
+            backlog[e][a].release(backlog[e][a].data);
+    }
+    backlog[e].erase(backlog[e].begin(), backlog[e].begin()+drop);
+    backlogBase[e] = oldest;
+}
+
+/*
+ * Shadow copy of an id-indexed world collection.
+ *
+ * The shadow is a vector of (key, value) pairs kept sorted by key. A check
+ * refills the scratch vector through begin()/add(), then diff() walks both
+ * sorted vectors once and reports each entry to the delta object as
+ *   added(key, now), removed(key, old) or kept(key, old, now).
+ * Whatever is left in 'now' becomes the new shadow value, so a delta can
+ * swap in a cached copy instead of the live object. The two vectors are
+ * swapped afterwards, so steady-state checks do not allocate.
+ **/
+template<typename Key, typename Value>
+class SnapshotDiff {
+public:
+    typedef pair<Key, Value> entry;
+
+    void begin() {
+        scratch.clear();
+    }
+    void add(const Key& key, const Value& value) {
+        scratch.push_back(entry(key, value));
+    }
+    std::vector<entry>& entries() {
+        return shadow;
+    }
+    size_t size() const {
+        return shadow.size();
+    }
+    void clear() {
+        shadow.clear();
+        scratch.clear();
+    }
+
+    //adopts the collected entries as the shadow without reporting anything
+    void load() {
+        sortScratch();
+        shadow.swap(scratch);
+        scratch.clear();
+    }
+
+    template<class Delta> void diff(Delta& delta) {
+        sortScratch();
+        size_t i = 0, j = 0;
+        while ( i < shadow.size() || j < scratch.size() ) {
+            if ( j == scratch.size() || (i < shadow.size() && shadow[i].first < scratch[j].first) ) {
+                delta.removed(shadow[i].first, shadow[i].second);
+                i++;
+            } else if ( i == shadow.size() || scratch[j].first < shadow[i].first ) {
+                delta.added(scratch[j].first, scratch[j].second);
+                j++;
+            } else {
+                delta.kept(shadow[i].first, shadow[i].second, scratch[j].second);
+                i++;
+                j++;
+            }
+        }
+        shadow.swap(scratch);
+        scratch.clear();
+    }
+
+private:
+    void sortScratch() {
+        //world vectors are nearly always in id order already
+        for ( size_t a = 1; a < scratch.size(); a++ ) {
+            if ( scratch[a].first < scratch[a-1].first ) {
+                std::stable_sort(scratch.begin(), scratch.end(), keyLess);
+                return;
+            }
+        }
+    }
+    static bool keyLess(const entry& a, const entry& b) {
+        return a.first < b.first;
+    }
+    std::vector<entry> shadow;
+    std::vector<entry> scratch;
+};
+
 //job initiated
 static int32_t lastJobId = -1;
 
 //job completed
-static unordered_map<int32_t, df::job*> prevJobs;
+static SnapshotDiff<int32_t, df::job*> prevJobs;
 
 //unit death
-static unordered_set<int32_t> livingUnits;
+static SnapshotDiff<int32_t, bool> unitsDead;
 
 //item creation
 static int32_t nextItem;
 
 //building
 static int32_t nextBuilding;
-static unordered_set<int32_t> buildings;
+static SnapshotDiff<int32_t, bool> buildings;
 
 //construction
-static unordered_map<df::coord, df::construction> constructions;
+static SnapshotDiff<int64_t, df::construction> constructions;
 static bool gameLoaded;
 
+static int64_t constructionKey(const df::coord& pos) {
+    return ((int64_t)(uint16_t)pos.z << 32) | ((int64_t)(uint16_t)pos.y << 16) | (int64_t)(uint16_t)pos.x;
+}
+
 //syndrome
 static int32_t lastSyndromeTime;
 
@@ -208,17 +506,18 @@ void DFHack::EventManager::onStateChange(color_ostream& out, state_change_event
     }
     if ( event == DFHack::SC_MAP_UNLOADED ) {
         lastJobId = -1;
-        for ( auto i = prevJobs.begin(); i != prevJobs.end(); i++ ) {
+        for ( auto i = prevJobs.entries().begin(); i != prevJobs.entries().end(); i++ ) {
             Job::deleteJobStruct((*i).second, true);
         }
         prevJobs.clear();
         tickQueue.clear();
-        livingUnits.clear();
+        unitsDead.clear();
         buildings.clear();
         constructions.clear();
         equipmentLog.clear();
 
         Buildings::clearBuildings(out);
+        resetSchedules();
         lastReport = -1;
         lastReportUnitAttack = -1;
         gameLoaded = false;
@@ -254,7 +553,7 @@ void DFHack::EventManager::onStateChange(color_ostream& out, state_change_event
         nextInvasion = df::global::ui->invasions.next_id;
         lastJobId = -1 + *df::global::job_next_id;
         
-        constructions.clear();
+        constructions.begin();
         for ( auto i = df::global::world->constructions.begin(); i != df::global::world->constructions.end(); i++ ) {
             df::construction* constr = *i;
             if ( !constr ) {
@@ -268,13 +567,16 @@ void DFHack::EventManager::onStateChange(color_ostream& out, state_change_event
                     out.print("EventManager.onLoad null position of construction.\n");
                 continue;
             }
-            constructions[constr->pos] = *constr;
+            constructions.add(constructionKey(constr->pos), *constr);
         }
+        constructions.load();
+        buildings.begin();
         for ( size_t a = 0; a < df::global::world->buildings.all.size(); a++ ) {
             df::building* b = df::global::world->buildings.all[a];
-            Buildings::updateBuildings(out, (void*)b);
-            buildings.insert(b->id);
+            Buildings::updateBuildings(out, (void*)b->id);
+            buildings.add(b->id, true);
         }
+        buildings.load();
         lastSyndromeTime = -1;
         for ( size_t a = 0; a < df::global::world->units.all.size(); a++ ) {
             df::unit* unit = df::global::world->units.all[a];
@@ -296,6 +598,7 @@ void DFHack::EventManager::onStateChange(color_ostream& out, state_change_event
         for ( size_t a = 0; a < EventType::EVENT_MAX; a++ ) {
             eventLastTick[a] = -1;//-1000000;
         }
+        resetSchedules();
         
         gameLoaded = true;
     }
@@ -313,21 +616,27 @@ void DFHack::EventManager::manageEvents(color_ostream& out) {
     int32_t tick = df::global::world->frame_counter;
 
     for ( size_t a = 0; a < EventType::EVENT_MAX; a++ ) {
+        if ( a == EventType::TICK ) {
+            //tick handlers keep their own queue, ordered by absolute tick
+            if ( !handlers[a].empty() && tick != eventLastTick[a] ) {
+                manageTickEvent(out);
+                eventLastTick[a] = tick;
+            }
+            continue;
+        }
+        if ( a == EventType::UNLOAD )
+            continue;
+        if ( scheduleDirty[a] )
+            rebuildSchedule(a, tick);
         if ( handlers[a].empty() )
             continue;
-        int32_t eventFrequency = -100;
-        if ( a != EventType::TICK )
-            for ( auto b = handlers[a].begin(); b != handlers[a].end(); b++ ) {
-                EventHandler bob = (*b).second;
-                if ( bob.freq < eventFrequency || eventFrequency == -100 )
-                    eventFrequency = bob.freq;
-            }
-        else eventFrequency = 1;
         
-        if ( tick >= eventLastTick[a] && tick - eventLastTick[a] < eventFrequency )
+        if ( !collectDue(a, tick) )
             continue;
         
+        flushBacklog(out, a);
         eventManager[a](out);
+        finishDue(a, tick);
         eventLastTick[a] = tick;
     }
 }
@@ -373,27 +682,96 @@ static void manageJobInitiatedEvent(color_ostream& out) {
     if ( lastJobId+1 == *df::global::job_next_id ) {
         return; //no new jobs
     }
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::JOB_INITIATED].begin(), handlers[EventType::JOB_INITIATED].end());
     
     for ( df::job_list_link* link = &df::global::world->job_list; link != NULL; link = link->next ) {
         if ( link->item == NULL )
             continue;
         if ( link->item->id <= lastJobId )
             continue;
-        for ( auto i = copy.begin(); i != copy.end(); i++ ) {
-            (*i).second.eventHandler(out, (void*)link->item);
-        }
+        dispatch(out, EventType::JOB_INITIATED, (void*)link->item);
     }
     
     lastJobId = *df::global::job_next_id - 1;
 }
 
-//helper function for manageJobCompletedEvent
-static int32_t getWorkerID(df::job* job) {
-    auto ref = findRef(job->general_refs, general_ref_type::UNIT_WORKER);
-    return ref ? ref->getID() : -1;
+static bool jobItemsChanged(df::job* job0, df::job* job1) {
+    if ( job0->items.size() != job1->items.size() )
+        return true;
+    for ( size_t a = 0; a < job0->items.size(); a++ ) {
+        if ( job0->items[a]->item != job1->items[a]->item || job0->items[a]->role != job1->items[a]->role )
+            return true;
+    }
+    return false;
+}
+
+static bool jobRefsChanged(df::job* job0, df::job* job1) {
+    if ( job0->general_refs.size() != job1->general_refs.size() )
+        return true;
+    for ( size_t a = 0; a < job0->general_refs.size(); a++ ) {
+        df::general_ref* ref0 = job0->general_refs[a];
+        df::general_ref* ref1 = job1->general_refs[a];
+        if ( ref0->getType() != ref1->getType() || ref0->getID() != ref1->getID() )
+            return true;
+    }
+    return false;
+}
+
+//the cloned copy of a job is only refreshed when one of these changes
+static bool jobChanged(df::job* job0, df::job* job1) {
+    //about to complete: the copy handed to JOB_COMPLETED must be current
+    if ( job1->completion_timer == 0 || job1->completion_timer == 1 )
+        return true;
+    return job0->completion_timer != job1->completion_timer ||
+        job0->flags.whole != job1->flags.whole ||
+        job0->job_type != job1->job_type ||
+        job0->mat_type != job1->mat_type ||
+        job0->mat_index != job1->mat_index ||
+        job0->pos != job1->pos ||
+        job0->reaction_name != job1->reaction_name ||
+        job0->job_items.size() != job1->job_items.size() ||
+        jobItemsChanged(job0, job1) ||
+        jobRefsChanged(job0, job1);
 }
 
+struct JobCompletedDelta {
+    color_ostream& out;
+    bool canComplete;
+
+    JobCompletedDelta(color_ostream& out_in, bool canComplete_in): out(out_in), canComplete(canComplete_in) {
+    }
+
+    void fire(df::job* job) {
+        dispatch(out, EventType::JOB_COMPLETED, (void*)job);
+    }
+
+    void added(int32_t id, df::job*& now) {
+        now = Job::cloneJobStruct(now, true);
+    }
+
+    void removed(int32_t id, df::job*& old) {
+        //recently finished or cancelled job
+        //if it happened within a tick, must have been cancelled by the user or a plugin: not completed
+        if ( canComplete && !old->flags.bits.repeat && old->completion_timer == 0 )
+            fire(old);
+        Job::deleteJobStruct(old, true);
+        old = NULL;
+    }
+
+    void kept(int32_t id, df::job*& old, df::job*& now) {
+        //could have just finished if it's a repeat job
+        //still false positive if cancelled at EXACTLY the right time, but experiments show this doesn't happen
+        if ( canComplete && old->flags.bits.repeat && old->completion_timer == 0 && now->completion_timer == -1 )
+            fire(old);
+        if ( jobChanged(old, now) ) {
+            Job::deleteJobStruct(old, true);
+            now = Job::cloneJobStruct(now, true);
+        } else {
+            now = old;
+        }
+        old = NULL;
+    }
+};
+
 /*
 TODO: consider checking item creation / experience gain just in case
 */
@@ -403,147 +781,46 @@ static void manageJobCompletedEvent(color_ostream& out) {
     int32_t tick0 = eventLastTick[EventType::JOB_COMPLETED];
     int32_t tick1 = df::global::world->frame_counter;
     
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::JOB_COMPLETED].begin(), handlers[EventType::JOB_COMPLETED].end());
-    map<int32_t, df::job*> nowJobs;
+    prevJobs.begin();
     for ( df::job_list_link* link = &df::global::world->job_list; link != NULL; link = link->next ) {
         if ( link->item == NULL )
             continue;
-        nowJobs[link->item->id] = link->item;
-    }
-    
-#if 0
-    //testing info on job initiation/completion
-    //newly allocated jobs
-    for ( auto j = nowJobs.begin(); j != nowJobs.end(); j++ ) {
-        if ( prevJobs.find((*j).first) != prevJobs.end() )
-            continue;
-        
-        df::job& job1 = *(*j).second;
-        out.print("new job\n"
-            "  location         : 0x%X\n"
-            "  id               : %d\n"
-            "  type             : %d %s\n"
-            "  working          : %d\n"
-            "  completion_timer : %d\n"
-            "  workerID         : %d\n"
-            "  time             : %d -> %d\n"
-            "\n", job1.list_link->item, job1.id, job1.job_type, ENUM_ATTR(job_type, caption, job1.job_type), job1.flags.bits.working, job1.completion_timer, getWorkerID(&job1), tick0, tick1);
-    }
-    for ( auto i = prevJobs.begin(); i != prevJobs.end(); i++ ) {
-        df::job& job0 = *(*i).second;
-        auto j = nowJobs.find((*i).first);
-        if ( j == nowJobs.end() ) {
-            out.print("job deallocated\n"
-                "  location         : 0x%X\n"
-                "  id               : %d\n"
-                "  type             : %d %s\n"
-                "  working          : %d\n"
-                "  completion_timer : %d\n"
-                "  workerID         : %d\n"
-                "  time             : %d -> %d\n"
-                ,job0.list_link == NULL ? 0 : job0.list_link->item, job0.id, job0.job_type, ENUM_ATTR(job_type, caption, job0.job_type), job0.flags.bits.working, job0.completion_timer, getWorkerID(&job0), tick0, tick1);
-            continue;
-        }
-        df::job& job1 = *(*j).second;
-        
-        if ( job0.flags.bits.working == job1.flags.bits.working &&
-               (job0.completion_timer == job1.completion_timer || (job1.completion_timer > 0 && job0.completion_timer-1 == job1.completion_timer)) &&
-               getWorkerID(&job0) == getWorkerID(&job1) )
-            continue;
-        
-        out.print("job change\n"
-            "  location         : 0x%X -> 0x%X\n"
-            "  id               : %d -> %d\n"
-            "  type             : %d -> %d\n"
-            "  type             : %s -> %s\n"
-            "  working          : %d -> %d\n"
-            "  completion timer : %d -> %d\n"
-            "  workerID         : %d -> %d\n"
-            "  time             : %d -> %d\n"
-            "\n",
-            job0.list_link->item, job1.list_link->item,
-            job0.id, job1.id,
-            job0.job_type, job1.job_type,
-            ENUM_ATTR(job_type, caption, job0.job_type), ENUM_ATTR(job_type, caption, job1.job_type),
-            job0.flags.bits.working, job1.flags.bits.working,
-            job0.completion_timer, job1.completion_timer,
-            getWorkerID(&job0), getWorkerID(&job1),
-            tick0, tick1
-        );
+        prevJobs.add(link->item->id, link->item);
     }
-#endif
     
-    for ( auto i = prevJobs.begin(); i != prevJobs.end(); i++ ) {
-        //if it happened within a tick, must have been cancelled by the user or a plugin: not completed
-        if ( tick1 <= tick0 )
-            continue;
-        
-        if ( nowJobs.find((*i).first) != nowJobs.end() ) {
-            //could have just finished if it's a repeat job
-            df::job& job0 = *(*i).second;
-            if ( !job0.flags.bits.repeat )
-                continue;
-            df::job& job1 = *nowJobs[(*i).first];
-            if ( job0.completion_timer != 0 )
-                continue;
-            if ( job1.completion_timer != -1 )
-                continue;
-            
-            //still false positive if cancelled at EXACTLY the right time, but experiments show this doesn't happen
-            for ( auto j = copy.begin(); j != copy.end(); j++ ) {
-                (*j).second.eventHandler(out, (void*)&job0);
-            }
-            continue;
-        }
-        
-        //recently finished or cancelled job
-        df::job& job0 = *(*i).second;
-        if ( job0.flags.bits.repeat || job0.completion_timer != 0 )
-            continue;
-        
-        for ( auto j = copy.begin(); j != copy.end(); j++ ) {
-            (*j).second.eventHandler(out, (void*)&job0);
-        }
-    }
+    JobCompletedDelta delta(out, tick1 > tick0);
+    prevJobs.diff(delta);
+}
+
+struct UnitDeathDelta {
+    color_ostream& out;
 
-    //erase old jobs, copy over possibly altered jobs
-    for ( auto i = prevJobs.begin(); i != prevJobs.end(); i++ ) {
-        Job::deleteJobStruct((*i).second, true);
+    UnitDeathDelta(color_ostream& out_in): out(out_in) {
     }
-    prevJobs.clear();
-    
-    //create new jobs
-    for ( auto j = nowJobs.begin(); j != nowJobs.end(); j++ ) {
-        /*map<int32_t, df::job*>::iterator i = prevJobs.find((*j).first);
-        if ( i != prevJobs.end() ) {
-            continue;
-        }*/
 
-        df::job* newJob = Job::cloneJobStruct((*j).second, true);
-        prevJobs[newJob->id] = newJob;
+    void added(int32_t id, bool& dead) {
     }
-}
+    void removed(int32_t id, bool& dead) {
+    }
+    void kept(int32_t id, bool& wasDead, bool& dead) {
+        //dead: if dead since last check, trigger events
+        if ( wasDead || !dead )
+            return;
+        dispatch(out, EventType::UNIT_DEATH, (void*)id);
+    }
+};
 
 static void manageUnitDeathEvent(color_ostream& out) {
     if (!df::global::world)
         return;
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::UNIT_DEATH].begin(), handlers[EventType::UNIT_DEATH].end());
+    unitsDead.begin();
     for ( size_t a = 0; a < df::global::world->units.all.size(); a++ ) {
         df::unit* unit = df::global::world->units.all[a];
         //if ( unit->counters.death_id == -1 ) {
-        if ( ! unit->flags1.bits.dead ) {
-            livingUnits.insert(unit->id);
-            continue;
-        }
-        //dead: if dead since last check, trigger events
-        if ( livingUnits.find(unit->id) == livingUnits.end() )
-            continue;
-        
-        for ( auto i = copy.begin(); i != copy.end(); i++ ) {
-            (*i).second.eventHandler(out, (void*)unit->id);
-        }
-        livingUnits.erase(unit->id);
+        unitsDead.add(unit->id, unit->flags1.bits.dead);
     }
+    UnitDeathDelta delta(out);
+    unitsDead.diff(delta);
 }
 
 static void manageItemCreationEvent(color_ostream& out) {
@@ -555,7 +832,6 @@ static void manageItemCreationEvent(color_ostream& out) {
         return;
     }
     
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::ITEM_CREATED].begin(), handlers[EventType::ITEM_CREATED].end());
     size_t index = df::item::binsearch_index(df::global::world->items.all, nextItem, false);
     if ( index != 0 ) index--;
     for ( size_t a = index; a < df::global::world->items.all.size(); a++ ) {
@@ -575,13 +851,31 @@ static void manageItemCreationEvent(color_ostream& out) {
         //spider webs don't count
         if ( item->flags.bits.spider_web )
             continue;
-        for ( auto i = copy.begin(); i != copy.end(); i++ ) {
-            (*i).second.eventHandler(out, (void*)item->id);
-        }
+        dispatch(out, EventType::ITEM_CREATED, (void*)item->id);
     }
     nextItem = *df::global::item_next_id;
 }
 
+struct BuildingDelta {
+    color_ostream& out;
+
+    BuildingDelta(color_ostream& out_in): out(out_in) {
+    }
+
+    void fire(int32_t id) {
+        dispatch(out, EventType::BUILDING, (void*)id);
+    }
+    //created and destroyed buildings are both reported by id
+    void added(int32_t id, bool&) {
+        fire(id);
+    }
+    void removed(int32_t id, bool&) {
+        fire(id);
+    }
+    void kept(int32_t id, bool&, bool&) {
+    }
+};
+
 static void manageBuildingEvent(color_ostream& out) {
     if (!df::global::world)
         return;
@@ -591,81 +885,57 @@ static void manageBuildingEvent(color_ostream& out) {
      * TODO: could be faster
      * consider looking at jobs: building creation / destruction
      **/
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::BUILDING].begin(), handlers[EventType::BUILDING].end());
-    //first alert people about new buildings
-    for ( int32_t a = nextBuilding; a < *df::global::building_next_id; a++ ) {
-        int32_t index = df::building::binsearch_index(df::global::world->buildings.all, a);
-        if ( index == -1 ) {
-            //out.print("%s, line %d: Couldn't find new building with id %d.\n", __FILE__, __LINE__, a);
-            //the tricky thing is that when the game first starts, it's ok to skip buildings, but otherwise, if you skip buildings, something is probably wrong. TODO: make this smarter
-            continue;
-        }
-        buildings.insert(a);
-        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-            EventHandler bob = (*b).second;
-            bob.eventHandler(out, (void*)a);
-        }
-    }
+    std::vector<df::building*>& all = df::global::world->buildings.all;
+    //nothing was created, so anything destroyed would have shrunk the vector
+    if ( nextBuilding == *df::global::building_next_id && all.size() == buildings.size() )
+        return;
     nextBuilding = *df::global::building_next_id;
-    
-    //now alert people about destroyed buildings
-    for ( auto a = buildings.begin(); a != buildings.end(); ) {
-        int32_t id = *a;
-        int32_t index = df::building::binsearch_index(df::global::world->buildings.all,id);
-        if ( index != -1 ) {
-            a++;
-            continue;
-        }
-        
-        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-            EventHandler bob = (*b).second;
-            bob.eventHandler(out, (void*)id);
-        }
-        a = buildings.erase(a);
+
+    buildings.begin();
+    for ( size_t a = 0; a < all.size(); a++ ) {
+        buildings.add(all[a]->id, true);
     }
+    BuildingDelta delta(out);
+    buildings.diff(delta);
 }
 
+struct ConstructionDelta {
+    color_ostream& out;
+
+    ConstructionDelta(color_ostream& out_in): out(out_in) {
+    }
+
+    void fire(df::construction& construction) {
+        dispatch(out, EventType::CONSTRUCTION, (void*)&construction);
+    }
+    void added(int64_t key, df::construction& now) {
+        //out.print("Created construction (%d,%d,%d)\n", now.pos.x,now.pos.y,now.pos.z);
+        fire(now);
+    }
+    void removed(int64_t key, df::construction& old) {
+        //out.print("Removed construction (%d,%d,%d)\n", old.pos.x,old.pos.y,old.pos.z);
+        fire(old);
+    }
+    void kept(int64_t key, df::construction&, df::construction&) {
+    }
+};
+
 static void manageConstructionEvent(color_ostream& out) {
     if (!df::global::world)
         return;
-    //unordered_set<df::construction*> constructionsNow(df::global::world->constructions.begin(), df::global::world->constructions.end());
     
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::CONSTRUCTION].begin(), handlers[EventType::CONSTRUCTION].end());
-    for ( auto a = constructions.begin(); a != constructions.end(); ) {
-        df::construction& construction = (*a).second;
-        if ( df::construction::find(construction.pos) != NULL ) {
-            a++;
-            continue;
-        }
-        //construction removed
-        //out.print("Removed construction (%d,%d,%d)\n", construction.pos.x,construction.pos.y,construction.pos.z);
-        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-            EventHandler handle = (*b).second;
-            handle.eventHandler(out, (void*)&construction);
-        }
-        a = constructions.erase(a);
-    }
-    
-    //for ( auto a = constructionsNow.begin(); a != constructionsNow.end(); a++ ) {
+    constructions.begin();
     for ( auto a = df::global::world->constructions.begin(); a != df::global::world->constructions.end(); a++ ) {
         df::construction* construction = *a;
-        bool b = constructions.find(construction->pos) != constructions.end();
-        constructions[construction->pos] = *construction;
-        if ( b )
-            continue;
-        //construction created
-        //out.print("Created construction (%d,%d,%d)\n", construction->pos.x,construction->pos.y,construction->pos.z);
-        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-            EventHandler handle = (*b).second;
-            handle.eventHandler(out, (void*)construction);
-        }
+        constructions.add(constructionKey(construction->pos), *construction);
     }
+    ConstructionDelta delta(out);
+    constructions.diff(delta);
 }
 
 static void manageSyndromeEvent(color_ostream& out) {
     if (!df::global::world)
         return;
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::SYNDROME].begin(), handlers[EventType::SYNDROME].end());
     int32_t highestTime = -1;
     for ( auto a = df::global::world->units.all.begin(); a != df::global::world->units.all.end(); a++ ) {
         df::unit* unit = *a;
@@ -682,10 +952,7 @@ static void manageSyndromeEvent(color_ostream& out) {
                 continue;
             
             SyndromeData data(unit->id, b);
-            for ( auto c = copy.begin(); c != copy.end(); c++ ) {
-                EventHandler handle = (*c).second;
-                handle.eventHandler(out, (void*)&data);
-            }
+            dispatch(out, EventType::SYNDROME, (void*)&data);
         }
     }
     lastSyndromeTime = highestTime;
@@ -694,22 +961,17 @@ static void manageSyndromeEvent(color_ostream& out) {
 static void manageInvasionEvent(color_ostream& out) {
     if (!df::global::ui)
         return;
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::INVASION].begin(), handlers[EventType::INVASION].end());
 
     if ( df::global::ui->invasions.next_id <= nextInvasion )
         return;
     nextInvasion = df::global::ui->invasions.next_id;
 
-    for ( auto a = copy.begin(); a != copy.end(); a++ ) {
-        EventHandler handle = (*a).second;
-        handle.eventHandler(out, (void*)(nextInvasion-1));
-    }
+    dispatch(out, EventType::INVASION, (void*)(nextInvasion-1));
 }
 
 static void manageEquipmentEvent(color_ostream& out) {
     if (!df::global::world)
         return;
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::INVENTORY_CHANGE].begin(), handlers[EventType::INVENTORY_CHANGE].end());
     
     unordered_map<int32_t, InventoryItem> itemIdToInventoryItem;
     unordered_set<int32_t> currentlyEquipped;
@@ -743,10 +1005,7 @@ static void manageEquipmentEvent(color_ostream& out) {
             if ( c == itemIdToInventoryItem.end() ) {
                 //new item equipped (probably just picked up)
                 InventoryChangeData data(unit->id, NULL, &item_new);
-                for ( auto h = copy.begin(); h != copy.end(); h++ ) {
-                    EventHandler handle = (*h).second;
-                    handle.eventHandler(out, (void*)&data);
-                }
+                dispatch(out, EventType::INVENTORY_CHANGE, (void*)&data);
                 continue;
             }
             InventoryItem item_old = (*c).second;
@@ -758,10 +1017,7 @@ static void manageEquipmentEvent(color_ostream& out) {
             //some sort of change in how it's equipped
             
             InventoryChangeData data(unit->id, &item_old, &item_new);
-            for ( auto h = copy.begin(); h != copy.end(); h++ ) {
-                EventHandler handle = (*h).second;
-                handle.eventHandler(out, (void*)&data);
-            }
+            dispatch(out, EventType::INVENTORY_CHANGE, (void*)&data);
         }
         if ( !hadEquipment )
             delete temp;
@@ -772,10 +1028,7 @@ static void manageEquipmentEvent(color_ostream& out) {
                 continue;
             //TODO: delete ptr if invalid
             InventoryChangeData data(unit->id, &i, NULL);
-            for ( auto h = copy.begin(); h != copy.end(); h++ ) {
-                EventHandler handle = (*h).second;
-                handle.eventHandler(out, (void*)&data);
-            }
+            dispatch(out, EventType::INVENTORY_CHANGE, (void*)&data);
         }
         
         //update equipment
@@ -814,7 +1067,6 @@ static void updateReportToRelevantUnits() {
 static void manageReportEvent(color_ostream& out) {
     if (!df::global::world)
         return;
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::REPORT].begin(), handlers[EventType::REPORT].end());
     std::vector<df::report*>& reports = df::global::world->status.reports;
     size_t a = df::report::binsearch_index(reports, lastReport, false);
     //this may or may not be needed: I don't know if binsearch_index goes earlier or later if it can't hit the target exactly
@@ -823,10 +1075,7 @@ static void manageReportEvent(color_ostream& out) {
     }
     for ( ; a < reports.size(); a++ ) {
         df::report* report = reports[a];
-        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-            EventHandler handle = (*b).second;
-            handle.eventHandler(out, (void*)report->id);
-        }
+        dispatch(out, EventType::REPORT, (void*)report->id);
         lastReport = report->id;
     }
 }
@@ -844,7 +1093,6 @@ static df::unit_wound* getWound(df::unit* attacker, df::unit* defender) {
 static void manageUnitAttackEvent(color_ostream& out) {
     if (!df::global::world)
         return;
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::UNIT_ATTACK].begin(), handlers[EventType::UNIT_ATTACK].end());
     std::vector<df::report*>& reports = df::global::world->status.reports;
     size_t a = df::report::binsearch_index(reports, lastReportUnitAttack, false);
     //this may or may not be needed: I don't know if binsearch_index goes earlier or later if it can't hit the target exactly
@@ -902,10 +1150,7 @@ static void manageUnitAttackEvent(color_ostream& out) {
             data.wound = wound1->id;
             
             alreadyDone[data.attacker][data.defender] = 1;
-            for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-                EventHandler handle = (*b).second;
-                handle.eventHandler(out, (void*)&data);
-            }
+            dispatch(out, EventType::UNIT_ATTACK, (void*)&data);
         }
         
         if ( wound2 && !alreadyDone[unit1->id][unit2->id] ) {
@@ -915,10 +1160,7 @@ static void manageUnitAttackEvent(color_ostream& out) {
             data.wound = wound2->id;
             
             alreadyDone[data.attacker][data.defender] = 1;
-            for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-                EventHandler handle = (*b).second;
-                handle.eventHandler(out, (void*)&data);
-            }
+            dispatch(out, EventType::UNIT_ATTACK, (void*)&data);
         }
 
         if ( unit1->flags1.bits.dead ) {
@@ -927,10 +1169,7 @@ static void manageUnitAttackEvent(color_ostream& out) {
             data.defender = unit1->id;
             data.wound = -1;
             alreadyDone[data.attacker][data.defender] = 1;
-            for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-                EventHandler handle = (*b).second;
-                handle.eventHandler(out, (void*)&data);
-            }
+            dispatch(out, EventType::UNIT_ATTACK, (void*)&data);
         }
         
         if ( unit2->flags1.bits.dead ) {
@@ -939,10 +1178,7 @@ static void manageUnitAttackEvent(color_ostream& out) {
             data.defender = unit2->id;
             data.wound = -1;
             alreadyDone[data.attacker][data.defender] = 1;
-            for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-                EventHandler handle = (*b).second;
-                handle.eventHandler(out, (void*)&data);
-            }
+            dispatch(out, EventType::UNIT_ATTACK, (void*)&data);
         }
         
         if ( !wound1 && !wound2 ) {
@@ -1133,7 +1369,6 @@ static vector<df::unit*> gatherRelevantUnits(color_ostream& out, df::report* r1,
 static void manageInteractionEvent(color_ostream& out) {
     if (!df::global::world)
         return;
-    multimap<Plugin*,EventHandler> copy(handlers[EventType::INTERACTION].begin(), handlers[EventType::INTERACTION].end());
     std::vector<df::report*>& reports = df::global::world->status.reports;
     size_t a = df::report::binsearch_index(reports, lastReportInteraction, false);
     while (a < reports.size() && reports[a]->id <= lastReportInteraction) {
@@ -1197,10 +1432,7 @@ static void manageInteractionEvent(color_ostream& out) {
         lastAttacker = df::unit::find(data.attacker);
         lastDefender = df::unit::find(data.defender);
         //fire event
-        for ( auto b = copy.begin(); b != copy.end(); b++ ) {
-            EventHandler handle = (*b).second;
-            handle.eventHandler(out, (void*)&data);
-        }
+        dispatch(out, EventType::INTERACTION, (void*)&data);
         //TODO: deduce attacker from latest defend event first
     }
 }
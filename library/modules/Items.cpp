@@ -198,6 +198,28 @@ ITEMDEF_VECTORS
     return toLower(ENUM_KEY_STR(item_type, type));
 }
 
+/*
+ * Subtype token lookup tables, one per itemdef vector, built on
+ * first use and dropped when the world is unloaded.
+ */
+#define ITEM(type,vec,tclass) static token_index vec##Index;
+ITEMDEF_VECTORS
+#undef ITEM
+
+void items_onStateChange(color_ostream &out, state_change_event event)
+{
+    switch (event) {
+    case SC_WORLD_LOADED:
+    case SC_WORLD_UNLOADED:
+#define ITEM(type,vec,tclass) vec##Index.clear();
+ITEMDEF_VECTORS
+#undef ITEM
+        break;
+    default:
+        break;
+    }
+}
+
 bool ItemTypeInfo::find(const std::string &token)
 {
     using namespace df::enums::item_type;
@@ -226,13 +248,13 @@ bool ItemTypeInfo::find(const std::string &token)
 
     switch (type) {
 #define ITEM(type,vec,tclass) \
-    case type: \
-        for (size_t i = 0; i < defs.vec.size(); i++) { \
-            if (defs.vec[i]->id == items[1]) { \
-                subtype = i; custom = defs.vec[i]; return true; \
-            } \
+    case type: { \
+        int i = vec##Index.find<df::tclass>(defs.vec, &df::itemdef::id, items[1]); \
+        if (i >= 0) { \
+            subtype = i; custom = defs.vec[i]; return true; \
         } \
-        break;
+        break; \
+    }
 ITEMDEF_VECTORS
 #undef ITEM
 
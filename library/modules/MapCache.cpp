@@ -29,6 +29,7 @@ distribution.
 #include <vector>
 #include <map>
 #include <set>
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 using namespace std;
@@ -1242,3 +1243,367 @@ void MapExtras::MapCache::resetTags()
         it->second->tags = NULL;
     }
 }
+
+struct MapExtras::PathSearch::BlockState
+{
+    enum {
+        CLOSED = 1,
+        GOAL = 2
+    };
+    static const uint8_t NO_PARENT = 0xFF;
+
+    cost_t cost[16][16];
+    uint8_t parent[16][16];
+    uint8_t flags[16][16];
+
+    BlockState()
+    {
+        for (int x = 0; x < 16; x++)
+            for (int y = 0; y < 16; y++)
+                cost[x][y] = -1;
+        memset(parent, NO_PARENT, sizeof(parent));
+        memset(flags, 0, sizeof(flags));
+    }
+};
+
+// The 26 neighbours of a tile; direction d and 25-d are opposite.
+static inline void path_step(int dir, int *dx, int *dy, int *dz)
+{
+    int idx = (dir < 13) ? dir : dir+1;
+    *dx = idx%3 - 1;
+    *dy = (idx/3)%3 - 1;
+    *dz = idx/9 - 1;
+}
+
+MapExtras::PathSearch::PathSearch(EdgeCostFn edge_cost, void *data, HeuristicFn heuristic)
+    : edge_cost(edge_cost), heuristic(heuristic), data(data)
+{
+    state = IDLE;
+    closed_count = edge_count = 0;
+    x_bmax = y_bmax = z_max = 0;
+}
+
+MapExtras::PathSearch::~PathSearch()
+{
+    clear();
+}
+
+void MapExtras::PathSearch::clear()
+{
+    for (size_t i = 0; i < blocks.size(); i++)
+        delete blocks[i];
+    blocks.clear();
+    block_index.clear();
+    heap.clear();
+    state = IDLE;
+    goal = df::coord();
+    closed_count = edge_count = 0;
+}
+
+MapExtras::PathSearch::BlockState *MapExtras::PathSearch::getBlock(df::coord pos, bool create)
+{
+    if (block_index.empty())
+    {
+        uint32_t x, y, z;
+        Maps::getSize(x, y, z);
+        x_bmax = x; y_bmax = y; z_max = z;
+        block_index.resize(size_t(x_bmax)*y_bmax*z_max, -1);
+    }
+
+    int32_t bx = pos.x >> 4, by = pos.y >> 4;
+    if (pos.x < 0 || pos.y < 0 || pos.z < 0 ||
+        bx >= x_bmax || by >= y_bmax || pos.z >= z_max)
+        return NULL;
+
+    int32_t &slot = block_index[(size_t(pos.z)*y_bmax + by)*x_bmax + bx];
+    if (slot < 0)
+    {
+        if (!create)
+            return NULL;
+        slot = blocks.size();
+        blocks.push_back(new BlockState());
+    }
+    return blocks[slot];
+}
+
+void MapExtras::PathSearch::push(df::coord pos, cost_t cost)
+{
+    HeapEntry entry;
+    entry.key = heuristic ? cost + heuristic(data, pos) : cost;
+    entry.pos = pos;
+    heap.push_back(entry);
+    std::push_heap(heap.begin(), heap.end());
+}
+
+void MapExtras::PathSearch::addSource(df::coord pos, cost_t cost)
+{
+    BlockState *blk = getBlock(pos, true);
+    if (!blk)
+        return;
+    cost_t &cur = blk->cost[pos.x&15][pos.y&15];
+    if (cur >= 0 && cur <= cost)
+        return;
+    cur = cost;
+    blk->parent[pos.x&15][pos.y&15] = BlockState::NO_PARENT;
+    push(pos, cost);
+    if (state == IDLE)
+        state = RUNNING;
+}
+
+void MapExtras::PathSearch::addGoal(df::coord pos)
+{
+    BlockState *blk = getBlock(pos, true);
+    if (blk)
+        blk->flags[pos.x&15][pos.y&15] |= BlockState::GOAL;
+}
+
+MapExtras::PathSearch::Status MapExtras::PathSearch::run(int max_nodes, uint64_t max_us)
+{
+    if (state != RUNNING)
+        return state;
+
+    uint64_t start = max_us ? GetTimeUs64() : 0;
+    int count = 0;
+
+    while (!heap.empty())
+    {
+        if (max_nodes > 0 && count >= max_nodes)
+            return state;
+        if (max_us && (count & 63) == 63 && GetTimeUs64() - start >= max_us)
+            return state;
+
+        std::pop_heap(heap.begin(), heap.end());
+        df::coord pt = heap.back().pos;
+        heap.pop_back();
+
+        // Stale entries are left in the heap when a tile's cost improves
+        BlockState *blk = getBlock(pt, false);
+        int tx = pt.x&15, ty = pt.y&15;
+        if (blk->flags[tx][ty] & BlockState::CLOSED)
+            continue;
+        blk->flags[tx][ty] |= BlockState::CLOSED;
+        count++;
+        closed_count++;
+
+        if (blk->flags[tx][ty] & BlockState::GOAL)
+        {
+            goal = pt;
+            state = FOUND;
+            return state;
+        }
+
+        cost_t my_cost = blk->cost[tx][ty];
+        for (int dir = 0; dir < 26; dir++)
+        {
+            int dx, dy, dz;
+            path_step(dir, &dx, &dy, &dz);
+            df::coord next(pt.x+dx, pt.y+dy, pt.z+dz);
+
+            BlockState *nblk = getBlock(next, false);
+            int nx = next.x&15, ny = next.y&15;
+            if (nblk && (nblk->flags[nx][ny] & BlockState::CLOSED))
+                continue;
+            if (!nblk && !Maps::isValidTilePos(next))
+                continue;
+
+            edge_count++;
+            cost_t step = edge_cost(data, pt, next);
+            if (step < 0)
+                continue;
+            cost_t new_cost = my_cost + step;
+
+            if (!nblk)
+                nblk = getBlock(next, true);
+            cost_t &cur = nblk->cost[nx][ny];
+            if (cur >= 0 && cur <= new_cost)
+                continue;
+            cur = new_cost;
+            nblk->parent[nx][ny] = uint8_t(dir);
+            push(next, new_cost);
+        }
+    }
+
+    state = EXHAUSTED;
+    return state;
+}
+
+MapExtras::PathSearch::cost_t MapExtras::PathSearch::getCost(df::coord pos)
+{
+    BlockState *blk = getBlock(pos, false);
+    return blk ? blk->cost[pos.x&15][pos.y&15] : -1;
+}
+
+bool MapExtras::PathSearch::isClosed(df::coord pos)
+{
+    BlockState *blk = getBlock(pos, false);
+    return blk && (blk->flags[pos.x&15][pos.y&15] & BlockState::CLOSED);
+}
+
+bool MapExtras::PathSearch::getParent(df::coord pos, df::coord *parent)
+{
+    BlockState *blk = getBlock(pos, false);
+    if (!blk)
+        return false;
+    uint8_t dir = blk->parent[pos.x&15][pos.y&15];
+    if (dir == BlockState::NO_PARENT)
+        return false;
+    int dx, dy, dz;
+    path_step(dir, &dx, &dy, &dz);
+    *parent = df::coord(pos.x-dx, pos.y-dy, pos.z-dz);
+    return true;
+}
+
+bool MapExtras::PathSearch::getPath(df::coord pos, std::vector<df::coord> *path)
+{
+    path->clear();
+    if (getCost(pos) < 0)
+        return false;
+    path->push_back(pos);
+    while (getParent(pos, &pos))
+        path->push_back(pos);
+    std::reverse(path->begin(), path->end());
+    return true;
+}
+
+struct MapExtras::FloodFill::BlockMask
+{
+    df::tile_bitmask filled;
+    df::tile_bitmask rejected;
+
+    BlockMask()
+    {
+        filled.clear();
+        rejected.clear();
+    }
+};
+
+MapExtras::FloodFill::FloodFill(MapCache &mc, TestFn test, VisitFn visit, void *data, int flags)
+    : mc(mc), test(test), step(NULL), visit(visit), data(data), flags(flags)
+{
+    x_tmax = mc.maxTileX();
+    y_tmax = mc.maxTileY();
+    z_max = mc.maxZ();
+    masks.resize(size_t(x_tmax/16)*(y_tmax/16)*z_max, NULL);
+}
+
+MapExtras::FloodFill::~FloodFill()
+{
+    clear();
+}
+
+void MapExtras::FloodFill::clear()
+{
+    for (size_t i = 0; i < masks.size(); i++)
+    {
+        delete masks[i];
+        masks[i] = NULL;
+    }
+}
+
+MapExtras::FloodFill::BlockMask *MapExtras::FloodFill::getMask(df::coord pos)
+{
+    BlockMask *&mask = masks[(size_t(pos.z)*(y_tmax/16) + (pos.y>>4))*(x_tmax/16) + (pos.x>>4)];
+    if (!mask)
+        mask = new BlockMask();
+    return mask;
+}
+
+bool MapExtras::FloodFill::isVisited(df::coord pos)
+{
+    if (pos.x < 0 || pos.y < 0 || pos.z < 0 ||
+        pos.x >= x_tmax || pos.y >= y_tmax || pos.z >= z_max)
+        return false;
+    return getMask(pos)->filled.getassignment(pos.x&15, pos.y&15);
+}
+
+// In the map, not seen yet, and passes the test; failures are remembered.
+bool MapExtras::FloodFill::accept(df::coord pos)
+{
+    if (pos.x < 0 || pos.y < 0 || pos.z < 0 ||
+        pos.x >= x_tmax || pos.y >= y_tmax || pos.z >= z_max)
+        return false;
+
+    BlockMask *mask = getMask(pos);
+    int tx = pos.x&15, ty = pos.y&15;
+    if (mask->filled.getassignment(tx, ty) || mask->rejected.getassignment(tx, ty))
+        return false;
+    if (test(mc, pos, data))
+        return true;
+    mask->rejected.setassignment(tx, ty, true);
+    return false;
+}
+
+// Seeds one tile for each run of acceptable tiles in the row
+void MapExtras::FloodFill::pushRow(df::coord from, int16_t x0, int16_t x1, int16_t y)
+{
+    bool in_run = false;
+    for (int16_t x = x0; x <= x1; x++)
+    {
+        df::coord pos(x, y, from.z);
+        if (accept(pos))
+        {
+            if (!in_run)
+                seeds.push_back(pos);
+            in_run = true;
+        }
+        else
+            in_run = false;
+    }
+}
+
+size_t MapExtras::FloodFill::fill(df::coord start)
+{
+    size_t count = 0;
+    int16_t diag = (flags & DIAGONAL) ? 1 : 0;
+
+    seeds.clear();
+    seeds.push_back(start);
+
+    while (!seeds.empty())
+    {
+        df::coord pos = seeds.back();
+        seeds.pop_back();
+        if (!accept(pos))
+            continue;
+
+        int16_t x0 = pos.x, x1 = pos.x;
+        while (accept(df::coord(x0-1, pos.y, pos.z)))
+            x0--;
+        while (accept(df::coord(x1+1, pos.y, pos.z)))
+            x1++;
+
+        for (int16_t x = x0; x <= x1; x++)
+        {
+            df::coord cur(x, pos.y, pos.z);
+            getMask(cur)->filled.setassignment(x&15, pos.y&15, true);
+            if (visit)
+                visit(mc, cur, data);
+            count++;
+        }
+
+        pushRow(pos, x0-diag, x1+diag, pos.y-1);
+        pushRow(pos, x0-diag, x1+diag, pos.y+1);
+
+        if (!(flags & VERTICAL))
+            continue;
+
+        for (int16_t x = x0; x <= x1; x++)
+        {
+            df::coord cur(x, pos.y, pos.z);
+            if (flags & DOWN)
+            {
+                df::coord below(x, pos.y, pos.z-1);
+                if (accept(below) && (!step || step(mc, cur, below, data)))
+                    seeds.push_back(below);
+            }
+            if (flags & UP)
+            {
+                df::coord above(x, pos.y, pos.z+1);
+                if (accept(above) && (!step || step(mc, cur, above, data)))
+                    seeds.push_back(above);
+            }
+        }
+    }
+
+    return count;
+}
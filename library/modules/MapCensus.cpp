@@ -0,0 +1,424 @@
+/*
+https://github.com/peterix/dfhack
+Copyright (c) 2009-2012 Petr Mrázek (peterix@gmail.com)
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any
+damages arising from the use of this software.
+
+Permission is granted to anyone to use this software for any
+purpose, including commercial applications, and to alter it and
+redistribute it freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must
+not claim that you wrote the original software. If you use this
+software in a product, an acknowledgment in the product documentation
+would be appreciated but is not required.
+
+2. Altered source versions must be plainly marked as such, and
+must not be misrepresented as being the original software.
+
+3. This notice may not be removed or altered from any source
+distribution.
+*/
+
+#include "Internal.h"
+
+#include <vector>
+#include <map>
+#include <algorithm>
+using namespace std;
+
+#include "modules/MapCensus.h"
+#include "modules/Maps.h"
+#include "modules/MapCache.h"
+#include "TileTypes.h"
+#include "Core.h"
+#include "MiscUtils.h"
+#include "tinythread.h"
+
+#include "DataDefs.h"
+#include "df/world.h"
+#include "df/map_block.h"
+#include "df/map_block_column.h"
+#include "df/plant.h"
+
+using namespace DFHack;
+using namespace df::enums;
+using df::global::world;
+
+void MapCensus::Count::add(int z, uint32_t n)
+{
+    count += n;
+    if (z != invalid_z)
+    {
+        if (lower_z == invalid_z || z < lower_z)
+            lower_z = z;
+        if (upper_z == invalid_z || z > upper_z)
+            upper_z = z;
+    }
+}
+
+void MapCensus::Count::merge(const Count &other)
+{
+    if (!other.count && other.lower_z == invalid_z)
+        return;
+    add(other.lower_z, other.count);
+    add(other.upper_z, 0);
+}
+
+static void mergeCounts(MapCensus::CountMap &dst, const MapCensus::CountMap &src)
+{
+    for (MapCensus::CountMap::const_iterator it = src.begin(); it != src.end(); ++it)
+        dst[it->first].merge(it->second);
+}
+
+void MapCensus::Result::merge(const Result &other)
+{
+    mergeCounts(base, other.base);
+    mergeCounts(layer, other.layer);
+    mergeCounts(vein, other.vein);
+    mergeCounts(shrub, other.shrub);
+    mergeCounts(tree, other.tree);
+    water.merge(other.water);
+    magma.merge(other.magma);
+    aquifer.merge(other.aquifer);
+    tube.merge(other.tube);
+    has_lair = has_lair || other.has_lair;
+    has_demon_temple = has_demon_temple || other.has_demon_temple;
+}
+
+/*
+ * Per-block cache. Each block's counts are kept as a short list of
+ * (kind, key, count) entries, all at the block's z level, together with a
+ * hash of the raw block data they were computed from.
+ */
+namespace {
+    enum EntryKind {
+        BASE, LAYER, VEIN, SHRUB, TREE,
+        WATER, MAGMA, AQUIFER, TUBE, LAIR, TEMPLE
+    };
+
+    struct CensusEntry {
+        uint8_t kind;
+        int32_t key;
+        uint32_t count;
+    };
+
+    struct BlockCensus {
+        bool valid;
+        uint32_t fingerprint;
+        std::vector<CensusEntry> entries;
+
+        BlockCensus() : valid(false), fingerprint(0) {}
+    };
+
+    struct CensusJob {
+        tthread::mutex lock;
+        size_t next;
+        std::vector<df::coord> blocks;
+        MapCensus::Options options;
+    };
+
+    struct CensusWorker {
+        CensusJob *job;
+        MapCensus::Result result;
+    };
+}
+
+static std::vector<BlockCensus> cache;
+static MapCensus::Options cacheOptions;
+static uint32_t cache_x, cache_y, cache_z;
+
+void MapCensus::clearCache()
+{
+    std::vector<BlockCensus>().swap(cache);
+    cache_x = cache_y = cache_z = 0;
+}
+
+void mapcensus_onStateChange(color_ostream &out, state_change_event event)
+{
+    if (event == SC_MAP_UNLOADED)
+        MapCensus::clearCache();
+}
+
+static uint32_t hashBytes(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+static uint32_t blockFingerprint(df::map_block *block, df::map_block_column *column, bool plants)
+{
+    uint32_t hash = 2166136261u;
+    hash = hashBytes(hash, block->tiletype, sizeof(block->tiletype));
+    hash = hashBytes(hash, block->designation, sizeof(block->designation));
+    hash = hashBytes(hash, block->occupancy, sizeof(block->occupancy));
+    if (plants && column)
+    {
+        for (size_t i = 0; i < column->plants.size(); i++)
+        {
+            df::plant *plant = column->plants[i];
+            if (plant->pos.z != block->map_pos.z)
+                continue;
+            hash = hashBytes(hash, &plant->pos, sizeof(plant->pos));
+            hash = hashBytes(hash, &plant->material, sizeof(plant->material));
+            hash = hashBytes(hash, &plant->flags, sizeof(plant->flags));
+        }
+    }
+    return hash;
+}
+
+static void addEntry(std::map<std::pair<int,int32_t>, uint32_t> &counts, int kind, int32_t key)
+{
+    counts[std::make_pair(kind, key)]++;
+}
+
+static void countBlock(MapExtras::Block *b, int16_t z, df::map_block_column *column,
+                       const MapCensus::Options &options, BlockCensus *census)
+{
+    std::map<std::pair<int,int32_t>, uint32_t> counts;
+
+    DFHack::t_feature blockFeatureGlobal;
+    DFHack::t_feature blockFeatureLocal;
+    b->GetGlobalFeature(&blockFeatureGlobal);
+    b->GetLocalFeature(&blockFeatureLocal);
+
+    for(uint32_t y = 0; y < 16; y++)
+    {
+        for(uint32_t x = 0; x < 16; x++)
+        {
+            df::coord2d coord(x, y);
+            df::tile_designation des = b->DesignationAt(coord);
+            df::tile_occupancy occ = b->OccupancyAt(coord);
+
+            // Skip hidden tiles
+            if (!options.hidden && des.bits.hidden)
+                continue;
+
+            if (des.bits.water_table)
+                addEntry(counts, AQUIFER, 0);
+            if (occ.bits.monster_lair)
+                addEntry(counts, LAIR, 0);
+
+            if (des.bits.flow_size)
+            {
+                if (des.bits.liquid_type == tile_liquid::Magma)
+                    addEntry(counts, MAGMA, 0);
+                else
+                    addEntry(counts, WATER, 0);
+            }
+
+            df::tiletype type = b->tiletypeAt(coord);
+            df::tiletype_shape tileshape = tileShape(type);
+            df::tiletype_material tilemat = tileMaterial(type);
+
+            // We only care about these types
+            switch (tileshape)
+            {
+            case tiletype_shape::WALL:
+            case tiletype_shape::FORTIFICATION:
+                break;
+            case tiletype_shape::EMPTY:
+                /* A heuristic: tubes inside adamantine have EMPTY:AIR tiles which
+                   still have feature_local set. Also check the unrevealed status,
+                   so as to exclude any holes mined by the player. */
+                if (tilemat == tiletype_material::AIR &&
+                    des.bits.feature_local && des.bits.hidden &&
+                    blockFeatureLocal.type == feature_type::deep_special_tube)
+                {
+                    addEntry(counts, TUBE, 0);
+                }
+            default:
+                continue;
+            }
+
+            addEntry(counts, BASE, tilemat);
+
+            switch (tilemat)
+            {
+            case tiletype_material::SOIL:
+            case tiletype_material::STONE:
+                addEntry(counts, LAYER, b->layerMaterialAt(coord));
+                break;
+            case tiletype_material::MINERAL:
+                addEntry(counts, VEIN, b->veinMaterialAt(coord));
+                break;
+            case tiletype_material::FEATURE:
+                if (blockFeatureLocal.type != -1 && des.bits.feature_local)
+                {
+                    if (blockFeatureLocal.type == feature_type::deep_special_tube
+                            && blockFeatureLocal.main_material == 0) // stone
+                    {
+                        addEntry(counts, VEIN, blockFeatureLocal.sub_material);
+                    }
+                    else if (blockFeatureLocal.type == feature_type::deep_surface_portal)
+                    {
+                        addEntry(counts, TEMPLE, 0);
+                    }
+                }
+
+                if (blockFeatureGlobal.type != -1 && des.bits.feature_global
+                        && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
+                        && blockFeatureGlobal.main_material == 0) // stone
+                {
+                    addEntry(counts, LAYER, blockFeatureGlobal.sub_material);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // Plants are listed per column, and are easier to check for visibility here
+    if (options.plants && column)
+    {
+        for (size_t i = 0; i < column->plants.size(); i++)
+        {
+            const df::plant &plant = *column->plants[i];
+            if (plant.pos.z != z)
+                continue;
+            df::coord2d loc(plant.pos.x, plant.pos.y);
+            loc = loc % 16;
+            if (options.hidden || !b->DesignationAt(loc).bits.hidden)
+                addEntry(counts, plant.flags.bits.is_shrub ? SHRUB : TREE, plant.material);
+        }
+    }
+
+    census->entries.clear();
+    for (std::map<std::pair<int,int32_t>, uint32_t>::const_iterator it = counts.begin(); it != counts.end(); ++it)
+    {
+        CensusEntry entry;
+        entry.kind = it->first.first;
+        entry.key = it->first.second;
+        entry.count = it->second;
+        census->entries.push_back(entry);
+    }
+}
+
+static void addToResult(MapCensus::Result &result, const BlockCensus &census, int z)
+{
+    for (size_t i = 0; i < census.entries.size(); i++)
+    {
+        const CensusEntry &entry = census.entries[i];
+        switch (entry.kind)
+        {
+        case BASE:    result.base[entry.key].add(z, entry.count); break;
+        case LAYER:   result.layer[entry.key].add(z, entry.count); break;
+        case VEIN:    result.vein[entry.key].add(z, entry.count); break;
+        case SHRUB:   result.shrub[entry.key].add(z, entry.count); break;
+        case TREE:    result.tree[entry.key].add(z, entry.count); break;
+        case WATER:   result.water.add(z, entry.count); break;
+        case MAGMA:   result.magma.add(z, entry.count); break;
+        case AQUIFER: result.aquifer.add(z, entry.count); break;
+        case TUBE:    result.tube.add(z, entry.count); break;
+        case LAIR:    result.has_lair = true; break;
+        case TEMPLE:  result.has_demon_temple = true; break;
+        }
+    }
+}
+
+static size_t cacheIndex(df::coord bpos)
+{
+    return (size_t(bpos.z)*cache_y + bpos.y)*cache_x + bpos.x;
+}
+
+// Runs with the core suspended, so the game data is only being read
+static void censusWorker(void *arg)
+{
+    CensusWorker *worker = (CensusWorker*)arg;
+    CensusJob *job = worker->job;
+    MapExtras::MapCache map;
+    int region_z = world->map.region_z;
+
+    for (;;)
+    {
+        size_t begin, end;
+        {
+            tthread::lock_guard<tthread::mutex> guard(job->lock);
+            begin = job->next;
+            end = std::min(begin + 64, job->blocks.size());
+            job->next = end;
+        }
+        if (begin >= end)
+            break;
+
+        for (size_t i = begin; i < end; i++)
+        {
+            df::coord bpos = job->blocks[i];
+            df::map_block *block = Maps::getBlock(bpos);
+            df::map_block_column *column = Maps::getBlockColumn(bpos.x, bpos.y);
+            BlockCensus &census = cache[cacheIndex(bpos)];
+
+            uint32_t fingerprint = blockFingerprint(block, column, job->options.plants);
+            if (!census.valid || census.fingerprint != fingerprint)
+            {
+                MapExtras::Block *b = map.BlockAt(bpos);
+                if (!b || !b->is_valid())
+                {
+                    census.valid = false;
+                    continue;
+                }
+                countBlock(b, bpos.z, column, job->options, &census);
+                census.fingerprint = fingerprint;
+                census.valid = true;
+            }
+
+            addToResult(worker->result, census, region_z + bpos.z);
+        }
+
+        // Clean uneeded memory
+        map.trash();
+    }
+}
+
+bool MapCensus::scan(Result *result, const Options &options)
+{
+    if (!Maps::IsValid())
+        return false;
+
+    uint32_t x_max, y_max, z_max;
+    Maps::getSize(x_max, y_max, z_max);
+
+    if (!(options == cacheOptions) || x_max != cache_x || y_max != cache_y || z_max != cache_z)
+    {
+        clearCache();
+        cache.resize(size_t(x_max)*y_max*z_max);
+        cacheOptions = options;
+        cache_x = x_max; cache_y = y_max; cache_z = z_max;
+    }
+
+    CensusJob job;
+    job.next = 0;
+    job.options = options;
+    for (uint32_t z = 0; z < z_max; z++)
+        for (uint32_t y = 0; y < y_max; y++)
+            for (uint32_t x = 0; x < x_max; x++)
+                if (Maps::getBlock(x, y, z))
+                    job.blocks.push_back(df::coord(x, y, z));
+
+    unsigned count = std::max(1u, std::min(8u, tthread::thread::hardware_concurrency()));
+    count = unsigned(std::min<size_t>(count, job.blocks.size()/256 + 1));
+
+    std::vector<CensusWorker> workers(count);
+    std::vector<tthread::thread*> threads;
+    for (unsigned i = 0; i < count; i++)
+        workers[i].job = &job;
+    // the calling thread does its share of the work too
+    for (unsigned i = 1; i < count; i++)
+        threads.push_back(new tthread::thread(censusWorker, &workers[i]));
+    censusWorker(&workers[0]);
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+
+    for (unsigned i = 0; i < count; i++)
+        result->merge(workers[i].result);
+    return true;
+}
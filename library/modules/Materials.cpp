@@ -208,6 +208,27 @@ bool MaterialInfo::find(const std::vector<std::string> &items)
     return false;
 }
 
+/*
+ * Token lookup tables for the raws, built on first use and dropped
+ * when the world is unloaded.
+ */
+static token_index builtinIndex, inorganicIndex, plantIndex, creatureIndex;
+
+void materials_onStateChange(color_ostream &out, state_change_event event)
+{
+    switch (event) {
+    case SC_WORLD_LOADED:
+    case SC_WORLD_UNLOADED:
+        builtinIndex.clear();
+        inorganicIndex.clear();
+        plantIndex.clear();
+        creatureIndex.clear();
+        break;
+    default:
+        break;
+    }
+}
+
 bool MaterialInfo::findBuiltin(const std::string &token)
 {
     if (token.empty())
@@ -219,12 +240,9 @@ bool MaterialInfo::findBuiltin(const std::string &token)
     }
 
     df::world_raws &raws = world->raws;
-    for (int i = 0; i < NUM_BUILTIN; i++)
-    {
-        auto obj = raws.mat_table.builtin[i];
-        if (obj && obj->id == token)
-            return decode(i, -1);
-    }
+    int i = builtinIndex.find(raws.mat_table.builtin, NUM_BUILTIN, &df::material::id, token);
+    if (i >= 0)
+        return decode(i, -1);
     return decode(-1);
 }
 
@@ -239,12 +257,9 @@ bool MaterialInfo::findInorganic(const std::string &token)
     }
 
     df::world_raws &raws = world->raws;
-    for (size_t i = 0; i < raws.inorganics.size(); i++)
-    {
-        df::inorganic_raw *p = raws.inorganics[i];
-        if (p->id == token)
-            return decode(0, i);
-    }
+    int i = inorganicIndex.find(raws.inorganics, &df::inorganic_raw::id, token);
+    if (i >= 0)
+        return decode(0, i);
     return decode(-1);
 }
 
@@ -253,11 +268,10 @@ bool MaterialInfo::findPlant(const std::string &token, const std::string &subtok
     if (token.empty())
         return decode(-1);
     df::world_raws &raws = world->raws;
-    for (size_t i = 0; i < raws.plants.all.size(); i++)
+    int i = plantIndex.find(raws.plants.all, &df::plant_raw::id, token);
+    if (i >= 0)
     {
         df::plant_raw *p = raws.plants.all[i];
-        if (p->id != token)
-            continue;
 
         // As a special exception, return the structural material with empty subtoken
         if (subtoken.empty())
@@ -266,8 +280,6 @@ bool MaterialInfo::findPlant(const std::string &token, const std::string &subtok
         for (size_t j = 0; j < p->material.size(); j++)
             if (p->material[j]->id == subtoken)
                 return decode(PLANT_BASE+j, i);
-
-        break;
     }
     return decode(-1);
 }
@@ -277,17 +289,14 @@ bool MaterialInfo::findCreature(const std::string &token, const std::string &sub
     if (token.empty() || subtoken.empty())
         return decode(-1);
     df::world_raws &raws = world->raws;
-    for (size_t i = 0; i < raws.creatures.all.size(); i++)
+    int i = creatureIndex.find(raws.creatures.all, &df::creature_raw::creature_id, token);
+    if (i >= 0)
     {
         df::creature_raw *p = raws.creatures.all[i];
-        if (p->creature_id != token)
-            continue;
 
         for (size_t j = 0; j < p->material.size(); j++)
             if (p->material[j]->id == subtoken)
                 return decode(CREATURE_BASE+j, i);
-
-        break;
     }
     return decode(-1);
 }
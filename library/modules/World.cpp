@@ -27,6 +27,8 @@ distribution.
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <algorithm>
 #include <cstring>
 using namespace std;
 
@@ -56,9 +58,19 @@ using namespace df::enums;
 
 using df::global::world;
 
+/*
+ * Persistent entries are fake historical figures with ids <= -100, kept
+ * at the start of the (id-sorted) figure vector. New entries are held in
+ * persistent_pending and spliced into that vector once per frame by
+ * world_flushPersistentData, so adding many keys costs a single shift
+ * of the figure vector. persistent_entries maps -id-100 to the figure
+ * for both stored and pending entries.
+ */
 static int next_persistent_id = 0;
 static std::multimap<std::string, int> persistent_index;
 typedef std::pair<std::string, int> T_persistent_item;
+static std::vector<df::historical_figure*> persistent_entries;
+static std::vector<df::historical_figure*> persistent_pending;
 
 bool World::ReadPauseState()
 {
@@ -190,10 +202,33 @@ struct hide_fake_histfigs_hook : df::viewscreen_legendsst {
 
 IMPLEMENT_VMETHOD_INTERPOSE_PRIO(hide_fake_histfigs_hook, feed, -10000);
 
+static df::historical_figure *findPersistentEntry(int id)
+{
+    if (id > -100)
+        return NULL;
+    size_t idx = size_t(-id-100);
+    return idx < persistent_entries.size() ? persistent_entries[idx] : NULL;
+}
+
+static void setPersistentEntry(int id, df::historical_figure *hfig)
+{
+    size_t idx = size_t(-id-100);
+    if (idx >= persistent_entries.size())
+        persistent_entries.resize(idx+1, NULL);
+    persistent_entries[idx] = hfig;
+}
+
 void World::ClearPersistentCache()
 {
     next_persistent_id = 0;
     persistent_index.clear();
+    persistent_entries.clear();
+
+    // Normally flushed at the end of the frame they were added in,
+    // so anything left here belongs to a world that is gone.
+    for (size_t i = 0; i < persistent_pending.size(); i++)
+        delete persistent_pending[i];
+    persistent_pending.clear();
 
     INTERPOSE_HOOK(hide_fake_histfigs_hook, feed).apply(Core::getInstance().isWorldLoaded());
 }
@@ -215,8 +250,9 @@ static bool BuildPersistentCache()
     if (hfvec.size() > 0 && hfvec[0]->id <= -100)
         next_persistent_id = hfvec[0]->id-1;
 
-    // Add the entries to the lookup table
+    // Add the entries to the lookup tables
     persistent_index.clear();
+    persistent_entries.clear();
 
     for (size_t i = 0; i < hfvec.size() && hfvec[i]->id <= -100; i++)
     {
@@ -224,18 +260,28 @@ static bool BuildPersistentCache()
             continue;
 
         persistent_index.insert(T_persistent_item(hfvec[i]->name.first_name, -hfvec[i]->id));
+        setPersistentEntry(hfvec[i]->id, hfvec[i]);
     }
 
     return true;
 }
 
-PersistentDataItem World::AddPersistentData(const std::string &key)
+void world_flushPersistentData()
 {
-    if (!BuildPersistentCache() || key.empty())
-        return PersistentDataItem();
+    if (persistent_pending.empty())
+        return;
 
     std::vector<df::historical_figure*> &hfvec = df::historical_figure::get_vector();
 
+    // Pending entries have descending ids; the vector is sorted ascending.
+    hfvec.insert(hfvec.begin(), persistent_pending.rbegin(), persistent_pending.rend());
+    persistent_pending.clear();
+}
+
+static df::historical_figure *newPersistentEntry(const std::string &key)
+{
+    std::vector<df::historical_figure*> &hfvec = df::historical_figure::get_vector();
+
     df::historical_figure *hfig = new df::historical_figure();
     hfig->id = next_persistent_id;
     hfig->name.has_name = true;
@@ -246,11 +292,20 @@ PersistentDataItem World::AddPersistentData(const std::string &key)
         hfig->id = std::min(hfig->id, hfvec[0]->id-1);
     next_persistent_id = hfig->id-1;
 
-    hfvec.insert(hfvec.begin(), hfig);
+    persistent_pending.push_back(hfig);
+    setPersistentEntry(hfig->id, hfig);
 
     persistent_index.insert(T_persistent_item(key, -hfig->id));
 
-    return dataFromHFig(hfig);
+    return hfig;
+}
+
+PersistentDataItem World::AddPersistentData(const std::string &key)
+{
+    if (!BuildPersistentCache() || key.empty())
+        return PersistentDataItem();
+
+    return dataFromHFig(newPersistentEntry(key));
 }
 
 PersistentDataItem World::GetPersistentData(const std::string &key)
@@ -269,8 +324,10 @@ PersistentDataItem World::GetPersistentData(int entry_id)
 {
     if (entry_id < 100)
         return PersistentDataItem();
+    if (!BuildPersistentCache())
+        return PersistentDataItem();
 
-    auto hfig = df::historical_figure::find(-entry_id);
+    auto hfig = findPersistentEntry(-entry_id);
     if (hfig && hfig->name.has_name)
         return dataFromHFig(hfig);
 
@@ -322,12 +379,86 @@ void World::GetPersistentData(std::vector<PersistentDataItem> *vec, const std::s
 
     for (auto it = eqrange.first; it != eqrange.second; ++it)
     {
-        auto hfig = df::historical_figure::find(-it->second);
+        auto hfig = findPersistentEntry(-it->second);
         if (hfig && hfig->name.has_name)
             vec->push_back(dataFromHFig(hfig));
     }
 }
 
+void World::GetPersistentData(std::vector<PersistentDataItem> *vec,
+                              const std::vector<std::string> &keys, bool add)
+{
+    vec->clear();
+
+    if (!BuildPersistentCache())
+    {
+        vec->resize(keys.size());
+        return;
+    }
+
+    vec->reserve(keys.size());
+
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        df::historical_figure *hfig = NULL;
+
+        auto it = persistent_index.find(keys[i]);
+        if (it != persistent_index.end())
+            hfig = findPersistentEntry(-it->second);
+        else if (add && !keys[i].empty())
+            hfig = newPersistentEntry(keys[i]);
+
+        if (hfig && hfig->name.has_name)
+            vec->push_back(dataFromHFig(hfig));
+        else
+            vec->push_back(PersistentDataItem());
+    }
+}
+
+static bool unindexPersistentEntry(const PersistentDataItem &item)
+{
+    int id = item.raw_id();
+    auto eqrange = persistent_index.equal_range(item.key());
+
+    for (auto it = eqrange.first; it != eqrange.second; ++it)
+    {
+        if (it->second != -id)
+            continue;
+
+        persistent_index.erase(it);
+        setPersistentEntry(id, NULL);
+        return true;
+    }
+
+    return false;
+}
+
+namespace {
+    // Only the entries that were actually unindexed; figures skipped by
+    // BuildPersistentCache (no name) are not in the cache, but must stay.
+    struct IsKeptEntry
+    {
+        const std::set<int> *deleted;
+        bool operator() (df::historical_figure *hfig) const
+        {
+            return deleted->count(hfig->id) == 0;
+        }
+    };
+}
+
+static void dropDeletedEntries(std::vector<df::historical_figure*> &vec, const std::set<int> &deleted)
+{
+    auto end = vec.begin();
+    while (end != vec.end() && (*end)->id <= -100)
+        ++end;
+
+    IsKeptEntry kept = { &deleted };
+    auto last = std::stable_partition(vec.begin(), end, kept);
+    for (auto it = last; it != end; ++it)
+        delete *it;
+    vec.erase(last, end);
+}
+
 bool World::DeletePersistentData(const PersistentDataItem &item)
 {
     int id = item.raw_id();
@@ -336,30 +467,52 @@ bool World::DeletePersistentData(const PersistentDataItem &item)
     if (!BuildPersistentCache())
         return false;
 
+    if (!unindexPersistentEntry(item))
+        return false;
+
     std::vector<df::historical_figure*> &hfvec = df::historical_figure::get_vector();
 
-    auto eqrange = persistent_index.equal_range(item.key());
+    int idx = binsearch_index(hfvec, id);
 
-    for (auto it2 = eqrange.first; it2 != eqrange.second; )
+    if (idx >= 0) {
+        delete hfvec[idx];
+        hfvec.erase(hfvec.begin()+idx);
+    }
+    else
     {
-        auto it = it2; ++it2;
-
-        if (it->second != -id)
-            continue;
+        for (size_t i = 0; i < persistent_pending.size(); i++)
+        {
+            if (persistent_pending[i]->id != id)
+                continue;
+            delete persistent_pending[i];
+            vector_erase_at(persistent_pending, i);
+            break;
+        }
+    }
 
-        persistent_index.erase(it);
+    return true;
+}
 
-        int idx = binsearch_index(hfvec, id);
+int World::DeletePersistentData(const std::vector<PersistentDataItem> &items)
+{
+    if (!BuildPersistentCache())
+        return 0;
 
-        if (idx >= 0) {
-            delete hfvec[idx];
-            hfvec.erase(hfvec.begin()+idx);
-        }
+    std::set<int> deleted;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        if (items[i].raw_id() <= -100 && unindexPersistentEntry(items[i]))
+            deleted.insert(items[i].raw_id());
+    }
 
-        return true;
+    // Compact the figure and pending vectors in one pass each.
+    if (!deleted.empty())
+    {
+        dropDeletedEntries(df::historical_figure::get_vector(), deleted);
+        dropDeletedEntries(persistent_pending, deleted);
     }
 
-    return false;
+    return (int)deleted.size();
 }
 
 df::tile_bitmask *World::getPersistentTilemask(const PersistentDataItem &item, df::map_block *block, bool create)
@@ -158,39 +158,9 @@ public:
     {
         coord_vec v;
 
-        std::stack<DFCoord> to_flood;
-        to_flood.push(start);
-
-        std::set<DFCoord> seen;
-
-        while (!to_flood.empty()) {
-            DFCoord xy = to_flood.top();
-            to_flood.pop();
-
-                        df::tile_designation des = mc.designationAt(xy);
-
-            if (seen.find(xy) == seen.end()
-                            && des.bits.flow_size
-                            && des.bits.liquid_type == tile_liquid::Water) {
-                v.push_back(xy);
-                seen.insert(xy);
-
-                maybeFlood(DFCoord(xy.x - 1, xy.y, xy.z), to_flood, mc);
-                maybeFlood(DFCoord(xy.x + 1, xy.y, xy.z), to_flood, mc);
-                maybeFlood(DFCoord(xy.x, xy.y - 1, xy.z), to_flood, mc);
-                maybeFlood(DFCoord(xy.x, xy.y + 1, xy.z), to_flood, mc);
-
-                df::tiletype tt = mc.tiletypeAt(xy);
-                if (LowPassable(tt))
-                {
-                    maybeFlood(DFCoord(xy.x, xy.y, xy.z - 1), to_flood, mc);
-                }
-                if (HighPassable(tt))
-                {
-                    maybeFlood(DFCoord(xy.x, xy.y, xy.z + 1), to_flood, mc);
-                }
-            }
-        }
+        MapExtras::FloodFill flood(mc, isWater, addPoint, &v, MapExtras::FloodFill::VERTICAL);
+        flood.setStep(canFlow);
+        flood.fill(start);
 
         return v;
     }
@@ -198,10 +168,19 @@ public:
         return "flood";
     }
 private:
-    void maybeFlood(DFCoord c, std::stack<DFCoord> &to_flood, MapExtras::MapCache &mc) {
-        if (mc.testCoord(c)) {
-            to_flood.push(c);
-        }
+    static bool isWater(MapExtras::MapCache &mc, DFCoord pos, void *)
+    {
+        df::tile_designation des = mc.designationAt(pos);
+        return des.bits.flow_size && des.bits.liquid_type == tile_liquid::Water;
+    }
+    static bool canFlow(MapExtras::MapCache &mc, DFCoord from, DFCoord to, void *)
+    {
+        df::tiletype tt = mc.tiletypeAt(from);
+        return (to.z < from.z) ? LowPassable(tt) : HighPassable(tt);
+    }
+    static void addPoint(MapExtras::MapCache &, DFCoord pos, void *data)
+    {
+        ((coord_vec*)data)->push_back(pos);
     }
     Core *c_;
 };
@@ -30,6 +30,7 @@ using df::global::world;
 command_result catsplosion (color_ostream &out, std::vector <std::string> & parameters);
 
 DFHACK_PLUGIN("catsplosion");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 // Mandatory init function. If you have some global state, create it here.
 DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
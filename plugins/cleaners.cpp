@@ -22,6 +22,7 @@ using df::global::world;
 using df::global::cursor;
 
 DFHACK_PLUGIN("cleaners");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 command_result cleanmap (color_ostream &out, bool snow, bool mud, bool item_spatter)
 {
@@ -54,6 +54,7 @@ using df::global::cursor;
 command_result cursecheck (color_ostream &out, vector <string> & parameters);
 
 DFHACK_PLUGIN("cursecheck");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
 {
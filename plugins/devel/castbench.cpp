@@ -0,0 +1,142 @@
+// Measure the cost of virtual_cast on the objects of the current world
+
+#include "Core.h"
+#include "Console.h"
+#include "Export.h"
+#include "PluginManager.h"
+#include "MiscUtils.h"
+#include "tinythread.h"
+
+#include <map>
+#include <vector>
+
+#include "DataDefs.h"
+#include "df/world.h"
+#include "df/item.h"
+#include "df/item_actual.h"
+#include "df/building.h"
+#include "df/building_actual.h"
+
+using std::vector;
+using std::string;
+
+using namespace DFHack;
+using namespace df::enums;
+
+using df::global::world;
+
+DFHACK_PLUGIN("castbench");
+
+static vector<virtual_ptr> objects;
+
+template<class T>
+static int cast_all(const vector<virtual_ptr> &objs)
+{
+    int hits = 0;
+    for (size_t i = 0; i < objs.size(); i++)
+        if (virtual_cast<T>(objs[i]))
+            hits++;
+    return hits;
+}
+
+// The lookup virtual_cast used to do: a mutex and a std::map on every call
+static tthread::mutex map_mutex;
+static std::map<void*, virtual_identity*> map_lookup;
+
+static virtual_identity *find_locked(void *vtable)
+{
+    tthread::lock_guard<tthread::mutex> lock(map_mutex);
+    auto it = map_lookup.find(vtable);
+    return (it != map_lookup.end()) ? it->second : NULL;
+}
+
+static int cast_all_locked(const vector<virtual_ptr> &objs, virtual_identity *target)
+{
+    int hits = 0;
+    for (size_t i = 0; i < objs.size(); i++)
+    {
+        virtual_identity *id = find_locked(*(void**)objs[i]);
+        if (id && target->is_subclass(id))
+            hits++;
+    }
+    return hits;
+}
+
+static void report(color_ostream &out, const char *what, uint64_t us, size_t casts, int hits)
+{
+    double rate = us ? casts * 1000000.0 / us : 0;
+    out.print("  %-24s %8.3f ms  %12.0f casts/s  (%d hits)\n",
+              what, us / 1000.0, rate, hits);
+}
+
+command_result df_castbench (color_ostream &out, vector <string> & parameters)
+{
+    int rounds = 100;
+    if (!parameters.empty())
+        rounds = atoi(parameters[0].c_str());
+    if (rounds <= 0)
+        return CR_WRONG_USAGE;
+
+    CoreSuspender suspend;
+
+    if (!world)
+        return CR_FAILURE;
+
+    objects.clear();
+    for (size_t i = 0; i < world->items.all.size(); i++)
+        objects.push_back(world->items.all[i]);
+    for (size_t i = 0; i < world->buildings.all.size(); i++)
+        objects.push_back(world->buildings.all[i]);
+
+    if (objects.empty())
+    {
+        out.printerr("No items or buildings to cast.\n");
+        return CR_FAILURE;
+    }
+
+    map_lookup.clear();
+    for (size_t i = 0; i < objects.size(); i++)
+        map_lookup[*(void**)objects[i]] = virtual_identity::get(objects[i]);
+
+    size_t casts = objects.size() * rounds;
+    out.print("%d rounds over %d objects:\n", rounds, int(objects.size()));
+
+    int hits = 0;
+    uint64_t start = GetTimeUs64();
+    for (int r = 0; r < rounds; r++)
+        hits = cast_all<df::building_actual>(objects);
+    report(out, "virtual_cast (building_actual)", GetTimeUs64() - start, casts, hits);
+
+    start = GetTimeUs64();
+    for (int r = 0; r < rounds; r++)
+        hits = cast_all<df::item_actual>(objects);
+    report(out, "virtual_cast (item_actual)", GetTimeUs64() - start, casts, hits);
+
+    start = GetTimeUs64();
+    for (int r = 0; r < rounds; r++)
+        hits = cast_all_locked(objects, &df::item_actual::_identity);
+    report(out, "mutex + map (item_actual)", GetTimeUs64() - start, casts, hits);
+
+    objects.clear();
+    map_lookup.clear();
+    return CR_OK;
+}
+
+DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
+{
+    commands.push_back(PluginCommand("castbench",
+        "Benchmark virtual_cast on all items and buildings.",
+        df_castbench, false,
+        "  castbench [rounds]\n"
+        "    Casts every item and building to a few classes, rounds times\n"
+        "    (default 100), and prints casts per second. For comparison the\n"
+        "    same casts are also done through a mutex-protected std::map,\n"
+        "    which is how vtables were looked up before the lock-free cache.\n"
+    ));
+    return CR_OK;
+}
+
+DFhackCExport command_result plugin_shutdown ( color_ostream &out )
+{
+    return CR_OK;
+}
@@ -10,6 +10,9 @@
 
 #include <vector>
 #include <string>
+#include <sstream>
+#include <algorithm>
+#include <string.h>
 #include "PassiveSocket.h"
 #include "tinythread.h"
 
@@ -67,16 +70,45 @@ const char * translate_socket_error(CSimpleSocket::CSocketError err) {
     }
 }
 
-// Owns the thread that accepts TCP connections and forwards messages to clients;
-// has a mutex
+// Frames are sent as a 4-byte big-endian length followed by
+//   "<dimx> <dimy> <x> <y> <w> <h>\n"
+// and w*h (character, attribute) byte pairs for that rectangle, row by row.
+// A client first gets the whole screen, then only the changed rectangles.
+
+// Owns the thread that accepts TCP connections and the thread that encodes
+// and sends frames to clients; has a mutex.
+// The renderer only hands over a copy of the screen, so a slow client can't
+// stall it; a client that falls too far behind is disconnected instead.
 class client_pool {
     typedef tthread::mutex mutex;
 
+    // unsent output above which a client is dropped
+    static const size_t max_pending = 1024*1024;
+
+    struct client {
+        CActiveSocket * socket;
+        std::string pending;
+        bool needs_full;
+
+        client(CActiveSocket * socket)
+            : socket(socket), needs_full(true)
+        {
+        }
+    };
+
     mutex clients_lock;
-    std::vector<CActiveSocket *> clients;
+    tthread::condition_variable frame_ready;
+
+    // guarded by clients_lock
+    std::vector<CActiveSocket *> incoming;
+    size_t client_count;
+    std::vector<unsigned char> frame;
+    int frame_w, frame_h;
+    bool has_frame;
 
-    // TODO - delete this at some point
+    // TODO - delete these at some point
     tthread::thread * accepter;
+    tthread::thread * sender;
 
     static void accept_clients(void * client_pool_pointer) {
         client_pool * p = reinterpret_cast<client_pool *>(client_pool_pointer);
@@ -92,11 +124,150 @@ class client_pool {
             CActiveSocket * client = socket.Accept();
             if (client != 0) {
                 lock l(*p);
-                p->clients.push_back(client);
+                p->add_client(client);
+            }
+        }
+    }
+
+    static void send_frames(void * client_pool_pointer) {
+        reinterpret_cast<client_pool *>(client_pool_pointer)->send_frames();
+    }
+
+    static void put_cell(std::string & out, const unsigned char * sc) {
+        static const unsigned char translate[] =
+        { 0, 4, 2, 6, 1, 5, 3, 7, 8, 12, 10, 14, 9, 13, 11, 15 };
+        unsigned char ch   = sc[0];
+        unsigned char bold = (sc[3] != 0) * 8;
+        unsigned char fg   = translate[(sc[1] + bold) % 16];
+        unsigned char bg   = translate[sc[2] % 16]*16;
+        out.push_back(ch);
+        out.push_back(fg+bg);
+    }
+
+    // screen is in the gps layout: column-major, 4 bytes per tile
+    static void encode_rect(std::string & out, const unsigned char * screen, int w, int h,
+                            int x0, int y0, int rw, int rh) {
+        std::stringstream header;
+        header << w << ' ' << h << ' ' << x0 << ' ' << y0 << ' ' << rw << ' ' << rh << '\n';
+        std::string msg = header.str();
+        msg.reserve(msg.size() + rw*rh*2);
+        for (int y = y0; y < y0 + rh; ++y)
+            for (int x = x0; x < x0 + rw; ++x)
+                put_cell(msg, screen + (x*h + y)*4);
+        unsigned int sz = htonl(msg.size());
+        out.append(reinterpret_cast<const char *>(&sz), sizeof(sz));
+        out += msg;
+    }
+
+    // One rectangle per run of changed rows, spanning their changed columns
+    static void encode_diff(std::string & out, const unsigned char * screen,
+                            const unsigned char * last, int w, int h) {
+        int band_y = -1, band_x0 = 0, band_x1 = 0;
+        for (int y = 0; y <= h; ++y) {
+            int x0 = w, x1 = -1;
+            for (int x = 0; y < h && x < w; ++x) {
+                int i = (x*h + y)*4;
+                if (memcmp(screen + i, last + i, 4) != 0) {
+                    if (x0 == w) x0 = x;
+                    x1 = x;
+                }
+            }
+            if (x1 >= 0) {
+                if (band_y < 0) {
+                    band_y = y;
+                    band_x0 = x0;
+                    band_x1 = x1;
+                } else {
+                    band_x0 = std::min(band_x0, x0);
+                    band_x1 = std::max(band_x1, x1);
+                }
+            } else if (band_y >= 0) {
+                encode_rect(out, screen, w, h, band_x0, band_y, band_x1 - band_x0 + 1, y - band_y);
+                band_y = -1;
             }
         }
     }
 
+    // Returns false if the client should be dropped
+    static bool flush(client & c) {
+        while (!c.pending.empty()) {
+            int sent = c.socket->Send((const uint8_t *) c.pending.data(), c.pending.size());
+            if (sent <= 0) {
+                return sent < 0 && c.socket->GetSocketError() == CSimpleSocket::SocketEwouldblock
+                    && c.pending.size() <= max_pending;
+            }
+            c.pending.erase(0, sent);
+        }
+        return true;
+    }
+
+    void send_frames() {
+        std::vector<client> clients;
+        std::vector<unsigned char> screen, last;
+        int last_w = -1, last_h = -1;
+
+        while (true) {
+            std::vector<CActiveSocket *> joined;
+            int w, h;
+            {
+                lock l(*this);
+                while (!has_frame)
+                    frame_ready.wait(clients_lock);
+                has_frame = false;
+                screen.swap(frame);
+                w = frame_w;
+                h = frame_h;
+                joined.swap(incoming);
+            }
+
+            for (size_t i = 0; i < joined.size(); ++i) {
+                joined[i]->SetNonblocking();
+                clients.push_back(client(joined[i]));
+            }
+
+            if (screen.empty())
+                continue;
+
+            bool resized = (w != last_w || h != last_h);
+            std::string full, diff;
+            bool have_full = false, have_diff = false;
+
+            for (size_t i = 0; i < clients.size();) {
+                client & c = clients[i];
+                if (c.needs_full || resized) {
+                    if (!have_full) {
+                        encode_rect(full, &screen[0], w, h, 0, 0, w, h);
+                        have_full = true;
+                    }
+                    c.pending += full;
+                    c.needs_full = false;
+                } else {
+                    if (!have_diff) {
+                        encode_diff(diff, &screen[0], &last[0], w, h);
+                        have_diff = true;
+                    }
+                    c.pending += diff;
+                }
+
+                if (flush(c)) {
+                    ++i;
+                    continue;
+                }
+                std::cout << "dfstream: dropping a client" << std::endl;
+                c.socket->Close();
+                delete c.socket;
+                clients.erase(clients.begin() + i);
+            }
+
+            last.swap(screen);
+            last_w = w;
+            last_h = h;
+
+            lock l(*this);
+            client_count = clients.size();
+        }
+    }
+
 public:
     class lock {
         tthread::lock_guard<mutex> l;
@@ -108,27 +279,35 @@ public:
     };
     friend class client_pool::lock;
 
-    client_pool() {
+    client_pool()
+        : client_count(0)
+        , frame_w(0)
+        , frame_h(0)
+        , has_frame(false)
+    {
         accepter = new tthread::thread(accept_clients, this);
+        sender = new tthread::thread(send_frames, this);
     }
 
     // MUST have lock
     bool has_clients() {
-        return !clients.empty();
+        return client_count > 0 || !incoming.empty();
     }
 
     // MUST have lock
     void add_client(CActiveSocket * sock) {
-        clients.push_back(sock);
+        incoming.push_back(sock);
     }
 
     // MUST have lock
-    void broadcast(const std::string & message) {
-        unsigned int sz = htonl(message.size());
-        for (size_t i = 0; i < clients.size(); ++i) {
-            clients[i]->Send(reinterpret_cast<const uint8_t *>(&sz), sizeof(sz));
-            clients[i]->Send((const uint8_t *) message.c_str(), message.size());
-        }
+    // Hands a copy of the screen (in the gps layout) to the sender thread;
+    // a frame it hasn't picked up yet is replaced.
+    void post_frame(const unsigned char * screen, int w, int h) {
+        frame.assign(screen, screen + w*h*4);
+        frame_w = w;
+        frame_h = h;
+        has_frame = true;
+        frame_ready.notify_one();
     }
 };
 
@@ -222,25 +401,7 @@ public:
         client_pool::lock lock(clients);
         if (!clients.has_clients()) return;
         framesNotPrinted = 0;
-        std::stringstream frame;
-        frame << gps->dimx << ' ' << gps->dimy << " 0 0 " << gps->dimx << ' ' << gps->dimy << '\n';
-        unsigned char * sc_ = gps->screen;
-        for (int y = 0; y < gps->dimy; ++y) {
-            unsigned char * sc = sc_;
-            for (int x = 0; x < gps->dimx; ++x) {
-                unsigned char ch   = sc[0];
-                unsigned char bold = (sc[3] != 0) * 8;
-                unsigned char translate[] =
-                { 0, 4, 2, 6, 1, 5, 3, 7, 8, 12, 10, 14, 9, 13, 11, 15 };
-                unsigned char fg   = translate[(sc[1] + bold) % 16];
-                unsigned char bg   = translate[sc[2] % 16]*16;
-                frame.put(ch);
-                frame.put(fg+bg);
-                sc += 4*gps->dimy;
-            }
-            sc_ += 4;
-        }
-        clients.broadcast(frame.str());
+        clients.post_frame(gps->screen, gps->dimx, gps->dimy);
     }
     virtual void set_fullscreen() { inner->set_fullscreen(); }
     virtual void zoom(df::zoom_commands cmd) {
@@ -8,12 +8,10 @@
 #include "modules/Materials.h"
 #include <vector>
 #include <cstdio>
-#include <stack>
 #include <string>
 #include <cmath>
 using std::vector;
 using std::string;
-using std::stack;
 using namespace DFHack;
 using namespace df::enums;
 
@@ -978,6 +976,92 @@ command_result digexp (color_ostream &out, vector <string> & parameters)
     return CR_OK;
 }
 
+// digv and digl share the flood fill and only use different conditions
+// to check if a tile should be marked for digging or not.
+struct VeinFill
+{
+    bool layer;         // digl: follow the layer material outside veins
+    int16_t veinmat;
+    int16_t basemat;
+    bool updown;
+    bool undo;
+    uint32_t tx_max, ty_max, z_max;
+};
+
+// Whether the tile has the material being followed; also used to place stairs
+static bool matchesVeinFill(MapExtras::MapCache &mc, DFHack::DFCoord pos, VeinFill *fill)
+{
+    if (!mc.testCoord(pos))
+        return false;
+    if (!fill->layer)
+        return mc.veinMaterialAt(pos) == fill->veinmat;
+
+    // don't dig out LAVA_STONE or MAGMA (semi-molten rock) accidentally
+    df::tiletype tt = mc.tiletypeAt(pos);
+    if(    tileMaterial(tt)!=tiletype_material::STONE
+        && tileMaterial(tt)!=tiletype_material::SOIL)
+        return false;
+    return mc.veinMaterialAt(pos) == -1 && mc.layerMaterialAt(pos) == fill->basemat;
+}
+
+static bool isVeinFillTile(MapExtras::MapCache &mc, DFHack::DFCoord pos, void *data)
+{
+    VeinFill *fill = (VeinFill*)data;
+    // stay off the map borders
+    if(pos.x < 1 || pos.x > int32_t(fill->tx_max) - 2 || pos.y < 1 || pos.y > int32_t(fill->ty_max) - 2)
+        return false;
+    if(!DFHack::isWallTerrain(mc.tiletypeAt(pos)))
+        return false;
+    return matchesVeinFill(mc, pos, fill);
+}
+
+// found a good tile, dig+unset material
+static void markVeinFillTile(MapExtras::MapCache &mc, DFHack::DFCoord pos, void *data)
+{
+    VeinFill *fill = (VeinFill*)data;
+    df::tile_designation des = mc.designationAt(pos);
+    if(fill->updown)
+    {
+        if(pos.z > 0 && matchesVeinFill(mc, pos-1, fill))
+        {
+            df::tile_designation des_minus = mc.designationAt(pos-1);
+            if(des_minus.bits.dig == tile_dig_designation::DownStair)
+                des_minus.bits.dig = tile_dig_designation::UpDownStair;
+            else
+                des_minus.bits.dig = tile_dig_designation::UpStair;
+            // undo mode: clear designation
+            if(fill->undo)
+                des_minus.bits.dig = tile_dig_designation::No;
+            mc.setDesignationAt(pos-1,des_minus);
+
+            des.bits.dig = tile_dig_designation::DownStair;
+        }
+        if(pos.z < int32_t(fill->z_max) - 1 && matchesVeinFill(mc, pos+1, fill))
+        {
+            df::tile_designation des_plus = mc.designationAt(pos+1);
+            if(des_plus.bits.dig == tile_dig_designation::UpStair)
+                des_plus.bits.dig = tile_dig_designation::UpDownStair;
+            else
+                des_plus.bits.dig = tile_dig_designation::DownStair;
+            // undo mode: clear designation
+            if(fill->undo)
+                des_plus.bits.dig = tile_dig_designation::No;
+            mc.setDesignationAt(pos+1,des_plus);
+
+            if(des.bits.dig == tile_dig_designation::DownStair)
+                des.bits.dig = tile_dig_designation::UpDownStair;
+            else
+                des.bits.dig = tile_dig_designation::UpStair;
+        }
+    }
+    if(des.bits.dig == tile_dig_designation::No)
+        des.bits.dig = tile_dig_designation::Default;
+    // undo mode: clear designation
+    if(fill->undo)
+        des.bits.dig = tile_dig_designation::No;
+    mc.setDesignationAt(pos,des);
+}
+
 command_result digvx (color_ostream &out, vector <string> & parameters)
 {
     // HOTKEY COMMAND: CORE ALREADY SUSPENDED
@@ -1034,114 +1118,19 @@ command_result digv (color_ostream &out, vector <string> & parameters)
         return CR_FAILURE;
     }
     con.print("%d/%d/%d tiletype: %d, veinmat: %d, designation: 0x%x ... DIGGING!\n", cx,cy,cz, tt, veinmat, des.whole);
-    stack <DFHack::DFCoord> flood;
-    flood.push(xy);
-
-    while( !flood.empty() )
-    {
-        DFHack::DFCoord current = flood.top();
-        flood.pop();
-        if (MCache->tagAt(current))
-            continue;
-        int16_t vmat2 = MCache->veinMaterialAt(current);
-        tt = MCache->tiletypeAt(current);
-        if(!DFHack::isWallTerrain(tt))
-            continue;
-        if(vmat2!=veinmat)
-            continue;
-
-        // found a good tile, dig+unset material
-        df::tile_designation des = MCache->designationAt(current);
-        df::tile_designation des_minus;
-        df::tile_designation des_plus;
-        des_plus.whole = des_minus.whole = 0;
-        int16_t vmat_minus = -1;
-        int16_t vmat_plus = -1;
-        bool below = 0;
-        bool above = 0;
-        if(updown)
-        {
-            if(MCache->testCoord(current-1))
-            {
-                below = 1;
-                des_minus = MCache->designationAt(current-1);
-                vmat_minus = MCache->veinMaterialAt(current-1);
-            }
-
-            if(MCache->testCoord(current+1))
-            {
-                above = 1;
-                des_plus = MCache->designationAt(current+1);
-                vmat_plus = MCache->veinMaterialAt(current+1);
-            }
-        }
-        if(MCache->testCoord(current))
-        {
-            MCache->setTagAt(current, 1);
-
-            if(current.x < tx_max - 2)
-            {
-                flood.push(DFHack::DFCoord(current.x + 1, current.y, current.z));
-                if(current.y < ty_max - 2)
-                {
-                    flood.push(DFHack::DFCoord(current.x + 1, current.y + 1,current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y + 1,current.z));
-                }
-                if(current.y > 1)
-                {
-                    flood.push(DFHack::DFCoord(current.x + 1, current.y - 1,current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y - 1,current.z));
-                }
-            }
-            if(current.x > 1)
-            {
-                flood.push(DFHack::DFCoord(current.x - 1, current.y,current.z));
-                if(current.y < ty_max - 2)
-                {
-                    flood.push(DFHack::DFCoord(current.x - 1, current.y + 1,current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y + 1,current.z));
-                }
-                if(current.y > 1)
-                {
-                    flood.push(DFHack::DFCoord(current.x - 1, current.y - 1,current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y - 1,current.z));
-                }
-            }
-            if(updown)
-            {
-                if(current.z > 0 && below && vmat_minus == vmat2)
-                {
-                    flood.push(current-1);
+    VeinFill fill;
+    fill.layer = false;
+    fill.veinmat = veinmat;
+    fill.basemat = -1;
+    fill.updown = updown;
+    fill.undo = false;
+    fill.tx_max = tx_max;
+    fill.ty_max = ty_max;
+    fill.z_max = z_max;
+    MapExtras::FloodFill flood(*MCache, isVeinFillTile, markVeinFillTile, &fill,
+        MapExtras::FloodFill::DIAGONAL | (updown ? MapExtras::FloodFill::VERTICAL : 0));
+    flood.fill(xy);
 
-                    if(des_minus.bits.dig == tile_dig_designation::DownStair)
-                        des_minus.bits.dig = tile_dig_designation::UpDownStair;
-                    else
-                        des_minus.bits.dig = tile_dig_designation::UpStair;
-                    MCache->setDesignationAt(current-1,des_minus);
-
-                    des.bits.dig = tile_dig_designation::DownStair;
-                }
-                if(current.z < z_max - 1 && above && vmat_plus == vmat2)
-                {
-                    flood.push(current+ 1);
-
-                    if(des_plus.bits.dig == tile_dig_designation::UpStair)
-                        des_plus.bits.dig = tile_dig_designation::UpDownStair;
-                    else
-                        des_plus.bits.dig = tile_dig_designation::DownStair;
-                    MCache->setDesignationAt(current+1,des_plus);
-
-                    if(des.bits.dig == tile_dig_designation::DownStair)
-                        des.bits.dig = tile_dig_designation::UpDownStair;
-                    else
-                        des.bits.dig = tile_dig_designation::UpStair;
-                }
-            }
-            if(des.bits.dig == tile_dig_designation::No)
-                des.bits.dig = tile_dig_designation::Default;
-            MCache->setDesignationAt(current,des);
-        }
-    }
     MCache->WriteAll();
     delete MCache;
     return CR_OK;
@@ -1155,12 +1144,6 @@ command_result diglx (color_ostream &out, vector <string> & parameters)
     return digl(out,lol);
 }
 
-// TODO: 
-// digl and digv share the longish floodfill code and only use different conditions
-// to check if a tile should be marked for digging or not.
-// to make the plugin a bit smaller and cleaner a main execute method would be nice
-// (doing the floodfill stuff and do the checks dependin on whether called in
-// "vein" or "layer" mode)
 command_result digl (color_ostream &out, vector <string> & parameters)
 {
     // HOTKEY COMMAND: CORE ALREADY SUSPENDED
@@ -1219,143 +1202,19 @@ command_result digl (color_ostream &out, vector <string> & parameters)
         return CR_FAILURE;
     }
     con.print("%d/%d/%d tiletype: %d, basemat: %d, designation: 0x%x ... DIGGING!\n", cx,cy,cz, tt, basemat, des.whole);
-    stack <DFHack::DFCoord> flood;
-    flood.push(xy);
-
-    int i = 0;
-    while( !flood.empty() )
-    {
-        DFHack::DFCoord current = flood.top();
-        flood.pop();
-        if (MCache->tagAt(current))
-            continue;
-        int16_t vmat2 = MCache->veinMaterialAt(current);
-        int16_t bmat2 = MCache->layerMaterialAt(current);
-        tt = MCache->tiletypeAt(current);
-
-        if(!DFHack::isWallTerrain(tt))
-            continue;
-        if(vmat2!=-1)
-            continue;
-        if(bmat2!=basemat)
-            continue;
-
-        // don't dig out LAVA_STONE or MAGMA (semi-molten rock) accidentally
-        if(    tileMaterial(tt)!=tiletype_material::STONE
-            && tileMaterial(tt)!=tiletype_material::SOIL)
-            continue;
-
-        // found a good tile, dig+unset material
-        df::tile_designation des = MCache->designationAt(current);
-        df::tile_designation des_minus;
-        df::tile_designation des_plus;
-        des_plus.whole = des_minus.whole = 0;
-        int16_t vmat_minus = -1;
-        int16_t vmat_plus = -1;
-        int16_t bmat_minus = -1;
-        int16_t bmat_plus = -1;
-        df::tiletype tt_minus;
-        df::tiletype tt_plus;
-
-        if(MCache->testCoord(current))
-        {
-            MCache->setTagAt(current, 1);
-            if(current.x < tx_max - 2)
-            {
-                flood.push(DFHack::DFCoord(current.x + 1, current.y, current.z));
-                if(current.y < ty_max - 2)
-                {
-                    flood.push(DFHack::DFCoord(current.x + 1, current.y + 1, current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y + 1, current.z));
-                }
-                if(current.y > 1)
-                {
-                    flood.push(DFHack::DFCoord(current.x + 1, current.y - 1, current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y - 1, current.z));
-                }
-            }
-            if(current.x > 1)
-            {
-                flood.push(DFHack::DFCoord(current.x - 1, current.y, current.z));
-                if(current.y < ty_max - 2)
-                {
-                    flood.push(DFHack::DFCoord(current.x - 1, current.y + 1, current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y + 1, current.z));
-                }
-                if(current.y > 1)
-                {
-                    flood.push(DFHack::DFCoord(current.x - 1, current.y - 1, current.z));
-                    flood.push(DFHack::DFCoord(current.x, current.y - 1, current.z));
-                }
-            }
-            if(updown)
-            {
-                bool below = 0;
-                bool above = 0;
-                if(MCache->testCoord(current-1))
-                {
-                    //below = 1;
-                    des_minus = MCache->designationAt(current-1);
-                    vmat_minus = MCache->veinMaterialAt(current-1);
-                    bmat_minus = MCache->layerMaterialAt(current-1);
-                    tt_minus = MCache->tiletypeAt(current-1);
-                    if (   tileMaterial(tt_minus)==tiletype_material::STONE
-                        || tileMaterial(tt_minus)==tiletype_material::SOIL)
-                        below = 1;
-                }
-                if(MCache->testCoord(current+1))
-                {
-                    //above = 1;
-                    des_plus = MCache->designationAt(current+1);
-                    vmat_plus = MCache->veinMaterialAt(current+1);
-                    bmat_plus = MCache->layerMaterialAt(current+1);
-                    tt_plus = MCache->tiletypeAt(current+1);
-                    if (   tileMaterial(tt_plus)==tiletype_material::STONE
-                        || tileMaterial(tt_plus)==tiletype_material::SOIL)
-                        above = 1;
-                }
-                if(current.z > 0 && below && vmat_minus == -1 && bmat_minus == basemat)
-                {
-                    flood.push(current-1);
-
-                    if(des_minus.bits.dig == tile_dig_designation::DownStair)
-                        des_minus.bits.dig = tile_dig_designation::UpDownStair;
-                    else
-                        des_minus.bits.dig = tile_dig_designation::UpStair;
-                    // undo mode: clear designation
-                    if(undo)
-                        des_minus.bits.dig = tile_dig_designation::No;
-                    MCache->setDesignationAt(current-1,des_minus);
-
-                    des.bits.dig = tile_dig_designation::DownStair;
-                }
-                if(current.z < z_max - 1 && above && vmat_plus == -1 && bmat_plus == basemat)
-                {
-                    flood.push(current+ 1);
-
-                    if(des_plus.bits.dig == tile_dig_designation::UpStair)
-                        des_plus.bits.dig = tile_dig_designation::UpDownStair;
-                    else
-                        des_plus.bits.dig = tile_dig_designation::DownStair;
-                    // undo mode: clear designation
-                    if(undo)
-                        des_plus.bits.dig = tile_dig_designation::No;
-                    MCache->setDesignationAt(current+1,des_plus);
+    VeinFill fill;
+    fill.layer = true;
+    fill.veinmat = -1;
+    fill.basemat = basemat;
+    fill.updown = updown;
+    fill.undo = undo;
+    fill.tx_max = tx_max;
+    fill.ty_max = ty_max;
+    fill.z_max = z_max;
+    MapExtras::FloodFill flood(*MCache, isVeinFillTile, markVeinFillTile, &fill,
+        MapExtras::FloodFill::DIAGONAL | (updown ? MapExtras::FloodFill::VERTICAL : 0));
+    flood.fill(xy);
 
-                    if(des.bits.dig == tile_dig_designation::DownStair)
-                        des.bits.dig = tile_dig_designation::UpDownStair;
-                    else
-                        des.bits.dig = tile_dig_designation::UpStair;
-                }
-            }
-            if(des.bits.dig == tile_dig_designation::No)
-                des.bits.dig = tile_dig_designation::Default;
-            // undo mode: clear designation
-            if(undo)
-                des.bits.dig = tile_dig_designation::No;
-            MCache->setDesignationAt(current,des);
-        }
-    }
     MCache->WriteAll();
     delete MCache;
     return CR_OK;
@@ -48,7 +48,7 @@ void getRidOfOldJob(df::unit* unit) {
     //delete job;
 }
 
-int32_t assignJob(color_ostream& out, Edge firstImportantEdge, unordered_map<df::coord,df::coord,PointHash> parentMap, unordered_map<df::coord,cost_t,PointHash>& costMap, vector<int32_t>& invaders, unordered_set<df::coord,PointHash>& requiresZNeg, unordered_set<df::coord,PointHash>& requiresZPos, MapExtras::MapCache& cache, DigAbilities& abilities ) {
+int32_t assignJob(color_ostream& out, Edge firstImportantEdge, MapExtras::PathSearch& search, vector<int32_t>& invaders, unordered_set<df::coord,PointHash>& requiresZNeg, unordered_set<df::coord,PointHash>& requiresZPos, MapExtras::MapCache& cache, DigAbilities& abilities ) {
     df::unit* firstInvader = df::unit::find(invaders[0]);
     if ( !firstInvader ) {
         return -1;
@@ -57,7 +57,7 @@ int32_t assignJob(color_ostream& out, Edge firstImportantEdge, unordered_map<df:
     //do whatever you need to do at the first important edge
     df::coord pt1 = firstImportantEdge.p1;
     df::coord pt2 = firstImportantEdge.p2;
-    if ( costMap[pt1] > costMap[pt2] ) {
+    if ( search.getCost(pt1) > search.getCost(pt2) ) {
         df::coord temp = pt1;
         pt1 = pt2;
         pt2 = temp;
@@ -79,7 +79,8 @@ int32_t assignJob(color_ostream& out, Edge firstImportantEdge, unordered_map<df:
         buildingPos = df::coord(pt2.x,pt2.y,pt2.z+1);
     }
     if ( building != NULL ) {
-        df::coord destroyFrom = parentMap[buildingPos];
+        df::coord destroyFrom;
+        search.getParent(buildingPos, &destroyFrom);
         if ( destroyFrom.z != buildingPos.z ) {
             //TODO: deal with this
         }
@@ -73,6 +73,7 @@ void watchForJobComplete(color_ostream& out, void* ptr);
 void newInvasionHandler(color_ostream& out, void* ptr);
 void clearDijkstra();
 void findAndAssignInvasionJob(color_ostream& out, void*);
+void invasionJobTick(color_ostream& out, void* ptr);
 //int32_t manageInvasion(color_ostream& out);
 
 DFHACK_PLUGIN_IS_ENABLED(enabled);
@@ -82,6 +83,8 @@ DFHACK_PLUGIN("diggingInvaders");
 static int32_t lastInvasionJob=-1;
 static int32_t lastInvasionDigger = -1;
 static int32_t edgesPerTick = 100;
+static int32_t searchTimePerTick = 2000;
+static bool tickPending = false;
 //static EventManager::EventHandler jobCompleteHandler(watchForJobComplete, 5);
 static bool activeDigging=false;
 static unordered_set<string> diggingRaces;
@@ -137,7 +140,8 @@ DFhackCExport command_result plugin_init (color_ostream &out, std::vector <Plugi
         "  diggingInvaders setDelay GOBLIN destroySmoothConstruction n\n"
         "  diggingInvaders now\n    makes invaders try to dig now, if plugin is enabled\n"
         "  diggingInvaders clear\n    clears all digging invader races\n"
-        "  diggingInvaders edgesPerTick n\n    makes the pathfinding algorithm work on at most n edges per tick. Set to 0 or lower to make it unlimited."
+        "  diggingInvaders edgesPerTick n\n    makes the pathfinding algorithm work on at most n edges per tick. Set to 0 or lower to make it unlimited.\n"
+        "  diggingInvaders searchTime n\n    makes the pathfinding algorithm spend at most n microseconds per tick. Set to 0 or lower to make it unlimited."
 //        "  diggingInvaders\n    Makes invaders try to dig now.\n"
     ));
     
@@ -156,6 +160,7 @@ DFhackCExport command_result plugin_enable(color_ostream& out, bool enable) {
     
     enabled = enable;
     EventManager::unregisterAll(plugin_self);
+    tickPending = false;
     clearDijkstra();
     lastInvasionJob = lastInvasionDigger = -1;
     activeDigging = false;
@@ -191,31 +196,6 @@ DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_chan
 
 df::coord getRoot(df::coord point, unordered_map<df::coord, df::coord>& rootMap);
 
-class PointComp {
-public:
-    unordered_map<df::coord, cost_t, PointHash> *pointCost;
-    PointComp(unordered_map<df::coord, cost_t, PointHash> *p): pointCost(p) {
-        
-    }
-    
-    int32_t operator()(df::coord p1, df::coord p2) {
-        if ( p1 == p2 ) return 0;
-        auto i1 = pointCost->find(p1);
-        auto i2 = pointCost->find(p2);
-        if ( i1 == pointCost->end() && i2 == pointCost->end() )
-            return p1 < p2;
-        if ( i1 == pointCost->end() )
-            return true;
-        if ( i2 == pointCost->end() )
-            return false;
-        cost_t c1 = (*i1).second;
-        cost_t c2 = (*i2).second;
-        if ( c1 != c2 )
-            return c1 < c2;
-        return p1 < p2;
-    }
-};
-
 //bool important(df::coord pos, map<df::coord, set<Edge> >& edges, df::coord prev, set<df::coord>& importantPoints, set<Edge>& importantEdges);
 
 void newInvasionHandler(color_ostream& out, void* ptr) {
@@ -317,13 +297,21 @@ command_result diggingInvadersCommand(color_ostream& out, std::vector<std::strin
             asdf >> edgeCount;
             edgesPerTick = edgeCount;
             a++;
+        } else if ( parameters[a] == "searchTime" ) {
+            if ( a+1 >= parameters.size() )
+                return CR_WRONG_USAGE;
+            stringstream asdf(parameters[a+1]);
+            int32_t time = 2000;
+            asdf >> time;
+            searchTimePerTick = time;
+            a++;
         }
         else {
             return CR_WRONG_USAGE;
         }
     }
     activeDigging = enabled;
-    out.print("diggingInvaders: enabled = %d, activeDigging = %d, edgesPerTick = %d\n", enabled, activeDigging, edgesPerTick);
+    out.print("diggingInvaders: enabled = %d, activeDigging = %d, edgesPerTick = %d, searchTime = %d\n", enabled, activeDigging, edgesPerTick, searchTimePerTick);
     
     return CR_OK;
 }
@@ -333,34 +321,39 @@ command_result diggingInvadersCommand(color_ostream& out, std::vector<std::strin
 vector<int32_t> invaders;
 unordered_set<df::coord, PointHash> invaderPts;
 unordered_set<df::coord, PointHash> localPts;
-unordered_map<df::coord,df::coord,PointHash> parentMap;
-unordered_map<df::coord,cost_t,PointHash> costMap;
 
-PointComp comp(&costMap);
-set<df::coord, PointComp> fringe(comp);
-EventManager::EventHandler findJobTickHandler(findAndAssignInvasionJob, 1);
+struct SearchContext {
+    color_ostream* out;
+    DigAbilities* abilities;
+    int32_t xMax, yMax, zMax;
+};
+static SearchContext searchContext;
+
+static MapExtras::PathSearch::cost_t invaderEdgeCost(void* data, df::coord pt, df::coord neighbor) {
+    SearchContext* context = (SearchContext*)data;
+    //no climbing to or from the edges of the map
+    if ( neighbor.z != pt.z && (neighbor.x == 0 || neighbor.y == 0 || neighbor.z == 0 || neighbor.x == context->xMax-1 || neighbor.y == context->yMax-1 || neighbor.z == context->zMax-1) )
+        return -1;
+    return getEdgeCost(*context->out, pt, neighbor, *context->abilities);
+}
 
-int32_t localPtsFound = 0;
-unordered_set<df::coord,PointHash> closedSet;
-unordered_map<df::coord,int32_t,PointHash> workNeeded; //non-walking work needed to get there
-bool foundTarget = false;
-int32_t edgeCount = 0;
+MapExtras::PathSearch search(invaderEdgeCost, &searchContext);
+EventManager::EventHandler findJobTickHandler(invasionJobTick, 1);
 
 void clearDijkstra() {
     invaders.clear();
     invaderPts.clear();
     localPts.clear();
-    parentMap.clear();
-    costMap.clear();
-    comp = PointComp(&costMap);
-    fringe = set<df::coord,PointComp>(comp);
-    localPtsFound = edgeCount = 0;
-    foundTarget = false;
-    closedSet.clear();
-    workNeeded.clear();
+    search.clear();
 }
 /////////////////////////////////////////////////////////////////////////////////////////
 
+void invasionJobTick(color_ostream& out, void* ptr) {
+    //the tick queue has already dropped this handler
+    tickPending = false;
+    findAndAssignInvasionJob(out, ptr);
+}
+
 void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
     CoreSuspender suspend;
     //returns the worker id of the job created //used to
@@ -370,10 +363,12 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
         clearDijkstra();
         return;
     }
-    EventManager::unregister(EventManager::EventType::TICK, findJobTickHandler, plugin_self);
-    EventManager::registerTick(findJobTickHandler, 1, plugin_self);
+    if ( !tickPending ) {
+        EventManager::registerTick(findJobTickHandler, 1, plugin_self);
+        tickPending = true;
+    }
     
-    if ( fringe.empty() ) {
+    if ( search.status() != MapExtras::PathSearch::RUNNING ) {
         df::unit* lastDigger = df::unit::find(lastInvasionDigger);
         if ( lastDigger && lastDigger->job.current_job && lastDigger->job.current_job->id == lastInvasionJob ) {
             return;
@@ -418,8 +413,7 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
                 if ( invaderPts.size() > 0 )
                     continue;
                 invaderPts.insert(unit->pos);
-                costMap[unit->pos] = 0;
-                fringe.insert(unit->pos);
+                search.addSource(unit->pos);
                 invaders.push_back(unit->id);
             } else {
                 continue;
@@ -430,6 +424,9 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
             activeDigging = false;
             return;
         }
+        for ( auto a = localPts.begin(); a != localPts.end(); a++ ) {
+            search.addGoal(*a);
+        }
 
         //if local connectivity is not disjoint from invader connectivity, no digging required
         bool overlap = false;
@@ -448,14 +445,14 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
     
     df::unit* firstInvader = df::unit::find(invaders[0]);
     if ( firstInvader == NULL ) {
-        fringe.clear();
+        search.clear();
         return;
     }
     
     df::creature_raw* creature_raw = df::creature_raw::find(firstInvader->race);
     if ( creature_raw == NULL || digAbilities.find(creature_raw->creature_id) == digAbilities.end() ) {
         //inappropriate digger: no dig abilities
-        fringe.clear();
+        search.clear();
         return;
     }
     DigAbilities& abilities = digAbilities[creature_raw->creature_id];
@@ -470,68 +467,18 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
     yMax *= 16;
     MapExtras::MapCache cache;
     
-    clock_t t0 = clock();
-    clock_t totalEdgeTime = 0;
-    int32_t edgesExpanded = 0;
-    while(!fringe.empty()) {
-        if ( edgesPerTick > 0 && edgesExpanded++ >= edgesPerTick ) {
-            return;
-        }
-        df::coord pt = *(fringe.begin());
-        fringe.erase(fringe.begin());
-        //out.print("line %d: fringe size = %d, localPtsFound = %d / %d, closedSetSize = %d, pt = %d,%d,%d\n", __LINE__, fringe.size(), localPtsFound, localPts.size(), closedSet.size(), pt.x,pt.y,pt.z);
-        if ( closedSet.find(pt) != closedSet.end() ) {
-            out.print("%s, line %d: Double closure! Bad!\n", __FILE__, __LINE__);
-            break;
-        }
-        closedSet.insert(pt);
-        
-        if ( localPts.find(pt) != localPts.end() ) {
-            localPtsFound++;
-            if ( true || localPtsFound >= localPts.size() ) {
-                foundTarget = true;
-                break;
-            }
-            if ( workNeeded.find(pt) == workNeeded.end() || workNeeded[pt] == 0 ) {
-                //there are still dwarves to kill that don't require digging to get to
-                return;
-            }
-        }
-
-        cost_t myCost = costMap[pt];
-        clock_t edgeTime = clock();
-        vector<Edge>* myEdges = getEdgeSet(out, pt, cache, xMax, yMax, zMax, abilities);
-        totalEdgeTime += (clock() - edgeTime);
-        for ( auto a = myEdges->begin(); a != myEdges->end(); a++ ) {
-            Edge &e = *a;
-            if ( e.p1 == df::coord() )
-                break;
-            edgeCount++;
-            df::coord& other = e.p1;
-            if ( other == pt )
-                other = e.p2;
-            //if ( closedSet.find(other) != closedSet.end() )
-            //    continue;
-            auto i = costMap.find(other);
-            if ( i != costMap.end() ) {
-                cost_t cost = (*i).second;
-                if ( cost <= myCost + e.cost ) {
-                    continue;
-                }
-                fringe.erase((*i).first);
-            }
-            costMap[other] = myCost + e.cost;
-            fringe.insert(other);
-            parentMap[other] = pt;
-            workNeeded[other] = (e.cost > 1 ? 1 : 0) + workNeeded[pt];
-        }
-        delete myEdges;
-    }
-    clock_t time = clock() - t0;
-    //out.print("tickTime = %d, time = %d, totalEdgeTime = %d, total points = %d, total edges = %d, time per point = %.3f, time per edge = %.3f, clocks/sec = %d\n", (int32_t)tickTime, time, totalEdgeTime, closedSet.size(), edgeCount, (float)time / closedSet.size(), (float)time / edgeCount, CLOCKS_PER_SEC);
-    fringe.clear();
-
-    if ( !foundTarget )
+    searchContext.out = &out;
+    searchContext.abilities = &abilities;
+    searchContext.xMax = xMax;
+    searchContext.yMax = yMax;
+    searchContext.zMax = zMax;
+    
+    //the search picks up where it left off last tick
+    MapExtras::PathSearch::Status status = search.run(edgesPerTick, searchTimePerTick > 0 ? searchTimePerTick : 0);
+    if ( status == MapExtras::PathSearch::RUNNING )
+        return;
+    //out.print("closed points = %d, total edges = %d\n", search.closedCount(), search.edgeCount());
+    if ( status != MapExtras::PathSearch::FOUND )
         return;
 
     unordered_set<df::coord, PointHash> requiresZNeg;
@@ -542,19 +489,13 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
     //df::coord closest;
     //cost_t closestCostEstimate=0;
     //cost_t closestCostActual=0;
-    for ( auto i = localPts.begin(); i != localPts.end(); i++ ) {
-        df::coord pt = *i;
-        if ( costMap.find(pt) == costMap.end() )
-            continue;
-        if ( parentMap.find(pt) == parentMap.end() )
-            continue;
+    {
+        df::coord pt = search.foundGoal();
         //closest = pt;
-        //closestCostEstimate = costMap[closest];
-        //if ( workNeeded[pt] == 0 ) 
-        //    continue;
-        while ( parentMap.find(pt) != parentMap.end() ) {
+        //closestCostEstimate = search.getCost(closest);
+        df::coord parent;
+        while ( search.getParent(pt, &parent) ) {
             //out.print("(%d,%d,%d)\n", pt.x, pt.y, pt.z);
-            df::coord parent = parentMap[pt];
             cost_t cost = getEdgeCost(out, parent, pt, abilities);
             if ( cost < 0 ) {
                 //path invalidated
@@ -581,7 +522,6 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
             }
             pt = parent;
         }
-        break;
     }
     if ( firstImportantEdge.p1 == df::coord() )
         return;
@@ -593,7 +533,7 @@ void findAndAssignInvasionJob(color_ostream& out, void* tickTime) {
     }
 */
     
-    assignJob(out, firstImportantEdge, parentMap, costMap, invaders, requiresZNeg, requiresZPos, cache, abilities);
+    assignJob(out, firstImportantEdge, search, invaders, requiresZNeg, requiresZPos, cache, abilities);
     lastInvasionDigger = firstInvader->id;
     lastInvasionJob = firstInvader->job.current_job ? firstInvader->job.current_job->id : -1;
     invaderJobs.erase(lastInvasionJob);
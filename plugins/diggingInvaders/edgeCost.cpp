@@ -450,34 +450,3 @@ cost_t getEdgeCostOld(color_ostream& out, df::coord pt1, df::coord pt2) {
     return -1;
 }
 */
-
-vector<Edge>* getEdgeSet(color_ostream &out, df::coord point, MapExtras::MapCache& cache, int32_t xMax, int32_t yMax, int32_t zMax, DigAbilities& abilities) {
-    //vector<Edge>* result = new vector<Edge>(26);
-    vector<Edge>* result = new vector<Edge>();
-    result->reserve(26);
-    
-    //size_t count = 0;
-    for ( int32_t dx = -1; dx <= 1; dx++ ) {
-        for ( int32_t dy = -1; dy <= 1; dy++ ) {
-            for ( int32_t dz = -1; dz <= 1; dz++ ) {
-                df::coord neighbor(point.x+dx, point.y+dy, point.z+dz);
-                if ( !Maps::isValidTilePos(neighbor) )
-                    continue;
-                if ( dz != 0 && /*(point.x == 0 || point.y == 0 || point.z == 0 || point.x == xMax-1 || point.y == yMax-1 || point.z == zMax-1) ||*/ (neighbor.x == 0 || neighbor.y == 0 || neighbor.z == 0 || neighbor.x == xMax-1 || neighbor.y == yMax-1 || neighbor.z == zMax-1) )
-                    continue;
-                if ( dx == 0 && dy == 0 && dz == 0 )
-                    continue;
-                cost_t cost = getEdgeCost(out, point, neighbor, abilities);
-                if ( cost == -1 )
-                    continue;
-                Edge edge(point, neighbor, cost);
-                //(*result)[count] = edge;
-                result->push_back(edge);
-                //count++;
-            }
-        }
-    }
-
-    return result;
-}
-
@@ -57,6 +57,7 @@ command_result df_flows (color_ostream &out, vector <string> & parameters)
 }
 
 DFHACK_PLUGIN("flows");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
 {
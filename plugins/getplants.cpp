@@ -149,6 +149,7 @@ command_result df_getplants (color_ostream &out, vector <string> & parameters)
 }
 
 DFHACK_PLUGIN("getplants");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 DFhackCExport command_result plugin_init ( color_ostream &out, vector <PluginCommand> &commands)
 {
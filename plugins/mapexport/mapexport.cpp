@@ -6,6 +6,12 @@
 using namespace DFHack;
 
 #include <fstream>
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/gzip_stream.h>
@@ -15,6 +21,9 @@ using namespace google::protobuf::io;
 #include "df/world.h"
 #include "df/plant.h"
 #include "modules/Constructions.h"
+#include "MiscUtils.h"
+
+#include "tinythread.h"
 
 #include "proto/Map.pb.h"
 #include "proto/Block.pb.h"
@@ -40,6 +49,16 @@ DFhackCExport command_result plugin_shutdown ( color_ostream &out )
     return CR_OK;
 }
 
+// Content hash of each block as of the last export, for "mapexport changed"
+static std::map<df::coord, uint32_t> exportedHashes;
+
+DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_change_event event)
+{
+    if (event == SC_MAP_UNLOADED)
+        exportedHashes.clear();
+    return CR_OK;
+}
+
 static dfproto::Tile::TileMaterialType toProto(df::tiletype_material mat)
 {
     /*
@@ -80,240 +99,693 @@ static dfproto::Tile::TileMaterialType toProto(df::tiletype_material mat)
     return dfproto::Tile::AIR;
 }
 
+/*
+ * Blocks are copied out of the game a few z levels at a time, each slab
+ * under its own short suspend, into plain structs. Building the protobuf
+ * messages and compressing them happens after the core is released.
+ */
+static const uint32_t SLAB_Z_LEVELS = 4;
+
+struct ExportTile
+{
+    enum { HAS_MATERIAL = 1 };
+
+    uint8_t x, y;
+    int16_t type;           // dfproto::Tile::TileType
+    uint8_t tile_material;  // dfproto::Tile::TileMaterialType
+    uint8_t liquid_type;
+    uint8_t flow_size;
+    uint8_t flags;
+    int32_t material_index;
+    int32_t material_type;
+};
+
+struct ExportPlant
+{
+    uint8_t x, y;
+    uint8_t is_shrub;
+    int32_t material;
+};
+
+struct ExportBlock
+{
+    uint32_t x, y, z;
+    std::vector<ExportTile> tiles;
+    std::vector<ExportPlant> plants;
+};
+
+// One row of blocks; the unit of compression and of the chunked file index
+struct ExportChunk
+{
+    int16_t z, y, x_min, x_max;
+    uint32_t count;
+    std::vector<ExportBlock> blocks;
+    std::string data;
+    bool done;
+
+    ExportChunk() : count(0), done(false) {}
+};
+
+struct ExportOptions
+{
+    bool showHidden;
+    bool chunked;
+    bool changedOnly;
+    // inclusive block ranges
+    int32_t x_min, x_max, y_min, y_max, z_min, z_max;
+};
+
+typedef std::map<df::coord,std::pair<uint32_t,uint16_t> > ConstructionMap;
+
+static uint32_t hashBytes(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+static uint32_t hashBlock(const ExportBlock &block)
+{
+    uint32_t hash = 2166136261u;
+    if (!block.tiles.empty())
+        hash = hashBytes(hash, &block.tiles[0], block.tiles.size()*sizeof(ExportTile));
+    if (!block.plants.empty())
+        hash = hashBytes(hash, &block.plants[0], block.plants.size()*sizeof(ExportPlant));
+    return hash;
+}
+
+// Core must be suspended
+static void snapshotBlock(ExportBlock *eb, MapExtras::Block *b, const ConstructionMap &constructionMaterials,
+                          bool showHidden)
+{
+    DFHack::t_feature blockFeatureGlobal;
+    DFHack::t_feature blockFeatureLocal;
+    b->GetGlobalFeature(&blockFeatureGlobal);
+    b->GetLocalFeature(&blockFeatureLocal);
+
+    for(uint32_t y = 0; y < 16; y++)
+    {
+        for(uint32_t x = 0; x < 16; x++)
+        {
+            df::coord2d coord(x, y);
+            df::tile_designation des = b->DesignationAt(coord);
+
+            // Skip hidden tiles
+            if (!showHidden && des.bits.hidden)
+                continue;
+
+            // zeroed so that padding doesn't change the block hash
+            ExportTile tile;
+            memset(&tile, 0, sizeof(tile));
+            tile.x = x;
+            tile.y = y;
+
+            // Check for liquid
+            if (des.bits.flow_size)
+            {
+                tile.liquid_type = des.bits.liquid_type;
+                tile.flow_size = des.bits.flow_size;
+            }
+
+            df::tiletype type = b->tiletypeAt(coord);
+            tile.type = tileShape(type);
+            tile.tile_material = toProto(tileMaterial(type));
+
+            df::coord map_pos = df::coord(eb->x*16+x,eb->y*16+y,eb->z);
+
+            switch (tileMaterial(type))
+            {
+            case tiletype_material::SOIL:
+            case tiletype_material::STONE:
+                tile.flags |= ExportTile::HAS_MATERIAL;
+                tile.material_type = 0;
+                tile.material_index = b->layerMaterialAt(coord);
+                break;
+            case tiletype_material::MINERAL:
+                tile.flags |= ExportTile::HAS_MATERIAL;
+                tile.material_type = 0;
+                tile.material_index = b->veinMaterialAt(coord);
+                break;
+            case tiletype_material::FEATURE:
+                if (blockFeatureLocal.type != -1 && des.bits.feature_local)
+                {
+                    if (blockFeatureLocal.type == feature_type::deep_special_tube
+                            && blockFeatureLocal.main_material == 0) // stone
+                    {
+                        tile.flags |= ExportTile::HAS_MATERIAL;
+                        tile.material_type = 0;
+                        tile.material_index = blockFeatureLocal.sub_material;
+                    }
+                    if (blockFeatureGlobal.type != -1 && des.bits.feature_global
+                            && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
+                            && blockFeatureGlobal.main_material == 0) // stone
+                    {
+                        tile.flags |= ExportTile::HAS_MATERIAL;
+                        tile.material_type = 0;
+                        tile.material_index = blockFeatureGlobal.sub_material;
+                    }
+                }
+                break;
+            case tiletype_material::CONSTRUCTION:
+            {
+                ConstructionMap::const_iterator it = constructionMaterials.find(map_pos);
+                if (it != constructionMaterials.end())
+                {
+                    tile.flags |= ExportTile::HAS_MATERIAL;
+                    tile.material_index = it->second.first;
+                    tile.material_type = it->second.second;
+                }
+                break;
+            }
+            default:
+                break;
+            }
+
+            eb->tiles.push_back(tile);
+        }
+    }
+
+    if (b->getRaw())
+    {
+        PlantList *plants = &b->getRaw()->plants;
+        for (PlantList::const_iterator it = plants->begin(); it != plants->end(); it++)
+        {
+            const df::plant & plant = *(*it);
+            df::coord2d loc(plant.pos.x, plant.pos.y);
+            loc = loc % 16;
+            if (showHidden || !b->DesignationAt(loc).bits.hidden)
+            {
+                ExportPlant eplant;
+                memset(&eplant, 0, sizeof(eplant));
+                eplant.x = loc.x;
+                eplant.y = loc.y;
+                eplant.is_shrub = plant.flags.bits.is_shrub;
+                eplant.material = plant.material;
+                eb->plants.push_back(eplant);
+            }
+        }
+    }
+}
+
+static void encodeBlock(const ExportBlock &block, CodedOutputStream *coded_output)
+{
+    dfproto::Block protoblock;
+    protoblock.set_x(block.x);
+    protoblock.set_y(block.y);
+    protoblock.set_z(block.z);
+
+    for (size_t i = 0; i < block.tiles.size(); i++)
+    {
+        const ExportTile &tile = block.tiles[i];
+        dfproto::Tile *prototile = protoblock.add_tile();
+        prototile->set_x(tile.x);
+        prototile->set_y(tile.y);
+        if (tile.flow_size)
+        {
+            prototile->set_liquid_type((dfproto::Tile::LiquidType)tile.liquid_type);
+            prototile->set_flow_size(tile.flow_size);
+        }
+        prototile->set_type((dfproto::Tile::TileType)tile.type);
+        prototile->set_tile_material((dfproto::Tile::TileMaterialType)tile.tile_material);
+        if (tile.flags & ExportTile::HAS_MATERIAL)
+        {
+            prototile->set_material_type(tile.material_type);
+            prototile->set_material_index(tile.material_index);
+        }
+    }
+
+    for (size_t i = 0; i < block.plants.size(); i++)
+    {
+        const ExportPlant &plant = block.plants[i];
+        dfproto::Plant *protoplant = protoblock.add_plant();
+        protoplant->set_x(plant.x);
+        protoplant->set_y(plant.y);
+        protoplant->set_is_shrub(plant.is_shrub);
+        protoplant->set_material(plant.material);
+    }
+
+    coded_output->WriteVarint32(protoblock.ByteSize());
+    protoblock.SerializeToCodedStream(coded_output);
+}
+
+static void compressChunk(ExportChunk *chunk)
+{
+    StringOutputStream raw_output(&chunk->data);
+    {
+        GzipOutputStream zip_output(&raw_output);
+        CodedOutputStream coded_output(&zip_output);
+        for (size_t i = 0; i < chunk->blocks.size(); i++)
+            encodeBlock(chunk->blocks[i], &coded_output);
+    }
+    std::vector<ExportBlock>().swap(chunk->blocks);
+}
+
+/*
+ * Compresses chunks on worker threads. Chunks are written out in the
+ * order they were snapshotted, so the writer waits on each in turn.
+ */
+class ExportPool
+{
+public:
+    ExportPool(unsigned count) : stopping(false)
+    {
+        for (unsigned i = 0; i < count; i++)
+            threads.push_back(new tthread::thread(worker, this));
+    }
+    ~ExportPool()
+    {
+        {
+            tthread::lock_guard<tthread::mutex> guard(lock);
+            stopping = true;
+            work_cond.notify_all();
+        }
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i]->join();
+            delete threads[i];
+        }
+    }
+
+    void submit(ExportChunk *chunk)
+    {
+        tthread::lock_guard<tthread::mutex> guard(lock);
+        queue.push_back(chunk);
+        work_cond.notify_one();
+    }
+
+    bool isDone(ExportChunk *chunk)
+    {
+        tthread::lock_guard<tthread::mutex> guard(lock);
+        return chunk->done;
+    }
+
+    void wait(ExportChunk *chunk)
+    {
+        tthread::lock_guard<tthread::mutex> guard(lock);
+        while (!chunk->done)
+            done_cond.wait(lock);
+    }
+
+private:
+    static void worker(void *arg)
+    {
+        ExportPool *pool = (ExportPool*)arg;
+        tthread::lock_guard<tthread::mutex> guard(pool->lock);
+        for (;;)
+        {
+            while (pool->queue.empty() && !pool->stopping)
+                pool->work_cond.wait(pool->lock);
+            if (pool->queue.empty())
+                return;
+
+            ExportChunk *chunk = pool->queue.front();
+            pool->queue.pop_front();
+
+            pool->lock.unlock();
+            compressChunk(chunk);
+            pool->lock.lock();
+
+            chunk->done = true;
+            pool->done_cond.notify_all();
+        }
+    }
+
+    tthread::mutex lock;
+    tthread::condition_variable work_cond;
+    tthread::condition_variable done_cond;
+    std::deque<ExportChunk*> queue;
+    std::vector<tthread::thread*> threads;
+    bool stopping;
+};
+
+static void writeLE(std::ofstream &file, uint64_t value, int bytes)
+{
+    char buf[8];
+    for (int i = 0; i < bytes; i++)
+        buf[i] = char(value >> (8*i));
+    file.write(buf, bytes);
+}
+
+struct IndexEntry
+{
+    int16_t z, y, x_min, x_max;
+    uint32_t blocks;
+    uint64_t offset;
+    uint32_t size;
+};
+
+static void writeChunk(std::ofstream &file, ExportChunk *chunk, std::vector<IndexEntry> &index)
+{
+    IndexEntry entry;
+    entry.z = chunk->z;
+    entry.y = chunk->y;
+    entry.x_min = chunk->x_min;
+    entry.x_max = chunk->x_max;
+    entry.blocks = chunk->count;
+    entry.offset = uint64_t(file.tellp());
+    entry.size = chunk->data.size();
+    file.write(chunk->data.data(), chunk->data.size());
+    index.push_back(entry);
+}
+
+// tile coordinates "a-b" or "a", converted to an inclusive block range
+static bool parseRange(const std::string &arg, int32_t div, int32_t *lo, int32_t *hi)
+{
+    int a, b;
+    if (sscanf(arg.c_str(), "%d-%d", &a, &b) == 2)
+        ;
+    else if (sscanf(arg.c_str(), "%d", &a) == 1)
+        b = a;
+    else
+        return false;
+    if (a > b || a < 0)
+        return false;
+    *lo = a / div;
+    *hi = b / div;
+    return true;
+}
+
 command_result mapexport (color_ostream &out, std::vector <std::string> & parameters)
 {
-    bool showHidden = false;
+    ExportOptions opts;
+    opts.showHidden = false;
+    opts.chunked = false;
+    opts.changedOnly = false;
+    opts.x_min = opts.y_min = opts.z_min = 0;
+    opts.x_max = opts.y_max = opts.z_max = INT_MAX;
 
-    int filenameParameter = 1;
+    std::string filename;
 
     for(size_t i = 0; i < parameters.size();i++)
     {
-        if(parameters[i] == "help" || parameters[i] == "?")
+        const std::string &param = parameters[i];
+        if(param == "help" || param == "?")
         {
             out.print("Exports the currently visible map to a file.\n"
                          "Usage: mapexport [options] <filename>\n"
                          "Example: mapexport all embark.dfmap\n"
                          "Options:\n"
-                         "   all   - Export the entire map, not just what's revealed.\n"
+                         "   all       - Export the entire map, not just what's revealed.\n"
+                         "   chunked   - Write an indexed file of separately compressed block\n"
+                         "               rows that readers can seek in, compressing on all cores.\n"
+                         "   changed   - Only export blocks that changed since the last export.\n"
+                         "   x=A-B, y=A-B, z=A-B\n"
+                         "             - Only export blocks overlapping these tile ranges.\n"
             );
             return CR_OK;
         }
-        if (parameters[i] == "all")
+        if (param == "all")
+            opts.showHidden = true;
+        else if (param == "chunked")
+            opts.chunked = true;
+        else if (param == "changed")
+            opts.changedOnly = true;
+        else if (param.size() > 2 && param[1] == '=' && (param[0] == 'x' || param[0] == 'y' || param[0] == 'z'))
         {
-            showHidden = true;
-            filenameParameter++;
+            bool ok;
+            if (param[0] == 'x')
+                ok = parseRange(param.substr(2), 16, &opts.x_min, &opts.x_max);
+            else if (param[0] == 'y')
+                ok = parseRange(param.substr(2), 16, &opts.y_min, &opts.y_max);
+            else
+                ok = parseRange(param.substr(2), 1, &opts.z_min, &opts.z_max);
+            if (!ok)
+            {
+                out.printerr("Invalid range: %s\n", param.c_str());
+                return CR_WRONG_USAGE;
+            }
         }
+        else
+            filename = param;
     }
 
-    CoreSuspender suspend;
-
-    uint32_t x_max=0, y_max=0, z_max=0;
-
-    if (!Maps::IsValid())
-    {
-        out.printerr("Map is not available!\n");
-        return CR_FAILURE;
-    }
-
-    if (parameters.size() < filenameParameter)
+    if (filename.empty())
     {
         out.printerr("Please supply a filename.\n");
         return CR_FAILURE;
     }
 
-    std::string filename = parameters[filenameParameter-1];
     if (filename.rfind(".dfmap") == std::string::npos) filename += ".dfmap";
-    out << "Writing to " << filename << "..." << std::endl;
 
-    std::ofstream output_file(filename.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
-    if (!output_file.is_open())
+    uint32_t x_max=0, y_max=0, z_max=0;
+    dfproto::Map protomap;
+    ConstructionMap constructionMaterials;
+    // the map must not be replaced while the core is released between slabs
+    void *map_identity;
+
     {
-        out.printerr("Couldn't open the output file.\n");
-        return CR_FAILURE;
-    }
-    ZeroCopyOutputStream *raw_output = new OstreamOutputStream(&output_file);
-    GzipOutputStream *zip_output = new GzipOutputStream(raw_output);
-    CodedOutputStream *coded_output = new CodedOutputStream(zip_output);
+        CoreSuspender suspend;
 
-    coded_output->WriteLittleEndian32(0x50414DDF); //Write our file header
+        if (!Maps::IsValid())
+        {
+            out.printerr("Map is not available!\n");
+            return CR_FAILURE;
+        }
 
-    Maps::getSize(x_max, y_max, z_max);
-    MapExtras::MapCache map;
-    DFHack::Materials *mats = Core::getInstance().getMaterials();
+        Maps::getSize(x_max, y_max, z_max);
+        protomap.set_x_size(x_max);
+        protomap.set_y_size(y_max);
+        protomap.set_z_size(z_max);
 
-    out << "Writing  map info..." << std::endl;
+        out << "Writing material dictionary..." << std::endl;
 
-    dfproto::Map protomap;
-    protomap.set_x_size(x_max);
-    protomap.set_y_size(y_max);
-    protomap.set_z_size(z_max);
+        for (size_t i = 0; i < world->raws.inorganics.size(); i++)
+        {
+            dfproto::Material *protomaterial = protomap.add_inorganic_material();
+            protomaterial->set_index(i);
+            protomaterial->set_name(world->raws.inorganics[i]->id);
+        }
 
-    out << "Writing material dictionary..." << std::endl;
-    
-    for (size_t i = 0; i < world->raws.inorganics.size(); i++)
-    {
-        dfproto::Material *protomaterial = protomap.add_inorganic_material();
-        protomaterial->set_index(i);
-        protomaterial->set_name(world->raws.inorganics[i]->id);
+        for (size_t i = 0; i < world->raws.plants.all.size(); i++)
+        {
+            dfproto::Material *protomaterial = protomap.add_organic_material();
+            protomaterial->set_index(i);
+            protomaterial->set_name(world->raws.plants.all[i]->id);
+        }
+
+        if (Constructions::isValid())
+        {
+            for (uint32_t i = 0; i < Constructions::getCount(); i++)
+            {
+                df::construction *construction = Constructions::getConstruction(i);
+                constructionMaterials[construction->pos] = std::make_pair(construction->mat_index, construction->mat_type);
+            }
+        }
+
+        map_identity = world->map.block_index;
     }
 
-    for (size_t i = 0; i < world->raws.plants.all.size(); i++)
+    opts.x_max = std::min(opts.x_max, int32_t(x_max)-1);
+    opts.y_max = std::min(opts.y_max, int32_t(y_max)-1);
+    opts.z_max = std::min(opts.z_max, int32_t(z_max)-1);
+
+    out << "Writing to " << filename << "..." << std::endl;
+
+    std::ofstream output_file(filename.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!output_file.is_open())
     {
-        dfproto::Material *protomaterial = protomap.add_organic_material();
-        protomaterial->set_index(i);
-        protomaterial->set_name(world->raws.plants.all[i]->id);
+        out.printerr("Couldn't open the output file.\n");
+        return CR_FAILURE;
     }
 
-    std::map<df::coord,std::pair<uint32_t,uint16_t> > constructionMaterials;
-    if (Constructions::isValid())
+    /*
+     * Chunked format, all integers little-endian:
+     *   uint32 0x50414DDF, uint32 2 (version)
+     *   gzip stream holding the varint-delimited dfproto::Map
+     *   gzip streams of varint-delimited dfproto::Block, one per row of blocks
+     *   index: per row, int16 z, y, x_min, x_max, uint32 blocks, uint64 offset, uint32 size
+     *   trailer: uint32 index entries, uint64 index offset, uint32 0x50414DDF
+     * Readers can seek to the trailer and inflate only the rows they need.
+     * The plain format is one gzip stream of the magic, Map and all Blocks.
+     */
+    ZeroCopyOutputStream *raw_output = NULL;
+    GzipOutputStream *zip_output = NULL;
+    CodedOutputStream *coded_output = NULL;
+    ExportPool *pool = NULL;
+    std::vector<IndexEntry> index;
+    std::deque<ExportChunk*> pending;
+
+    if (opts.chunked)
     {
-        for (uint32_t i = 0; i < Constructions::getCount(); i++)
+        writeLE(output_file, 0x50414DDF, 4);
+        writeLE(output_file, 2, 4);
+        std::string header;
+        StringOutputStream header_output(&header);
         {
-            df::construction *construction = Constructions::getConstruction(i);
-            constructionMaterials[construction->pos] = std::make_pair(construction->mat_index, construction->mat_type);
+            GzipOutputStream header_zip(&header_output);
+            CodedOutputStream header_coded(&header_zip);
+            header_coded.WriteVarint32(protomap.ByteSize());
+            protomap.SerializeToCodedStream(&header_coded);
         }
+        output_file.write(header.data(), header.size());
+
+        unsigned threads = tthread::thread::hardware_concurrency();
+        pool = new ExportPool(std::max(1u, threads));
+    }
+    else
+    {
+        raw_output = new OstreamOutputStream(&output_file);
+        zip_output = new GzipOutputStream(raw_output);
+        coded_output = new CodedOutputStream(zip_output);
+
+        coded_output->WriteLittleEndian32(0x50414DDF); //Write our file header
+        coded_output->WriteVarint32(protomap.ByteSize());
+        protomap.SerializeToCodedStream(coded_output);
     }
-        
-    coded_output->WriteVarint32(protomap.ByteSize());
-    protomap.SerializeToCodedStream(coded_output);
-    
-    DFHack::t_feature blockFeatureGlobal;
-    DFHack::t_feature blockFeatureLocal;
 
     out.print("Writing map block information");
 
-    for(uint32_t z = 0; z < z_max; z++)
+    std::vector<std::pair<df::coord, uint32_t> > newHashes;
+    size_t blockCount = 0, skipped = 0;
+    bool lost_map = false;
+
+    for (int32_t slab = opts.z_min; slab <= opts.z_max && !lost_map; slab += SLAB_Z_LEVELS)
     {
-        for(uint32_t b_y = 0; b_y < y_max; b_y++)
+        std::vector<ExportChunk*> chunks;
         {
-            for(uint32_t b_x = 0; b_x < x_max; b_x++)
+            CoreSuspender suspend;
+            uint32_t x_now, y_now, z_now;
+            if (!Maps::IsValid() || (void*)world->map.block_index != map_identity)
             {
-                if (b_x == 0 && b_y == 0 && z % 10 == 0) out.print(".");
-                // Get the map block
-                df::coord2d blockCoord(b_x, b_y);
-                MapExtras::Block *b = map.BlockAt(DFHack::DFCoord(b_x, b_y, z));
-                if (!b || !b->is_valid())
-                {
-                    continue;
-                }
-
-                dfproto::Block protoblock;
-                protoblock.set_x(b_x);
-                protoblock.set_y(b_y);
-                protoblock.set_z(z);
-
-                // Find features
-                b->GetGlobalFeature(&blockFeatureGlobal);
-                b->GetLocalFeature(&blockFeatureLocal);
+                lost_map = true;
+                break;
+            }
+            Maps::getSize(x_now, y_now, z_now);
+            if (x_now != x_max || y_now != y_max || z_now != z_max)
+            {
+                lost_map = true;
+                break;
+            }
 
-                int global_z = df::global::world->map.region_z + z;
+            // cached blocks hold region and biome pointers, so only live for one slab
+            MapExtras::MapCache map;
 
-                // Iterate over all the tiles in the block
-                for(uint32_t y = 0; y < 16; y++)
+            int32_t slab_end = std::min(opts.z_max, int32_t(slab + SLAB_Z_LEVELS - 1));
+            for (int32_t z = slab; z <= slab_end; z++)
+            {
+                for (int32_t b_y = opts.y_min; b_y <= opts.y_max; b_y++)
                 {
-                    for(uint32_t x = 0; x < 16; x++)
-                    {
-                        df::coord2d coord(x, y);
-                        df::tile_designation des = b->DesignationAt(coord);
-                        df::tile_occupancy occ = b->OccupancyAt(coord);
+                    ExportChunk *chunk = new ExportChunk();
+                    chunk->z = z;
+                    chunk->y = b_y;
+                    chunk->x_min = opts.x_min;
+                    chunk->x_max = opts.x_max;
 
-                        // Skip hidden tiles
-                        if (!showHidden && des.bits.hidden)
-                        {
+                    for (int32_t b_x = opts.x_min; b_x <= opts.x_max; b_x++)
+                    {
+                        // Get the map block
+                        MapExtras::Block *b = map.BlockAt(DFHack::DFCoord(b_x, b_y, z));
+                        if (!b || !b->is_valid())
                             continue;
-                        }
-
-                        dfproto::Tile *prototile = protoblock.add_tile();
-                        prototile->set_x(x);
-                        prototile->set_y(y);
-
-                        // Check for liquid
-                        if (des.bits.flow_size)
-                        {
-                            prototile->set_liquid_type((dfproto::Tile::LiquidType)des.bits.liquid_type);
-                            prototile->set_flow_size(des.bits.flow_size);
-                        }
 
-                        df::tiletype type = b->tiletypeAt(coord);
-                        prototile->set_type((dfproto::Tile::TileType)tileShape(type));
-                        prototile->set_tile_material(toProto(tileMaterial(type)));
+                        chunk->blocks.push_back(ExportBlock());
+                        ExportBlock &eb = chunk->blocks.back();
+                        eb.x = b_x;
+                        eb.y = b_y;
+                        eb.z = z;
+                        snapshotBlock(&eb, b, constructionMaterials, opts.showHidden);
 
-                        df::coord map_pos = df::coord(b_x*16+x,b_y*16+y,z);
-                        
-                        switch (tileMaterial(type))
+                        df::coord bpos(b_x, b_y, z);
+                        uint32_t hash = hashBlock(eb);
+                        if (opts.changedOnly)
                         {
-                        case tiletype_material::SOIL:
-                        case tiletype_material::STONE:
-                            prototile->set_material_type(0);
-                            prototile->set_material_index(b->layerMaterialAt(coord));
-                            break;
-                        case tiletype_material::MINERAL:
-                            prototile->set_material_type(0);
-                            prototile->set_material_index(b->veinMaterialAt(coord));
-                            break;
-                        case tiletype_material::FEATURE:
-                            if (blockFeatureLocal.type != -1 && des.bits.feature_local)
+                            std::map<df::coord, uint32_t>::iterator it = exportedHashes.find(bpos);
+                            if (it != exportedHashes.end() && it->second == hash)
                             {
-                                if (blockFeatureLocal.type == feature_type::deep_special_tube
-                                        && blockFeatureLocal.main_material == 0) // stone
-                                {
-                                    prototile->set_material_type(0);
-                                    prototile->set_material_index(blockFeatureLocal.sub_material);
-                                }
-                                if (blockFeatureGlobal.type != -1 && des.bits.feature_global
-                                        && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
-                                        && blockFeatureGlobal.main_material == 0) // stone
-                                {
-                                    prototile->set_material_type(0);
-                                    prototile->set_material_index(blockFeatureGlobal.sub_material);
-                                }
+                                chunk->blocks.pop_back();
+                                skipped++;
+                                continue;
                             }
-                            break;
-                        case tiletype_material::CONSTRUCTION:
-                            if (constructionMaterials.find(map_pos) != constructionMaterials.end())
-                            {
-                                prototile->set_material_index(constructionMaterials[map_pos].first);
-                                prototile->set_material_type(constructionMaterials[map_pos].second);
-                            }
-                            break;
-                        default:
-                            break;
                         }
+                        newHashes.push_back(std::make_pair(bpos, hash));
                     }
-                }
 
-                if (b->getRaw())
-                {
-                    PlantList *plants = &b->getRaw()->plants;
-                    for (PlantList::const_iterator it = plants->begin(); it != plants->end(); it++)
-                    {
-                        const df::plant & plant = *(*it);
-                        df::coord2d loc(plant.pos.x, plant.pos.y);
-                        loc = loc % 16;
-                        if (showHidden || !b->DesignationAt(loc).bits.hidden)
-                        {
-                            dfproto::Plant *protoplant = protoblock.add_plant();
-                            protoplant->set_x(loc.x);
-                            protoplant->set_y(loc.y);
-                            protoplant->set_is_shrub(plant.flags.bits.is_shrub);
-                            protoplant->set_material(plant.material);
-                        }
-                    }
+                    if (chunk->blocks.empty())
+                        delete chunk;
+                    else
+                        chunks.push_back(chunk);
                 }
-                
-                coded_output->WriteVarint32(protoblock.ByteSize());
-                protoblock.SerializeToCodedStream(coded_output);
-            } // block x
-            // Clean uneeded memory
-            map.trash();
-        } // block y
-    } // z
+            }
+        }
+
+        out.print(".");
+
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            ExportChunk *chunk = chunks[i];
+            chunk->count = chunk->blocks.size();
+            blockCount += chunk->count;
+            if (pool)
+            {
+                pool->submit(chunk);
+                pending.push_back(chunk);
+            }
+            else
+            {
+                for (size_t j = 0; j < chunk->blocks.size(); j++)
+                    encodeBlock(chunk->blocks[j], coded_output);
+                delete chunk;
+            }
+        }
+
+        // write what is ready, and bound the memory held by queued slabs
+        while (!pending.empty() && (pending.size() > 4*chunks.size() || pool->isDone(pending.front())))
+        {
+            ExportChunk *chunk = pending.front();
+            pool->wait(chunk);
+            writeChunk(output_file, chunk, index);
+            pending.pop_front();
+            delete chunk;
+        }
+    }
 
+    while (!pending.empty())
+    {
+        ExportChunk *chunk = pending.front();
+        pool->wait(chunk);
+        writeChunk(output_file, chunk, index);
+        pending.pop_front();
+        delete chunk;
+    }
+
+    delete pool;
     delete coded_output;
     delete zip_output;
     delete raw_output;
 
-    mats->Finish();
+    if (opts.chunked)
+    {
+        uint64_t index_offset = uint64_t(output_file.tellp());
+        for (size_t i = 0; i < index.size(); i++)
+        {
+            writeLE(output_file, uint16_t(index[i].z), 2);
+            writeLE(output_file, uint16_t(index[i].y), 2);
+            writeLE(output_file, uint16_t(index[i].x_min), 2);
+            writeLE(output_file, uint16_t(index[i].x_max), 2);
+            writeLE(output_file, index[i].blocks, 4);
+            writeLE(output_file, index[i].offset, 8);
+            writeLE(output_file, index[i].size, 4);
+        }
+        writeLE(output_file, index.size(), 4);
+        writeLE(output_file, index_offset, 8);
+        writeLE(output_file, 0x50414DDF, 4);
+    }
+    output_file.close();
+
+    {
+        CoreSuspender suspend;
+        if (lost_map)
+        {
+            out.printerr("\nThe map was unloaded during the export.\n");
+            return CR_FAILURE;
+        }
+        for (size_t i = 0; i < newHashes.size(); i++)
+            exportedHashes[newHashes[i].first] = newHashes[i].second;
+    }
+
+    if (opts.changedOnly)
+        out.print("\n%d changed blocks exported, %d unchanged skipped.\n", (int)blockCount, (int)skipped);
     out.print("\nMap succesfully exported!\n");
     return CR_OK;
 }
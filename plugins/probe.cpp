@@ -41,6 +41,7 @@ command_result df_cprobe (color_ostream &out, vector <string> & parameters);
 command_result df_bprobe (color_ostream &out, vector <string> & parameters);
 
 DFHACK_PLUGIN("probe");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
 {
@@ -19,6 +19,7 @@ using namespace std;
 #include "Export.h"
 #include "PluginManager.h"
 #include "modules/MapCache.h"
+#include "modules/MapCensus.h"
 
 #include "MiscUtils.h"
 
@@ -114,6 +115,21 @@ struct compare_pair_second
     }
 };
 
+static matdata toMatdata(const MapCensus::Count &count)
+{
+    matdata data;
+    data.count = count.count;
+    data.lower_z = count.lower_z;
+    data.upper_z = count.upper_z;
+    return data;
+}
+
+static void toMatMap(MatMap &mat, const MapCensus::CountMap &counts)
+{
+    for (MapCensus::CountMap::const_iterator it = counts.begin(); it != counts.end(); ++it)
+        mat[it->first] = toMatdata(it->second);
+}
+
 static void printMatdata(color_ostream &con, const matdata &data, bool only_z = false)
 {
     if (!only_z)
@@ -199,6 +215,7 @@ void printVeins(color_ostream &con, MatMap &mat_map,
 command_result prospector (color_ostream &out, vector <string> & parameters);
 
 DFHACK_PLUGIN("prospector");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 DFhackCExport command_result plugin_init ( color_ostream &out, std::vector <PluginCommand> &commands)
 {
@@ -549,8 +566,6 @@ command_result prospector (color_ostream &con, vector <string> & parameters)
 {
     bool showHidden = false;
     bool showPlants = true;
-    bool showSlade = true;
-    bool showTemple = true;
     bool showValue = false;
     bool showTube = false;
 
@@ -584,188 +599,37 @@ command_result prospector (color_ostream &con, vector <string> & parameters)
         return CR_FAILURE;
     }
 
-    uint32_t x_max = 0, y_max = 0, z_max = 0;
-    Maps::getSize(x_max, y_max, z_max);
-    MapExtras::MapCache map;
-
     DFHack::Materials *mats = Core::getInstance().getMaterials();
 
-    DFHack::t_feature blockFeatureGlobal;
-    DFHack::t_feature blockFeatureLocal;
+    MapCensus::Options options;
+    options.hidden = showHidden;
+    options.plants = showPlants;
+    MapCensus::Result census;
+    if (!MapCensus::scan(&census, options))
+    {
+        con.printerr("Could not scan the map!\n");
+        return CR_FAILURE;
+    }
 
-    bool hasAquifer = false;
-    bool hasDemonTemple = false;
-    bool hasLair = false;
     MatMap baseMats;
     MatMap layerMats;
     MatMap veinMats;
     MatMap plantMats;
     MatMap treeMats;
-
-    matdata liquidWater;
-    matdata liquidMagma;
-    matdata aquiferTiles;
-    matdata tubeTiles;
-
-    uint32_t vegCount = 0;
-
-    for(uint32_t z = 0; z < z_max; z++)
-    {
-        for(uint32_t b_y = 0; b_y < y_max; b_y++)
-        {
-            for(uint32_t b_x = 0; b_x < x_max; b_x++)
-            {
-                // Get the map block
-                df::coord2d blockCoord(b_x, b_y);
-                MapExtras::Block *b = map.BlockAt(DFHack::DFCoord(b_x, b_y, z));
-                if (!b || !b->is_valid())
-                {
-                    continue;
-                }
-
-                // Find features
-                b->GetGlobalFeature(&blockFeatureGlobal);
-                b->GetLocalFeature(&blockFeatureLocal);
-
-                int global_z = world->map.region_z + z;
-
-                // Iterate over all the tiles in the block
-                for(uint32_t y = 0; y < 16; y++)
-                {
-                    for(uint32_t x = 0; x < 16; x++)
-                    {
-                        df::coord2d coord(x, y);
-                        df::tile_designation des = b->DesignationAt(coord);
-                        df::tile_occupancy occ = b->OccupancyAt(coord);
-
-                        // Skip hidden tiles
-                        if (!showHidden && des.bits.hidden)
-                        {
-                            continue;
-                        }
-
-                        // Check for aquifer
-                        if (des.bits.water_table)
-                        {
-                            hasAquifer = true;
-                            aquiferTiles.add(global_z);
-                        }
-
-                        // Check for lairs
-                        if (occ.bits.monster_lair)
-                        {
-                            hasLair = true;
-                        }
-
-                        // Check for liquid
-                        if (des.bits.flow_size)
-                        {
-                            if (des.bits.liquid_type == tile_liquid::Magma)
-                                liquidMagma.add(global_z);
-                            else
-                                liquidWater.add(global_z);
-                        }
-
-                        df::tiletype type = b->tiletypeAt(coord);
-                        df::tiletype_shape tileshape = tileShape(type);
-                        df::tiletype_material tilemat = tileMaterial(type);
-
-                        // We only care about these types
-                        switch (tileshape)
-                        {
-                        case tiletype_shape::WALL:
-                        case tiletype_shape::FORTIFICATION:
-                            break;
-                        case tiletype_shape::EMPTY:
-                            /* A heuristic: tubes inside adamantine have EMPTY:AIR tiles which
-                               still have feature_local set. Also check the unrevealed status,
-                               so as to exclude any holes mined by the player. */
-                            if (tilemat == tiletype_material::AIR &&
-                                des.bits.feature_local && des.bits.hidden &&
-                                blockFeatureLocal.type == feature_type::deep_special_tube)
-                            {
-                                tubeTiles.add(global_z);
-                            }
-                        default:
-                            continue;
-                        }
-
-                        // Count the material type
-                        baseMats[tilemat].add(global_z);
-
-                        // Find the type of the tile
-                        switch (tilemat)
-                        {
-                        case tiletype_material::SOIL:
-                        case tiletype_material::STONE:
-                            layerMats[b->layerMaterialAt(coord)].add(global_z);
-                            break;
-                        case tiletype_material::MINERAL:
-                            veinMats[b->veinMaterialAt(coord)].add(global_z);
-                            break;
-                        case tiletype_material::FEATURE:
-                            if (blockFeatureLocal.type != -1 && des.bits.feature_local)
-                            {
-                                if (blockFeatureLocal.type == feature_type::deep_special_tube
-                                        && blockFeatureLocal.main_material == 0) // stone
-                                {
-                                    veinMats[blockFeatureLocal.sub_material].add(global_z);
-                                }
-                                else if (showTemple
-                                         && blockFeatureLocal.type == feature_type::deep_surface_portal)
-                                {
-                                    hasDemonTemple = true;
-                                }
-                            }
-
-                            if (showSlade && blockFeatureGlobal.type != -1 && des.bits.feature_global
-                                    && blockFeatureGlobal.type == feature_type::feature_underworld_from_layer
-                                    && blockFeatureGlobal.main_material == 0) // stone
-                            {
-                                layerMats[blockFeatureGlobal.sub_material].add(global_z);
-                            }
-                            break;
-                        case tiletype_material::LAVA_STONE:
-                            // TODO ?
-                            break;
-                        default:
-                            break;
-                        }
-                    }
-                }
-
-                // Check plants this way, as the other way wasn't getting them all
-                // and we can check visibility more easily here
-                if (showPlants)
-                {
-                    auto block = Maps::getBlockColumn(b_x,b_y);
-                    vector<df::plant *> *plants = block ? &block->plants : NULL;
-                    if(plants)
-                    {
-                        for (PlantList::const_iterator it = plants->begin(); it != plants->end(); it++)
-                        {
-                            const df::plant & plant = *(*it);
-                            if (plant.pos.z != z)
-                                continue;
-                            df::coord2d loc(plant.pos.x, plant.pos.y);
-                            loc = loc % 16;
-                            if (showHidden || !b->DesignationAt(loc).bits.hidden)
-                            {
-                                if(plant.flags.bits.is_shrub)
-                                    plantMats[plant.material].add(global_z);
-                                else
-                                    treeMats[plant.material].add(global_z);
-                            }
-                        }
-                    }
-                }
-                // Block end
-            } // block x
-
-            // Clean uneeded memory
-            map.trash();
-        } // block y
-    } // z
+    toMatMap(baseMats, census.base);
+    toMatMap(layerMats, census.layer);
+    toMatMap(veinMats, census.vein);
+    toMatMap(plantMats, census.shrub);
+    toMatMap(treeMats, census.tree);
+
+    matdata liquidWater = toMatdata(census.water);
+    matdata liquidMagma = toMatdata(census.magma);
+    matdata aquiferTiles = toMatdata(census.aquifer);
+    matdata tubeTiles = toMatdata(census.tube);
+
+    bool hasAquifer = census.aquifer.count > 0;
+    bool hasDemonTemple = census.has_demon_temple;
+    bool hasLair = census.has_lair;
 
     MatMap::const_iterator it;
 
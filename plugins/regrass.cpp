@@ -25,6 +25,7 @@ using namespace DFHack;
 using df::global::world;
 
 DFHACK_PLUGIN("regrass");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 command_result df_regrass (color_ostream &out, vector <string> & parameters);
 
@@ -26,6 +26,7 @@
 #include "df/material_vec_ref.h"
 #include "df/builtin_mats.h"
 #include "df/map_block_column.h"
+#include "df/construction.h"
 #include "df/plant.h"
 #include "df/plant_tree_info.h"
 #include "df/plant_growth.h"
@@ -45,6 +46,8 @@
 #include "TileTypes.h"
 
 #include <vector>
+#include <algorithm>
+#include <cstring>
 #include <time.h>
 
 #include "RemoteFortressReader.pb.h"
@@ -62,11 +65,31 @@ using namespace std;
 static command_result GetGrowthList(color_ostream &stream, const EmptyMessage *in, MaterialList *out);
 static command_result GetMaterialList(color_ostream &stream, const EmptyMessage *in, MaterialList *out);
 static command_result GetTiletypeList(color_ostream &stream, const EmptyMessage *in, TiletypeList *out);
-static command_result GetBlockList(color_ostream &stream, const BlockRequest *in, BlockList *out);
 static command_result GetPlantList(color_ostream &stream, const BlockRequest *in, PlantList *out);
 static command_result CheckHashes(color_ostream &stream, const EmptyMessage *in);
 void CopyBlock(df::map_block * DfBlock, RemoteFortressReader::MapBlock * NetBlock, MapExtras::MapCache * MC);
-void FindChangedBlocks();
+void CopyBlockPacked(df::map_block * DfBlock, RemoteFortressReader::MapBlock * NetBlock, MapExtras::MapCache * MC, bool designations);
+uint16_t fletcher16(uint8_t const *data, size_t bytes);
+
+// One instance per client connection. Remembers which blocks the client
+// was sent, so that GetBlockList only returns the ones that changed.
+class RemoteFortressReaderService : public RPCService
+{
+    // Indexed by block position; a block is up to date on the client if
+    // both the pointer (changes on map reload) and the content hash match.
+    std::vector<df::map_block*> sent_blocks;
+    std::vector<uint64_t> sent_hashes;
+    int grid_x, grid_y, grid_z;
+    // packed/designations flags of the blocks that were sent
+    int sent_format;
+
+    void checkGrid();
+
+public:
+    RemoteFortressReaderService();
+
+    command_result GetBlockList(color_ostream &stream, const BlockRequest *in, BlockList *out);
+};
 
 const char* growth_locations[] = {
     "TWIGS",
@@ -100,16 +123,20 @@ DFhackCExport command_result plugin_init(color_ostream &out, std::vector <Plugin
     return CR_OK;
 }
 
+RemoteFortressReaderService::RemoteFortressReaderService()
+    : grid_x(0), grid_y(0), grid_z(0), sent_format(-1)
+{
+    addFunction("GetMaterialList", GetMaterialList);
+    addFunction("GetGrowthList", GetGrowthList);
+    addMethod("GetBlockList", &RemoteFortressReaderService::GetBlockList);
+    addFunction("CheckHashes", CheckHashes);
+    addFunction("GetTiletypeList", GetTiletypeList);
+    addFunction("GetPlantList", GetPlantList);
+}
+
 DFhackCExport RPCService *plugin_rpcconnect(color_ostream &)
 {
-    RPCService *svc = new RPCService();
-    svc->addFunction("GetMaterialList", GetMaterialList);
-    svc->addFunction("GetGrowthList", GetGrowthList);
-    svc->addFunction("GetBlockList", GetBlockList);
-    svc->addFunction("CheckHashes", CheckHashes);
-    svc->addFunction("GetTiletypeList", GetTiletypeList);
-    svc->addFunction("GetPlantList", GetPlantList);
-    return svc;
+    return new RemoteFortressReaderService();
 }
 
 // This is called right before the plugin library is removed from memory.
@@ -555,15 +582,137 @@ void CopyBlock(df::map_block * DfBlock, RemoteFortressReader::MapBlock * NetBloc
         {
             df::tiletype tile = DfBlock->tiletype[xx][yy];
             NetBlock->add_tiles(tile);
+            t_matpair mat = block->baseMaterialAt(df::coord2d(xx, yy));
             RemoteFortressReader::MatPair * material = NetBlock->add_materials();
-            material->set_mat_type(block->baseMaterialAt(df::coord2d(xx, yy)).mat_index);
-            material->set_mat_index(block->baseMaterialAt(df::coord2d(xx, yy)).mat_type);
+            material->set_mat_type(mat.mat_type);
+            material->set_mat_index(mat.mat_index);
+        }
+    }
+}
+
+void CopyBlockPacked(df::map_block * DfBlock, RemoteFortressReader::MapBlock * NetBlock, MapExtras::MapCache * MC, bool designations)
+{
+    NetBlock->set_map_x(DfBlock->map_pos.x);
+    NetBlock->set_map_y(DfBlock->map_pos.y);
+    NetBlock->set_map_z(DfBlock->map_pos.z);
+
+    MapExtras::Block * block = MC->BlockAtTile(DfBlock->map_pos);
+    google::protobuf::RepeatedField<google::protobuf::int32> * runs = NetBlock->mutable_material_runs();
+
+    uint8_t tiles[16 * 16 * 2];
+    t_matpair run_mat;
+    int run_len = 0;
+
+    for (int yy = 0; yy < 16; yy++)
+    {
+        for (int xx = 0; xx < 16; xx++)
+        {
+            int i = yy * 16 + xx;
+            uint16_t tile = DfBlock->tiletype[xx][yy];
+            tiles[i * 2] = tile & 0xFF;
+            tiles[i * 2 + 1] = tile >> 8;
+
+            t_matpair mat = block->baseMaterialAt(df::coord2d(xx, yy));
+            if (run_len > 0 && mat.mat_type == run_mat.mat_type && mat.mat_index == run_mat.mat_index)
+            {
+                run_len++;
+                continue;
+            }
+            if (run_len > 0)
+            {
+                runs->Add(run_len);
+                runs->Add(run_mat.mat_type);
+                runs->Add(run_mat.mat_index);
+            }
+            run_mat = mat;
+            run_len = 1;
+        }
+    }
+    runs->Add(run_len);
+    runs->Add(run_mat.mat_type);
+    runs->Add(run_mat.mat_index);
+
+    NetBlock->set_tile_data(tiles, sizeof(tiles));
+
+    if (designations)
+    {
+        uint8_t des[16 * 16 * 4];
+        for (int yy = 0; yy < 16; yy++)
+        {
+            for (int xx = 0; xx < 16; xx++)
+            {
+                int i = (yy * 16 + xx) * 4;
+                uint32_t whole = DfBlock->designation[xx][yy].whole;
+                des[i] = whole & 0xFF;
+                des[i + 1] = (whole >> 8) & 0xFF;
+                des[i + 2] = (whole >> 16) & 0xFF;
+                des[i + 3] = whole >> 24;
+            }
+        }
+        NetBlock->set_designation_data(des, sizeof(des));
+    }
+}
+
+// Hash of the materials of the constructed tiles in a block
+static uint32_t constructionHash(df::map_block *block)
+{
+    uint8_t data[16 * 16 * 6];
+    size_t size = 0;
+
+    for (int yy = 0; yy < 16; yy++)
+    {
+        for (int xx = 0; xx < 16; xx++)
+        {
+            if (tileMaterial(block->tiletype[xx][yy]) != tiletype_material::CONSTRUCTION)
+                continue;
+            df::construction *con = df::construction::find(block->map_pos + df::coord(xx, yy, 0));
+            if (!con)
+                continue;
+            memcpy(data + size, &con->mat_type, 2);
+            memcpy(data + size + 2, &con->mat_index, 4);
+            size += 6;
         }
     }
+
+    // one more bit, so that no constructions differs from some
+    return size ? 0x10000 | fletcher16(data, size) : 0;
 }
 
-static command_result GetBlockList(color_ostream &stream, const BlockRequest *in, BlockList *out)
+void RemoteFortressReaderService::checkGrid()
 {
+    auto &map = df::global::world->map;
+
+    if (map.x_count_block == grid_x && map.y_count_block == grid_y && map.z_count_block == grid_z)
+        return;
+
+    grid_x = map.x_count_block;
+    grid_y = map.y_count_block;
+    grid_z = map.z_count_block;
+
+    size_t count = std::max(0, grid_x * grid_y * grid_z);
+    sent_blocks.assign(count, NULL);
+    sent_hashes.assign(count, 0);
+}
+
+command_result RemoteFortressReaderService::GetBlockList(color_ostream &stream, const BlockRequest *in, BlockList *out)
+{
+    if (!Maps::IsValid())
+        return CR_OK;
+
+    checkGrid();
+
+    // Blocks sent in another format are of no use to the client
+    int format = (in->packed() ? 1 : 0) | (in->designations() ? 2 : 0);
+    if (format != sent_format)
+    {
+        sent_blocks.assign(sent_blocks.size(), NULL);
+        sent_format = format;
+    }
+    bool send_designations = in->packed() && in->designations();
+
+    // Blocks over the limit stay unsent and are picked up by the next call
+    int limit = in->blocks_needed() > 0 ? in->blocks_needed() : -1;
+
     MapExtras::MapCache MC;
     //stream.print("Got request for blocks from (%d, %d, %d) to (%d, %d, %d).\n", in->min_x(), in->min_y(), in->min_z(), in->max_x(), in->max_y(), in->max_z());
     for (int zz = in->min_z(); zz < in->max_z(); zz++)
@@ -575,11 +724,34 @@ static command_result GetBlockList(color_ostream &stream, const BlockRequest *in
                 df::map_block * block = DFHack::Maps::getBlock(xx, yy, zz);
                 if (block == NULL)
                     continue;
+
+                // Natural materials only change together with the tile type, but a
+                // construction can be rebuilt from another material on the same
+                // tile type, so hash the tiles, construction materials and, when
+                // they are sent, the designations (liquids)
+                size_t index = (size_t(zz) * grid_y + yy) * grid_x + xx;
+                uint64_t hash = fletcher16((uint8_t*)(block->tiletype), 16 * 16 * sizeof(df::enums::tiletype::tiletype));
+                if (send_designations)
+                    hash |= uint64_t(fletcher16((uint8_t*)(block->designation), 16 * 16 * sizeof(df::tile_designation))) << 16;
+                hash |= uint64_t(constructionHash(block)) << 32;
+                if (sent_blocks[index] == block && sent_hashes[index] == hash)
+                    continue;
+
+                if (limit >= 0 && out->map_blocks_size() >= limit)
+                    goto done;
+
                 RemoteFortressReader::MapBlock *net_block = out->add_map_blocks();
-                CopyBlock(block, net_block,&MC);
+                if (in->packed())
+                    CopyBlockPacked(block, net_block, &MC, send_designations);
+                else
+                    CopyBlock(block, net_block,&MC);
+
+                sent_blocks[index] = block;
+                sent_hashes[index] = hash;
             }
         }
     }
+done:
     MC.trash();
     return CR_OK;
 }
@@ -29,6 +29,8 @@
 #include "df/unit.h"
 
 #include <vector>
+#include <algorithm>
+#include <climits>
 
 using df::global::gps;
 using namespace DFHack;
@@ -36,6 +38,7 @@ using df::coord2d;
 using namespace tthread;
 
 const float RootTwo = 1.4142135623730950488016887242097f;
+const int LIGHT_TILE_SIZE = 16;
 
 
 bool isInRect(const coord2d& pos,const rect2d& rect)
@@ -108,6 +111,7 @@ rect2d getMapViewport()
 lightingEngineViewscreen::lightingEngineViewscreen(renderer_light* target):lightingEngine(target),doDebug(false),threading(this)
 {
     reinit();
+    invalidateCache();
     defaultSettings();
     int numTreads=tthread::thread::hardware_concurrency();
     if(numTreads==0)numTreads=1;
@@ -270,6 +274,7 @@ rgbf blend(const rgbf& a,const rgbf& b)
 }
 void lightingEngineViewscreen::clear()
 {
+    invalidateCache(); //also happens on world unload, so drop item and building pointers
     lightMap.assign(lightMap.size(),rgbf(1,1,1));
     tthread::lock_guard<tthread::fast_mutex> guard(myRenderer->dataMutex);
     if(lightMap.size()==myRenderer->lightGrid.size())
@@ -453,15 +458,27 @@ itemLightDef* lightingEngineViewscreen::getItemDef(df::item* it)
     }
 }
 void lightingEngineViewscreen::applyMaterial(int tileId,const matLightDef& mat,float size, float thickness)
+{
+    applyMaterial(ocupancy[tileId],lights[tileId],mat,size,thickness);
+}
+void lightingEngineViewscreen::applyMaterial(rgbf& ocupancy,lightSource& light,const matLightDef& mat,float size, float thickness)
 {
     if(mat.isTransparent)
     {
-       addOclusion(tileId,mat.transparency,thickness);
+        if(thickness > 0.999 && thickness < 1.001)
+            ocupancy*=mat.transparency;
+        else
+            ocupancy*=(mat.transparency.pow(thickness));
     }
     else
-        ocupancy[tileId]=rgbf(0,0,0);
+        ocupancy=rgbf(0,0,0);
     if(mat.isEmiting)
-        addLight(tileId,mat.makeSource(size));
+    {
+        lightSource source=mat.makeSource(size);
+        light.combine(source);
+        if(source.flicker)
+            light.flicker=true;
+    }
 }
 bool lightingEngineViewscreen::applyMaterial(int tileId,int matType,int matIndex,float size,float thickness,const matLightDef* def)
 {
@@ -538,60 +555,117 @@ coord2d lightingEngineViewscreen::worldToViewportCoord(const coord2d& in,const r
 }
 
 static size_t max_list_size = 100000; // Avoid iterating over huge lists
-void lightingEngineViewscreen::doSun(const lightSource& sky,MapExtras::MapCache& map)
+static uint32_t hashBytes(uint32_t hash,const void* data,size_t size)
 {
-    //TODO fix this mess
-    int window_x=*df::global::window_x;
-    int window_y=*df::global::window_y;
-    coord2d window2d(window_x,window_y);
-    int window_z=*df::global::window_z;
-    rect2d vp=getMapViewport();
-    coord2d vpSize=rect_size(vp);
-    rect2d blockVp;
-    blockVp.first=window2d/16;
-    blockVp.second=(window2d+vpSize)/16;
-    blockVp.second.x=std::min(blockVp.second.x,(int16_t)df::global::world->map.x_count_block);
-    blockVp.second.y=std::min(blockVp.second.y,(int16_t)df::global::world->map.y_count_block);
-    //endof mess
-    for(int blockX=blockVp.first.x;blockX<=blockVp.second.x;blockX++)
-    for(int blockY=blockVp.first.y;blockY<=blockVp.second.y;blockY++)
+    const uint8_t* bytes=(const uint8_t*)data;
+    for(size_t i=0;i<size;i++)
+        hash=(hash^bytes[i])*16777619u;
+    return hash;
+}
+static uint32_t hashBlock(uint32_t hash,df::map_block* block)
+{
+    if(!block)
+        return hash*16777619u;
+    hash=hashBytes(hash,block->tiletype,sizeof(block->tiletype));
+    return hashBytes(hash,block->designation,sizeof(block->designation));
+}
+void lightingEngineViewscreen::invalidateCache()
+{
+    blockCache.clear();
+    sunCheck=0;
+    lightItems.clear();
+    lightItemsSize=0;
+    lightItemsNextId=-1;
+    lightBuildings.clear();
+    lightBuildingsSize=0;
+    lightBuildingsNextId=-1;
+}
+void lightingEngineViewscreen::buildBlockTiles(lightBlockCache& c,MapExtras::MapCache& map,int blockX,int blockY,int z)
+{
+    MapExtras::Block* b=map.BlockAt(DFCoord(blockX,blockY,z));
+    MapExtras::Block* bDown=map.BlockAt(DFCoord(blockX,blockY,z-1));
+    for(int block_x = 0; block_x < 16; block_x++)
+    for(int block_y = 0; block_y < 16; block_y++)
     {
-        rgbf cellArray[16][16];
-        for(int block_x = 0; block_x < 16; block_x++)
-        for(int block_y = 0; block_y < 16; block_y++)
-            cellArray[block_x][block_y] = sky.power;
+        c.lights[block_x][block_y]=lightSource();
+        rgbf& curCell=c.ocupancy[block_x][block_y];
+        curCell=matAmbience.transparency;
+        if(!b)
+            continue; //empty blocks fixed by sun propagation
+        lightSource& curLight=c.lights[block_x][block_y];
+        df::coord2d gpos(blockX*16+block_x,blockY*16+block_y);
 
-        int emptyCell=0;
-        for(int z=window_z;z< df::global::world->map.z_count && emptyCell<256;z++)
+        df::tiletype type = b->tiletypeAt(gpos);
+        df::tile_designation d = b->DesignationAt(gpos);
+        if(d.bits.hidden )
         {
-            MapExtras::Block* b=map.BlockAt(DFCoord(blockX,blockY,z));
-            if(!b)
-                continue;
-            emptyCell=0;
-            for(int block_x = 0; block_x < 16; block_x++)
-            for(int block_y = 0; block_y < 16; block_y++)
+            curCell=rgbf(0,0,0);
+            continue; // do not process hidden stuff, TODO other hidden stuff
+        }
+        //df::tile_occupancy o = b->OccupancyAt(gpos);
+        df::tiletype_shape shape = ENUM_ATTR(tiletype,shape,type);
+        bool is_wall=!ENUM_ATTR(tiletype_shape,passable_high,shape);
+        bool is_floor=!ENUM_ATTR(tiletype_shape,passable_low,shape);
+        df::tiletype_shape_basic basic_shape = ENUM_ATTR(tiletype_shape, basic_shape, shape);
+        df::tiletype_material tileMat= ENUM_ATTR(tiletype,material,type);
+
+        DFHack::t_matpair mat=b->staticMaterialAt(gpos);
+
+        matLightDef* lightDef=getMaterialDef(mat.mat_type,mat.mat_index);
+        if(!lightDef || !lightDef->isTransparent)
+            lightDef=&matWall;
+        if(shape==df::tiletype_shape::BROOK_BED )
+        {
+            curCell=rgbf(0,0,0);
+        }
+        else if(is_wall)
+        {
+            if(tileMat==df::tiletype_material::FROZEN_LIQUID)
+                applyMaterial(curCell,curLight,matIce);
+            else
+                applyMaterial(curCell,curLight,*lightDef);
+        }
+        else if(!d.bits.liquid_type && d.bits.flow_size>0 )
+        {
+            applyMaterial(curCell,curLight,matWater, (float)d.bits.flow_size/7.0f, (float)d.bits.flow_size/7.0f);
+        }
+        if(d.bits.liquid_type && d.bits.flow_size>0) 
+        {
+            applyMaterial(curCell,curLight,matLava,(float)d.bits.flow_size/7.0f,(float)d.bits.flow_size/7.0f);
+        }
+        else if(!is_floor)
+        {
+            if(bDown)
             {
-                rgbf& curCell=cellArray[block_x][block_y];
-                curCell=propogateSun(b,block_x,block_y,curCell,z==window_z);
-                if(curCell.dot(curCell)<0.003f)
-                    emptyCell++;                
+               df::tile_designation d2=bDown->DesignationAt(gpos);
+               if(d2.bits.liquid_type && d2.bits.flow_size>0)
+               {
+                   applyMaterial(curCell,curLight,matLava);
+               }
             }
         }
-        if(emptyCell==256)
+    }
+}
+void lightingEngineViewscreen::buildBlockSun(lightBlockCache& c,MapExtras::MapCache& map,int blockX,int blockY,int z)
+{
+    for(int block_x = 0; block_x < 16; block_x++)
+    for(int block_y = 0; block_y < 16; block_y++)
+        c.sun[block_x][block_y] = rgbf(1,1,1);
+
+    int emptyCell=0;
+    for(int zz=z;zz< df::global::world->map.z_count && emptyCell<256;zz++)
+    {
+        MapExtras::Block* b=map.BlockAt(DFCoord(blockX,blockY,zz));
+        if(!b)
             continue;
+        emptyCell=0;
         for(int block_x = 0; block_x < 16; block_x++)
         for(int block_y = 0; block_y < 16; block_y++)
         {
-            rgbf& curCell=cellArray[block_x][block_y];
-            df::coord2d pos;
-            pos.x = blockX*16+block_x;
-            pos.y = blockY*16+block_y;
-            pos=worldToViewportCoord(pos,vp,window2d);
-            if(isInRect(pos,vp) && curCell.dot(curCell)>0.003f)
-            {
-                lightSource sun=lightSource(curCell,15);
-                addLight(getIndex(pos.x,pos.y),sun);
-            }
+            rgbf& curCell=c.sun[block_x][block_y];
+            curCell=propogateSun(b,block_x,block_y,curCell,zz==z);
+            if(curCell.dot(curCell)<0.003f)
+                emptyCell++;                
         }
     }
 }
@@ -626,8 +700,7 @@ void lightingEngineViewscreen::doOcupancyAndLights()
     rgbf sky_col=getSkyColor(daycol);
     lightSource sky(sky_col, -1);//auto calculate best size
     
-    MapExtras::MapCache cache;
-    doSun(sky,cache);
+    MapExtras::MapCache cache; //only loads blocks that need to be rebuilt
 
     int window_x=*df::global::window_x;
     int window_y=*df::global::window_y;
@@ -640,87 +713,66 @@ void lightingEngineViewscreen::doOcupancyAndLights()
     blockVp.second=(window2d+vpSize)/16;
     blockVp.second.x=std::min(blockVp.second.x,(int16_t)df::global::world->map.x_count_block);
     blockVp.second.y=std::min(blockVp.second.y,(int16_t)df::global::world->map.y_count_block);
-   
+
+    if(blockCache.size()>1024)
+        blockCache.clear();
+    //digging far above changes sunlight here without touching these blocks,
+    //so recheck one sun column per frame
+    size_t blockCount=(blockVp.second.x-blockVp.first.x+1)*(blockVp.second.y-blockVp.first.y+1);
+    size_t blockNum=0;
+    sunCheck=(sunCheck+1)%std::max<size_t>(blockCount,1);
+
     for(int blockX=blockVp.first.x;blockX<=blockVp.second.x;blockX++)
-    for(int blockY=blockVp.first.y;blockY<=blockVp.second.y;blockY++)
+    for(int blockY=blockVp.first.y;blockY<=blockVp.second.y;blockY++,blockNum++)
     {
-        MapExtras::Block* b=cache.BlockAt(DFCoord(blockX,blockY,window_z));
-        MapExtras::Block* bDown=cache.BlockAt(DFCoord(blockX,blockY,window_z-1));
-        if(!b)
-            continue; //empty blocks fixed by sun propagation
-        
+        df::map_block* block=Maps::getBlock(blockX,blockY,window_z);
+        uint32_t tileHash=hashBlock(hashBlock(2166136261u,block),Maps::getBlock(blockX,blockY,window_z-1));
+
+        auto key=std::make_tuple(blockX,blockY,window_z);
+        auto it=blockCache.find(key);
+        bool fresh=(it==blockCache.end());
+        lightBlockCache& c=fresh ? blockCache[key] : it->second;
+        if(fresh || c.block!=block || c.tileHash!=tileHash)
+        {
+            buildBlockTiles(c,cache,blockX,blockY,window_z);
+            c.tileHash=tileHash;
+        }
+        if(fresh || c.block!=block || blockNum==sunCheck)
+        {
+            uint32_t sunHash=2166136261u;
+            for(int z=window_z;z<df::global::world->map.z_count;z++)
+                sunHash=hashBlock(sunHash,Maps::getBlock(blockX,blockY,z));
+            if(fresh || c.block!=block || c.sunHash!=sunHash)
+            {
+                buildBlockSun(c,cache,blockX,blockY,window_z);
+                c.sunHash=sunHash;
+            }
+        }
+        c.block=block;
+
         for(int block_x = 0; block_x < 16; block_x++)
         for(int block_y = 0; block_y < 16; block_y++)
         {
             df::coord2d pos;
             pos.x = blockX*16+block_x;
             pos.y = blockY*16+block_y;
-            df::coord2d gpos=pos;
             pos=worldToViewportCoord(pos,vp,window2d);
             if(!isInRect(pos,vp))
                 continue;
             int tile=getIndex(pos.x,pos.y);
-            rgbf& curCell=ocupancy[tile];
-            curCell=matAmbience.transparency;
-            
-
-            df::tiletype type = b->tiletypeAt(gpos);
-            df::tile_designation d = b->DesignationAt(gpos);
-            if(d.bits.hidden )
-            {
-                curCell=rgbf(0,0,0);
-                continue; // do not process hidden stuff, TODO other hidden stuff
-            }
-            //df::tile_occupancy o = b->OccupancyAt(gpos);
-            df::tiletype_shape shape = ENUM_ATTR(tiletype,shape,type);
-            bool is_wall=!ENUM_ATTR(tiletype_shape,passable_high,shape);
-            bool is_floor=!ENUM_ATTR(tiletype_shape,passable_low,shape);
-            df::tiletype_shape_basic basic_shape = ENUM_ATTR(tiletype_shape, basic_shape, shape);
-            df::tiletype_material tileMat= ENUM_ATTR(tiletype,material,type);
-            
-            DFHack::t_matpair mat=b->staticMaterialAt(gpos);
-            
-            matLightDef* lightDef=getMaterialDef(mat.mat_type,mat.mat_index);
-            if(!lightDef || !lightDef->isTransparent)
-                lightDef=&matWall;
-            if(shape==df::tiletype_shape::BROOK_BED )
-            {
-                curCell=rgbf(0,0,0);
-            }
-            else if(is_wall)
-            {
-                if(tileMat==df::tiletype_material::FROZEN_LIQUID)
-                    applyMaterial(tile,matIce);
-                else
-                    applyMaterial(tile,*lightDef);
-            }
-            else if(!d.bits.liquid_type && d.bits.flow_size>0 )
-            {
-                applyMaterial(tile,matWater, (float)d.bits.flow_size/7.0f, (float)d.bits.flow_size/7.0f);
-            }
-            if(d.bits.liquid_type && d.bits.flow_size>0) 
-            {
-                applyMaterial(tile,matLava,(float)d.bits.flow_size/7.0f,(float)d.bits.flow_size/7.0f);
-            }
-            else if(!is_floor)
-            {
-                if(bDown)
-                {
-                   df::tile_designation d2=bDown->DesignationAt(gpos);
-                   if(d2.bits.liquid_type && d2.bits.flow_size>0)
-                   {
-                       applyMaterial(tile,matLava);
-                   }
-                }
-            }
-            
-
+            rgbf sun=sky.power*c.sun[block_x][block_y];
+            if(sun.dot(sun)>0.003f)
+                addLight(tile,lightSource(sun,15));
+            if(!block)
+                continue;
+            ocupancy[tile]=c.ocupancy[block_x][block_y];
+            if(c.lights[block_x][block_y].radius>0)
+                addLight(tile,c.lights[block_x][block_y]);
         }
         
-        df::map_block* block=b->getRaw();
         if(!block)
             continue;
-        //flows
+    //flows
         for(int i=0;i<block->flows.size();i++)
         {
             df::flow_info* f=block->flows[i];
@@ -810,13 +862,25 @@ void lightingEngineViewscreen::doOcupancyAndLights()
     if(itemDefs.size()>0)
     {
         std::vector<df::item*>& vec=df::global::world->items.other[items_other_id::IN_PLAY];
-        for(size_t i=0;i<vec.size();i++)
+        if(vec.size()!=lightItemsSize || *df::global::item_next_id!=lightItemsNextId)
         {
-            df::item* curItem=vec[i];
+            lightItems.clear();
+            for(size_t i=0;i<vec.size();i++)
+            {
+                itemLightDef* mat=getItemDef(vec[i]);
+                if(mat)
+                    lightItems.push_back(std::make_pair(vec[i],mat));
+            }
+            lightItemsSize=vec.size();
+            lightItemsNextId=*df::global::item_next_id;
+        }
+        for(size_t i=0;i<lightItems.size();i++)
+        {
+            df::item* curItem=lightItems[i].first;
+            itemLightDef* mat=lightItems[i].second;
             df::coord itemPos=DFHack::Items::getPosition(curItem);
             coord2d pos=worldToViewportCoord(itemPos,vp,window2d);
-            itemLightDef* mat=0;
-            if( itemPos.z==window_z && isInRect(pos,vp) && (mat=getItemDef(curItem)) )
+            if( itemPos.z==window_z && isInRect(pos,vp) )
             {
                 if( ((mat->equiped || mat->haul ||mat->inBuilding ||mat->inContainer) && curItem->flags.bits.in_inventory)|| //TODO split this up
                     (mat->onGround && curItem->flags.bits.on_ground) )
@@ -831,9 +895,22 @@ void lightingEngineViewscreen::doOcupancyAndLights()
     }
     
     //buildings
-    for(size_t i = 0; i < df::global::world->buildings.all.size(); i++)
+    std::vector<df::building*>& buildings=df::global::world->buildings.all;
+    if(buildings.size()!=lightBuildingsSize || *df::global::building_next_id!=lightBuildingsNextId)
     {
-        df::building *bld = df::global::world->buildings.all[i];
+        lightBuildings.clear();
+        for(size_t i = 0; i < buildings.size(); i++)
+        {
+            buildingLightDef* def=getBuildingDef(buildings[i]);
+            if(def)
+                lightBuildings.push_back(std::make_pair(buildings[i],def));
+        }
+        lightBuildingsSize=buildings.size();
+        lightBuildingsNextId=*df::global::building_next_id;
+    }
+    for(size_t i = 0; i < lightBuildings.size(); i++)
+    {
+        df::building *bld = lightBuildings[i].first;
         
         if(window_z!=bld->z)
             continue;
@@ -853,9 +930,7 @@ void lightingEngineViewscreen::doOcupancyAndLights()
             else
                 tile=getIndex(p2.x,p2.y);
             df::building_type type = bld->getType();
-            buildingLightDef* def=getBuildingDef(bld);
-            if(!def)
-                continue;
+            buildingLightDef* def=lightBuildings[i].second;
             if(type==df::enums::building_type::Door)
             {
                 df::building_doorst* door=static_cast<df::building_doorst*>(bld);
@@ -1184,6 +1259,7 @@ void lightingEngineViewscreen::loadSettings()
 
     CoreSuspender lock;
     color_ostream_proxy out(Core::getInstance().getConsole());
+    invalidateCache();
     
     lua_State* s=DFHack::Lua::Core::State;
     lua_newtable(s);
@@ -1249,9 +1325,9 @@ void lightingEngineViewscreen::loadSettings()
 /*
  *      Threading stuff
  */
-lightThread::lightThread( lightThreadDispatch& dispatch ):dispatch(dispatch),isDone(false),myThread(0)
+lightThread::lightThread( lightThreadDispatch& dispatch,int index ):canvasW(0),canvasH(0),dispatch(dispatch),index(index),isDone(false),myThread(0)
 {
-
+    resetDirty();
 }
 lightThread::~lightThread()
 {
@@ -1260,61 +1336,82 @@ lightThread::~lightThread()
 
 void lightThread::run()
 {
+    int frame=0;
     while(!isDone)
     {
         //TODO: get area to process, and then process (by rounds): 1. occlusions, 2.sun, 3.lights(could be difficult, units/items etc...)
         {//wait for occlusion (and lights) to be ready
             tthread::lock_guard<tthread::mutex> guard(dispatch.occlusionMutex);
-            if(!dispatch.occlusionReady)
-            dispatch.occlusionDone.wait(dispatch.occlusionMutex);//wait for work
-            if(dispatch.unprocessed.size()==0 || !dispatch.occlusionReady) //spurious wake-up
-                continue;
-            if(dispatch.occlusion.size()!=canvas.size()) //oh no somebody resized stuff
-                canvas.resize(dispatch.occlusion.size());
-        }
-        
-        
-        { //get my rectangle (any will do)
-            tthread::lock_guard<tthread::mutex> guard(dispatch.unprocessedMutex);
-            if (dispatch.unprocessed.size()==0)
+            while(!isDone && dispatch.frame==frame)
+                dispatch.occlusionDone.wait(dispatch.occlusionMutex);//wait for work
+            if(isDone)
+                break;
+            frame=dispatch.frame;
+            //oh no somebody resized stuff; same area is not enough, the dirty box is in old rows
+            if(dispatch.getW()!=canvasW || dispatch.getH()!=canvasH || dispatch.occlusion.size()!=canvas.size())
             {
-                //wtf?? why?!
-                continue;
-            }
-            myRect=dispatch.unprocessed.top();
-            dispatch.unprocessed.pop();
-            if (dispatch.unprocessed.size()==0)
-            {
-                dispatch.occlusionReady=false;
+                canvasW=dispatch.getW();
+                canvasH=dispatch.getH();
+                canvas.assign(dispatch.occlusion.size(),rgbf(0,0,0));
+                resetDirty();
             }
-            
         }
-        work();
+        clearDirty();
+        rect2d tile;
+        while(dispatch.takeTile(index,tile))
+            work(tile);
+        dispatch.waitForLighting();//all canvases are final after this
+        combine();//write it back
         {
             tthread::lock_guard<tthread::mutex> guard(dispatch.writeLock);
-            combine();//write it back
             dispatch.writeCount++; 
         }
         dispatch.writesDone.notify_one();//tell about it to the dispatch.
     }
 }
 
-void lightThread::work()
+void lightThread::work(const rect2d& area)
 {
-    canvas.assign(canvas.size(),rgbf(0,0,0));
-    for(int i=myRect.first.x;i<myRect.second.x;i++)
-    for(int j=myRect.first.y;j<myRect.second.y;j++)
+    for(int i=area.first.x;i<area.second.x;i++)
+    for(int j=area.first.y;j<area.second.y;j++)
     {
         doLight(i,j);
     }
 }
 
+void lightThread::resetDirty()
+{
+    dirtyX1=dirtyY1=INT_MAX;
+    dirtyX2=dirtyY2=0;
+}
+
+void lightThread::clearDirty()
+{
+    int h=canvasH;
+    for(int i=dirtyX1;i<dirtyX2;i++)
+        std::fill(canvas.begin()+i*h+dirtyY1,canvas.begin()+i*h+dirtyY2,rgbf(0,0,0));
+    resetDirty();
+}
+
 void lightThread::combine()
 {
-    for(int i=0;i<canvas.size();i++)   
+    int h=dispatch.getH();
+    const rect2d& vp=dispatch.viewPort;
+    int count=dispatch.threadPool.size();
+    int vw=vp.second.x-vp.first.x;
+    int x1=vp.first.x+index*vw/count;
+    int x2=vp.first.x+(index+1)*vw/count;
+    for(int t=0;t<count;t++)
     {
-        rgbf& c=dispatch.lightMap[i];
-        c=blend(c,canvas[i]);
+        const lightThread& other=*dispatch.threadPool[t];
+        int ox1=std::max(x1,other.dirtyX1);
+        int ox2=std::min(x2,other.dirtyX2);
+        for(int i=ox1;i<ox2;i++)
+        for(int j=other.dirtyY1;j<other.dirtyY2;j++)
+        {
+            rgbf& c=dispatch.lightMap[i*h+j];
+            c=blend(c,other.canvas[i*h+j]);
+        }
     }
 }
 
@@ -1354,6 +1451,10 @@ rgbf lightThread::lightUpCell(rgbf power,int dx,int dy,int tx,int ty)
         rgbf oldCol=canvas[tile];
         rgbf ncol=blendMax(power,oldCol);
         canvas[tile]=ncol;
+        if(tx<dirtyX1) dirtyX1=tx;
+        if(tx>=dirtyX2) dirtyX2=tx+1;
+        if(ty<dirtyY1) dirtyY1=ty;
+        if(ty>=dirtyY2) dirtyY2=ty+1;
 
         if(wallhack)
             return rgbf();
@@ -1406,39 +1507,82 @@ void lightThreadDispatch::signalDoneOcclusion()
         writeCount=0;
     }
     tthread::lock_guard<tthread::mutex> guard1(occlusionMutex);
-    tthread::lock_guard<tthread::mutex> guard2(unprocessedMutex);
-    while(!unprocessed.empty())
-        unprocessed.pop();
-    viewPort=getMapViewport();
-    int threadCount=threadPool.size();
-    int w=viewPort.second.x-viewPort.first.x;
-    int slicew=w/threadCount;
-    for(int i=0;i<threadCount;i++)
     {
-        rect2d area=viewPort;
-        area.first.x=viewPort.first.x+i*slicew;
-        if(i==threadCount-1)
-            area.second.x=viewPort.second.x; //fix, when area is even number or sth.
-        else
-            area.second.x=viewPort.first.x+(i+1)*slicew;
-        unprocessed.push(area);
+        tthread::lock_guard<tthread::mutex> guard2(unprocessedMutex);
+        viewPort=getMapViewport();
+        tiles.clear();
+        for(int x=viewPort.first.x;x<viewPort.second.x;x+=LIGHT_TILE_SIZE)
+        for(int y=viewPort.first.y;y<viewPort.second.y;y+=LIGHT_TILE_SIZE)
+        {
+            tiles.push_back(mkrect_xy(x,y,std::min(x+LIGHT_TILE_SIZE,(int)viewPort.second.x),
+                std::min(y+LIGHT_TILE_SIZE,(int)viewPort.second.y)));
+        }
+        int threadCount=threadPool.size();
+        int tileCount=tiles.size();
+        queues.resize(threadCount);
+        for(int i=0;i<threadCount;i++)
+        {
+            queues[i].next=i*tileCount/threadCount;
+            queues[i].end=(i+1)*tileCount/threadCount;
+        }
+        lightingCount=0;
     }
-    occlusionReady=true;
+    frame++;
     occlusionDone.notify_all();
 }
 
+bool lightThreadDispatch::takeTile(int thread,rect2d& tile)
+{
+    tthread::lock_guard<tthread::mutex> guard(unprocessedMutex);
+    tileRange& own=queues[thread];
+    if(own.next<own.end)
+    {
+        tile=tiles[own.next++];
+        return true;
+    }
+    //out of work, steal from whoever has most left
+    int victim=-1;
+    int most=0;
+    for(int i=0;i<queues.size();i++)
+    {
+        if(queues[i].end-queues[i].next>most)
+        {
+            most=queues[i].end-queues[i].next;
+            victim=i;
+        }
+    }
+    if(victim<0)
+        return false;
+    tile=tiles[--queues[victim].end];
+    return true;
+}
+
+void lightThreadDispatch::waitForLighting()
+{
+    tthread::lock_guard<tthread::mutex> guard(unprocessedMutex);
+    if(++lightingCount==threadPool.size())
+    {
+        lightingDone.notify_all();
+        return;
+    }
+    while(lightingCount<threadPool.size())
+        lightingDone.wait(unprocessedMutex);
+}
+
 lightThreadDispatch::lightThreadDispatch( lightingEngineViewscreen* p ):parent(p),lights(parent->lights),occlusion(parent->ocupancy),num_diffusion(parent->num_diffuse),
-    lightMap(parent->lightMap),writeCount(0),occlusionReady(false)
+    lightMap(parent->lightMap),writeCount(0),frame(0),lightingCount(0)
 {
 
 }
 
 void lightThreadDispatch::shutdown()
 {
-    for(int i=0;i<threadPool.size();i++)
     {
-        threadPool[i]->isDone=true;
-        
+        tthread::lock_guard<tthread::mutex> guard(occlusionMutex);
+        for(int i=0;i<threadPool.size();i++)
+        {
+            threadPool[i]->isDone=true;
+        }
     }
     occlusionDone.notify_all();//if stuck signal that you are done with stuff.
     for(int i=0;i<threadPool.size();i++)
@@ -1466,7 +1610,7 @@ void lightThreadDispatch::start(int count)
 {
     for(int i=0;i<count;i++)
     {        
-        std::unique_ptr<lightThread> nthread(new lightThread(*this));
+        std::unique_ptr<lightThread> nthread(new lightThread(*this,i));
         nthread->myThread=new tthread::thread(&threadStub,nthread.get());
         threadPool.push_back(std::move(nthread));
     }
@@ -232,15 +232,26 @@ public:
 
     tthread::mutex occlusionMutex;
     tthread::condition_variable occlusionDone; //all threads wait for occlusion to finish
-    bool occlusionReady;
+    int frame; //bumped when occlusion is ready, every thread takes part in each frame
+    
+    //viewport is cut into small tiles; each thread starts with its own share
+    //of them, and steals from the back of the others' when it runs out
+    struct tileRange
+    {
+        int next,end;
+    };
     tthread::mutex unprocessedMutex;
-    std::stack<DFHack::rect2d> unprocessed; //stack of parts of map where lighting is not finished
+    std::vector<DFHack::rect2d> tiles;
+    std::vector<tileRange> queues; //one per thread, indices into tiles
+    tthread::condition_variable lightingDone; //all threads wait for others to finish lighting
+    int lightingCount;
     std::vector<rgbf>& occlusion;
     int& num_diffusion;
 
-    tthread::mutex writeLock; //mutex for lightMap
+    //each thread merges its own strip of viewport, so lightMap needs no lock
     std::vector<rgbf>& lightMap;
 
+    tthread::mutex writeLock; //mutex for writeCount
     tthread::condition_variable writesDone;
     int writeCount;
 
@@ -249,6 +260,8 @@ public:
     void signalDoneOcclusion();
     void shutdown();
     void waitForWrites();
+    bool takeTile(int thread,DFHack::rect2d& tile);
+    void waitForLighting();
 
     int getW();
     int getH();
@@ -257,14 +270,18 @@ public:
 class lightThread
 {
     std::vector<rgbf> canvas;
+    int canvasW,canvasH; //dimensions the canvas and dirty box were made for
+    int dirtyX1,dirtyY1,dirtyX2,dirtyY2; //part of canvas that was lit
     lightThreadDispatch& dispatch;
-    DFHack::rect2d myRect;
-    void work(); //main light calculation function
-    void combine(); //combine existing canvas into global lightmap
+    int index;
+    void work(const DFHack::rect2d& area); //main light calculation function
+    void combine(); //combine all canvases into my strip of global lightmap
+    void resetDirty();
+    void clearDirty();
 public:
     tthread::thread *myThread;
     bool isDone; //no mutex, because bool is atomic
-    lightThread(lightThreadDispatch& dispatch);
+    lightThread(lightThreadDispatch& dispatch,int index);
     ~lightThread();
     void run();
 private:
@@ -291,7 +308,6 @@ private:
     df::coord2d worldToViewportCoord(const df::coord2d& in,const DFHack::rect2d& r,const df::coord2d& window2d) ;
     
 
-    void doSun(const lightSource& sky,MapExtras::MapCache& map);
     void doOcupancyAndLights();
     rgbf propogateSun(MapExtras::Block* b, int x,int y,const rgbf& in,bool lastLevel);
     void doRay(std::vector<rgbf> & target, rgbf power,int cx,int cy,int tx,int ty);
@@ -308,6 +324,7 @@ private:
 
     //apply material to cell
     void applyMaterial(int tileId,const matLightDef& mat,float size=1, float thickness = 1);
+    void applyMaterial(rgbf& ocupancy,lightSource& light,const matLightDef& mat,float size=1, float thickness = 1);
     //try to find and apply material, if failed return false, and if def!=null then apply def.
     bool applyMaterial(int tileId,int matType,int matIndex,float size=1,float thickness = 1,const matLightDef* def=NULL);
     
@@ -324,6 +341,30 @@ private:
     std::vector<rgbf> ocupancy;
     std::vector<lightSource> lights;
 
+    //occlusion and lights that come from map tiles, kept per map block and
+    //rebuilt only when the block (or for sun, the column above it) changes
+    struct lightBlockCache
+    {
+        df::map_block* block;
+        uint32_t tileHash;
+        uint32_t sunHash;
+        rgbf ocupancy[16][16];
+        lightSource lights[16][16];
+        rgbf sun[16][16]; //part of sky light that gets down here
+    };
+    std::unordered_map<std::tuple<int,int,int>,lightBlockCache> blockCache;
+    size_t sunCheck; //which block in viewport gets its sun column rechecked next
+    void buildBlockTiles(lightBlockCache& c,MapExtras::MapCache& map,int blockX,int blockY,int z);
+    void buildBlockSun(lightBlockCache& c,MapExtras::MapCache& map,int blockX,int blockY,int z);
+    //items and buildings that have light definitions, rebuilt when their lists change
+    std::vector<std::pair<df::item*,itemLightDef*> > lightItems;
+    size_t lightItemsSize;
+    int lightItemsNextId;
+    std::vector<std::pair<df::building*,buildingLightDef*> > lightBuildings;
+    size_t lightBuildingsSize;
+    int lightBuildingsNextId;
+    void invalidateCache();
+
     //Threading stuff
     int num_diffuse; //under same lock as ocupancy
     lightThreadDispatch threading;
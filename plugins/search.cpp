@@ -291,6 +291,7 @@ protected:
         end_entry_mode();
         search_string = "";
         saved_list1.clear();
+        clear_description_index();
     }
 
     // Shortcut to clear the search immediately
@@ -302,6 +303,81 @@ protected:
             saved_list1.clear();
         }
         search_string = "";
+        clear_description_index();
+    }
+
+    void clear_description_index()
+    {
+        saved_descriptions.clear();
+        match_history.clear();
+    }
+
+    // Describe every saved element once, when a search starts
+    void build_description_index()
+    {
+        match_history.clear();
+        saved_descriptions.resize(saved_list1.size());
+        for (size_t i = 0; i < saved_list1.size(); i++)
+            saved_descriptions[i] = toLower(get_element_description(saved_list1[i]));
+    }
+
+    bool matches_terms(size_t i, const vector<string> &terms) const
+    {
+        for (size_t j = 0; j < terms.size(); j++)
+        {
+            if (saved_descriptions[i].find(terms[j]) == string::npos)
+                return false;
+        }
+        return true;
+    }
+
+    // Indexes of the saved elements containing every space-separated term of
+    // the query. Matches for each shorter query typed so far are kept: since
+    // extending a query can only narrow its matches, typing a character only
+    // filters the last set, and backspace returns to an earlier one.
+    const vector<size_t> &find_matches(const string &query)
+    {
+        while (!match_history.empty())
+        {
+            const string &prev = match_history.back().first;
+            if (query.size() >= prev.size() && query.compare(0, prev.size(), prev) == 0)
+                break;
+            match_history.pop_back();
+        }
+
+        if (!match_history.empty() && match_history.back().first == query)
+            return match_history.back().second;
+
+        vector<string> terms, parts;
+        split_string(&parts, query, " ");
+        for (size_t i = 0; i < parts.size(); i++)
+        {
+            if (!parts[i].empty())
+                terms.push_back(parts[i]);
+        }
+
+        vector<size_t> matches;
+        if (match_history.empty())
+        {
+            for (size_t i = 0; i < saved_descriptions.size(); i++)
+            {
+                if (matches_terms(i, terms))
+                    matches.push_back(i);
+            }
+        }
+        else
+        {
+            const vector<size_t> &prev = match_history.back().second;
+            for (size_t i = 0; i < prev.size(); i++)
+            {
+                if (matches_terms(prev[i], terms))
+                    matches.push_back(prev[i]);
+            }
+        }
+
+        match_history.push_back(make_pair(query, vector<size_t>()));
+        match_history.back().second.swap(matches);
+        return match_history.back().second;
     }
 
     virtual void save_original_values()
@@ -349,16 +425,24 @@ protected:
         }
 
         if (saved_list1.size() == 0)
+        {
             // On first run, save the original list
             save_original_values();
+            build_description_index();
+        }
         else
             do_pre_incremental_search();
 
         clear_viewscreen_vectors();
 
-        string search_string_l = toLower(search_string);
+        const vector<size_t> &matches = find_matches(toLower(search_string));
+        size_t next_match = 0;
         for (size_t i = 0; i < saved_list1.size(); i++ )
         {
+            bool matched = (next_match < matches.size() && matches[next_match] == i);
+            if (matched)
+                next_match++;
+
             if (force_in_search(i))
             {
                 add_to_filtered_list(i);
@@ -368,12 +452,8 @@ protected:
             if (!is_valid_for_search(i))
                 continue;
 
-            T element = saved_list1[i];
-            string desc = toLower(get_element_description(element));
-            if (desc.find(search_string_l) != string::npos)
-            {
+            if (matched)
                 add_to_filtered_list(i);
-            }
         }
 
         do_post_search();
@@ -404,6 +484,8 @@ protected:
 
     S *viewscreen;
     vector <T> saved_list1, reference_list, *primary_list;
+    vector <string> saved_descriptions;
+    vector <pair<string, vector<size_t> > > match_history;
 
     //bool redo_search;
     string search_string;
@@ -292,6 +292,7 @@ command_result df_showmood (color_ostream &out, vector <string> & parameters)
 }
 
 DFHACK_PLUGIN("showmood");
+DFHACK_PLUGIN_LAZY_LOAD;
 
 DFhackCExport command_result plugin_init (color_ostream &out, std::vector<PluginCommand> &commands)
 {
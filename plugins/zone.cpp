@@ -29,6 +29,8 @@
 #include <iomanip>
 #include <climits>
 #include <vector>
+#include <map>
+#include <set>
 #include <algorithm>
 #include <string>
 #include <sstream>
@@ -272,6 +274,7 @@ command_result start_autonestbox(color_ostream &out);
 
 command_result autoNestbox( color_ostream &out, bool verbose );
 command_result autoButcher( color_ostream &out, bool verbose );
+static void invalidateUnitFacets();
 
 static bool enable_autonestbox = false;
 static bool enable_autobutcher = false;
@@ -289,11 +292,14 @@ DFhackCExport command_result plugin_onstatechange(color_ostream &out, state_chan
     switch (event)
     {
     case DFHack::SC_MAP_LOADED:
+        // the frame counter of the new world may match the old one
+        invalidateUnitFacets();
         // initialize from the world just loaded
         init_autobutcher(out);
         init_autonestbox(out);
         break;
     case DFHack::SC_MAP_UNLOADED:
+        invalidateUnitFacets();
         enable_autonestbox = false;
         enable_autobutcher = false;
         // cleanup
@@ -409,6 +415,7 @@ bool isMarkedForSlaughter(df::unit* unit)
 void doMarkForSlaughter(df::unit* unit)
 {
     unit->flags2.bits.slaughter = 1;
+    invalidateUnitFacets();
 }
 
 // check if creature is tame
@@ -911,15 +918,12 @@ int32_t findPenPitAtCursor()
     if(cursor->x == -30000)
         return -1;
 
-    for (size_t b = 0; b < world->buildings.all.size(); b++)
-    {
-        df::building* building = world->buildings.all[b];
+    std::vector<df::building*> at_cursor;
+    Buildings::findInRect(&at_cursor, df::coord2d(cursor->x, cursor->y), df::coord2d(cursor->x, cursor->y), cursor->z);
 
-        // find zone under cursor
-        if (!(building->x1 <= cursor->x && cursor->x <= building->x2 &&
-            building->y1 <= cursor->y && cursor->y <= building->y2 &&
-            building->z == cursor->z))
-            continue;
+    for (size_t b = 0; b < at_cursor.size(); b++)
+    {
+        df::building* building = at_cursor[b];
 
         if(isPenPasture(building) || isPitPond(building))
         {
@@ -938,14 +942,12 @@ int32_t findCageAtCursor()
     if(cursor->x == -30000)
         return -1;
 
-    for (size_t b = 0; b < world->buildings.all.size(); b++)
-    {
-        df::building* building = world->buildings.all[b];
+    std::vector<df::building*> at_cursor;
+    Buildings::findInRect(&at_cursor, df::coord2d(cursor->x, cursor->y), df::coord2d(cursor->x, cursor->y), cursor->z);
 
-        if (!(building->x1 <= cursor->x && cursor->x <= building->x2 &&
-            building->y1 <= cursor->y && cursor->y <= building->y2 &&
-            building->z == cursor->z))
-            continue;
+    for (size_t b = 0; b < at_cursor.size(); b++)
+    {
+        df::building* building = at_cursor[b];
 
         // don't set id if cage is not constructed yet
         if(building->getBuildStage()!=building->getMaxBuildStage())
@@ -967,15 +969,12 @@ int32_t findChainAtCursor()
     if(cursor->x == -30000)
         return -1;
 
-    for (size_t b = 0; b < world->buildings.all.size(); b++)
-    {
-        df::building* building = world->buildings.all[b];
+    std::vector<df::building*> at_cursor;
+    Buildings::findInRect(&at_cursor, df::coord2d(cursor->x, cursor->y), df::coord2d(cursor->x, cursor->y), cursor->z);
 
-        // find zone under cursor
-        if (!(building->x1 <= cursor->x && cursor->x <= building->x2 &&
-            building->y1 <= cursor->y && cursor->y <= building->y2 &&
-            building->z == cursor->z))
-            continue;
+    for (size_t b = 0; b < at_cursor.size(); b++)
+    {
+        df::building* building = at_cursor[b];
 
         if(isChain(building))
         {
@@ -1289,31 +1288,145 @@ bool isFreeEgglayer(df::unit * unit)
         return false;
 }
 
-df::unit * findFreeEgglayer()
+// Facets of an own-stock unit that autobutcher filters on
+struct UnitFacets
 {
-    df::unit* free_unit = NULL;
-    for (size_t i=0; i < world->units.all.size(); i++)
+    df::unit *unit;
+    bool tame;
+    bool marked;  // marked for slaughter
+    bool prot;    // war or hunting animal, in a zoo cage, for adoption or named
+};
+
+// Index of the units autobutcher and autonestbox look at, built with one
+// pass over units and one over cages instead of evaluating every predicate
+// (and scanning all buildings for each caged unit) on every query.
+// Rebuilt when the tick advances, on map load and unload, at the start of
+// each autobutcher/autonestbox run and command (the game may be paused),
+// and after this plugin assigns or marks units itself.
+struct UnitFacetIndex
+{
+    bool valid;
+    int32_t frame;
+
+    // alive, own civ, not merchants' and with a sane position; by race
+    std::map<int, std::vector<UnitFacets> > stock;
+    // what isFreeEgglayer() accepts, in unit vector order
+    std::vector<df::unit*> free_egglayers;
+
+    UnitFacetIndex() : valid(false), frame(-1) {}
+};
+
+static UnitFacetIndex unit_facets;
+
+static void invalidateUnitFacets()
+{
+    unit_facets.valid = false;
+}
+
+// same as isAssigned(), with the units assigned to built cages precomputed
+static bool isAssignedCached(df::unit *unit, const std::set<int32_t> &caged)
+{
+    for (size_t r=0; r < unit->general_refs.size(); r++)
     {
-        df::unit* unit = world->units.all[i];
-        if(isFreeEgglayer(unit))
+        auto rtype = unit->general_refs[r]->getType();
+        if(    rtype == df::general_ref_type::BUILDING_CIVZONE_ASSIGNED
+            || rtype == df::general_ref_type::BUILDING_CAGED
+            || rtype == df::general_ref_type::BUILDING_CHAIN
+            || (rtype == df::general_ref_type::CONTAINED_IN_ITEM && caged.count(unit->id))
+            )
+            return true;
+    }
+    return false;
+}
+
+static UnitFacetIndex &getUnitFacets()
+{
+    if (unit_facets.valid && unit_facets.frame == world->frame_counter)
+        return unit_facets;
+
+    unit_facets.stock.clear();
+    unit_facets.free_egglayers.clear();
+
+    // units assigned to built cages, and to those that are rooms (zoos)
+    std::set<int32_t> caged, caged_room;
+    for (size_t b=0; b < world->buildings.all.size(); b++)
+    {
+        df::building* building = world->buildings.all[b];
+        if(building->getType() != building_type::Cage)
+            continue;
+        df::building_cagest* cage = (df::building_cagest*) building;
+        for(size_t c=0; c<cage->assigned_units.size(); c++)
         {
-            free_unit = unit;
-            break;
+            caged.insert(cage->assigned_units[c]);
+            if(building->is_room)
+                caged_room.insert(cage->assigned_units[c]);
         }
     }
-    return free_unit;
+
+    for(size_t i=0; i<world->units.all.size(); i++)
+    {
+        df::unit * unit = world->units.all[i];
+
+        if(    isDead(unit)
+            || isUndead(unit)
+            || isMerchant(unit) // ignore merchants' draught animals
+            || isForest(unit) // ignore merchants' caged animals
+            || !isOwnCiv(unit)
+            )
+            continue;
+
+        bool tame = isTame(unit);
+        bool contained = isContainedInItem(unit);
+
+        if(    tame
+            && isFemale(unit)
+            && isEggLayer(unit)
+            && !isGrazer(unit)
+            && !isAssignedCached(unit, caged)
+            )
+            unit_facets.free_egglayers.push_back(unit);
+
+        // found a bugged unit which had invalid coordinates but was not in a cage.
+        // marking it for slaughter didn't seem to have negative effects, but you never know...
+        if(!contained && !hasValidMapPos(unit))
+            continue;
+
+        UnitFacets f;
+        f.unit = unit;
+        f.tame = tame;
+        f.marked = isMarkedForSlaughter(unit);
+        // ignore creatures in built cages which are defined as rooms to leave zoos alone
+        f.prot = isWar(unit)
+            || isHunter(unit)
+            || (contained && caged_room.count(unit->id))
+            || isAvailableForAdoption(unit)
+            || unit->name.has_name;
+
+        unit_facets.stock[unit->race].push_back(f);
+    }
+
+    unit_facets.valid = true;
+    unit_facets.frame = world->frame_counter;
+    return unit_facets;
+}
+
+static const std::vector<UnitFacets> &getRaceStock(int race)
+{
+    static const std::vector<UnitFacets> empty;
+    UnitFacetIndex &facets = getUnitFacets();
+    auto it = facets.stock.find(race);
+    return (it != facets.stock.end()) ? it->second : empty;
+}
+
+df::unit * findFreeEgglayer()
+{
+    UnitFacetIndex &facets = getUnitFacets();
+    return facets.free_egglayers.empty() ? NULL : facets.free_egglayers[0];
 }
 
 size_t countFreeEgglayers()
 {
-    size_t count = 0;
-    for (size_t i=0; i < world->units.all.size(); i++)
-    {
-        df::unit* unit = world->units.all[i];
-        if(isFreeEgglayer(unit))
-            count ++;
-    }
-    return count;
+    return getUnitFacets().free_egglayers.size();
 }
 
 // check if unit is already assigned to a zone, remove that ref from unit and old zone
@@ -1324,6 +1437,7 @@ size_t countFreeEgglayers()
 bool unassignUnitFromBuilding(df::unit* unit)
 {
     bool success = false;
+    invalidateUnitFacets();
     for (std::size_t idx = 0; idx < unit->general_refs.size(); idx++)
     {
         df::general_ref * oldref = unit->general_refs[idx];
@@ -1502,6 +1616,7 @@ command_result assignUnitToChain(color_ostream& out, df::unit* unit, df::buildin
 
 command_result assignUnitToBuilding(color_ostream& out, df::unit* unit, df::building* building, bool verbose)
 {
+    invalidateUnitFacets();
     command_result result = CR_WRONG_USAGE;
 
     if(isActivityZone(building))
@@ -1775,6 +1890,7 @@ void chainInfo(color_ostream & out, df::building* building, bool list_refs = fal
 command_result df_zone (color_ostream &out, vector <string> & parameters)
 {
     CoreSuspender suspend;
+    invalidateUnitFacets();
 
     bool need_cursor = false; // for zone_info, zone_assign, ...
     bool unit_info = false;
@@ -2612,6 +2728,7 @@ command_result df_zone (color_ostream &out, vector <string> & parameters)
 command_result df_autonestbox(color_ostream &out, vector <string> & parameters)
 {
     CoreSuspender suspend;
+    invalidateUnitFacets();
 
     bool verbose = false;
 
@@ -2681,6 +2798,9 @@ command_result autoNestbox( color_ostream &out, bool verbose = false )
     bool stop = false;
     size_t processed = 0;
 
+    // runs while paused too, when the frame counter doesn't advance
+    invalidateUnitFacets();
+
     if (!Maps::IsValid())
     {
         out.printerr("Map is not available!\n");
@@ -2992,6 +3112,7 @@ static int default_ma = 1;
 command_result df_autobutcher(color_ostream &out, vector <string> & parameters)
 {
     CoreSuspender suspend;
+    invalidateUnitFacets();
 
     bool verbose = false;
     bool watch_race = false;
@@ -3401,6 +3522,9 @@ command_result autoButcher( color_ostream &out, bool verbose = false )
     if(!Maps::IsValid())
         return CR_OK;
 
+    // runs while paused too, when the frame counter doesn't advance
+    invalidateUnitFacets();
+
     // check if there is anything to watch before walking through units vector
     if(!enable_autobutcher_autowatch)
     {
@@ -3418,63 +3542,59 @@ command_result autoButcher( color_ostream &out, bool verbose = false )
             return CR_OK;
     }
 
-    for(size_t i=0; i<world->units.all.size(); i++)
+    UnitFacetIndex &facets = getUnitFacets();
+
+    for(auto it = facets.stock.begin(); it != facets.stock.end(); ++it)
     {
-        df::unit * unit = world->units.all[i];
+        int race = it->first;
+        const std::vector<UnitFacets> &units = it->second;
+        WatchedRace * w = NULL;
+        bool looked_up = false;
 
-        // this check is now divided into two steps, squeezed autowatch into the middle
-        // first one ignores completely inappropriate units (dead, undead, not belonging to the fort, ...)
-        // then let autowatch add units to the watchlist which will probably start breeding (owned pets, war animals, ...)
-        // then process units counting those which can't be butchered (war animals, named pets, ...)
-        // so that they are treated as "own stock" as well and count towards the target quota
-        if(    isDead(unit)
-            || isUndead(unit)
-            || isMarkedForSlaughter(unit)
-            || isMerchant(unit) // ignore merchants' draught animals
-            || isForest(unit) // ignore merchants' caged animals
-            || !isOwnCiv(unit)
-            || !isTame(unit)
-            )
-            continue;
+        for(size_t i=0; i<units.size(); i++)
+        {
+            const UnitFacets &f = units[i];
 
-        // found a bugged unit which had invalid coordinates but was not in a cage.
-        // marking it for slaughter didn't seem to have negative effects, but you never know...
-        if(!isContainedInItem(unit) && !hasValidMapPos(unit))
-            continue;
+            // this check is now divided into two steps, squeezed autowatch into the middle
+            // first one ignores completely inappropriate units (dead, undead, not belonging to the fort, ...)
+            // then let autowatch add units to the watchlist which will probably start breeding (owned pets, war animals, ...)
+            // then process units counting those which can't be butchered (war animals, named pets, ...)
+            // so that they are treated as "own stock" as well and count towards the target quota
+            if(f.marked || !f.tame)
+                continue;
 
-        WatchedRace * w = NULL;
-        int watched_index = getWatchedIndex(unit->race);
-        if(watched_index != -1)
-        {
-            w = watched_races[watched_index];
-        }
-        else if(enable_autobutcher_autowatch)
-        {
-            w = new WatchedRace(true, unit->race, default_fk, default_mk, default_fa, default_ma);
-            w->UpdateConfig(out);
-            watched_races.push_back(w);
+            if(!looked_up)
+            {
+                looked_up = true;
+                int watched_index = getWatchedIndex(race);
+                if(watched_index != -1)
+                {
+                    w = watched_races[watched_index];
+                }
+                else if(enable_autobutcher_autowatch)
+                {
+                    w = new WatchedRace(true, race, default_fk, default_mk, default_fa, default_ma);
+                    w->UpdateConfig(out);
+                    watched_races.push_back(w);
 
-            string announce;
-            announce = "New race added to autobutcher watchlist: " + getRaceNamePlural(w->raceId);
-            Gui::showAnnouncement(announce, 2, false);
-            autobutcher_sortWatchList(out);
-        }
+                    string announce;
+                    announce = "New race added to autobutcher watchlist: " + getRaceNamePlural(w->raceId);
+                    Gui::showAnnouncement(announce, 2, false);
+                    autobutcher_sortWatchList(out);
+                }
+            }
+
+            if(!w || !w->isWatched)
+                break;
 
-        if(w && w->isWatched)
-        {
             // don't butcher protected units, but count them as stock as well
             // this way they count towards target quota, so if you order that you want 1 female adult cat
             // and have 2 cats, one of them being a pet, the other gets butchered
-            if(    isWar(unit)    // ignore war dogs etc
-                || isHunter(unit) // ignore hunting dogs etc
-                // ignore creatures in built cages which are defined as rooms to leave zoos alone
-                // (TODO: better solution would be to allow some kind of slaughter cages which you can place near the butcher)
-                || (isContainedInItem(unit) && isInBuiltCageRoom(unit))  // !!! see comments in isBuiltCageRoom()
-                || isAvailableForAdoption(unit)
-                || unit->name.has_name )
-                w->PushProtectedUnit(unit);
+            // (TODO: better solution for zoo cages would be to allow some kind of slaughter cages which you can place near the butcher)
+            if(f.prot)
+                w->PushProtectedUnit(f.unit);
             else
-                w->PushUnit(unit);
+                w->PushUnit(f.unit);
         }
     }
 
@@ -3658,28 +3778,10 @@ WatchedRace * checkRaceStocksTotal(int race)
 {
     WatchedRace * w = new WatchedRace(true, race, default_fk, default_mk, default_fa, default_ma);
 
-    for(size_t i=0; i<world->units.all.size(); i++)
-    {
-        df::unit * unit = world->units.all[i];
-
-        if(unit->race != race)
-            continue;
-
-        if(    isDead(unit)
-            || isUndead(unit)
-            || isMerchant(unit) // ignore merchants' draught animals
-            || isForest(unit) // ignore merchants' caged animals
-            || !isOwnCiv(unit)
-            )
-            continue;
+    const std::vector<UnitFacets> &units = getRaceStock(race);
+    for(size_t i=0; i<units.size(); i++)
+        w->PushUnit(units[i].unit);
 
-        // found a bugged unit which had invalid coordinates but was not in a cage.
-        // marking it for slaughter didn't seem to have negative effects, but you never know...
-        if(!isContainedInItem(unit) && !hasValidMapPos(unit))
-            continue;
-
-        w->PushUnit(unit);
-    }
     return w;
 }
 
@@ -3687,35 +3789,11 @@ WatchedRace * checkRaceStocksProtected(int race)
 {
     WatchedRace * w = new WatchedRace(true, race, default_fk, default_mk, default_fa, default_ma);
 
-    for(size_t i=0; i<world->units.all.size(); i++)
+    const std::vector<UnitFacets> &units = getRaceStock(race);
+    for(size_t i=0; i<units.size(); i++)
     {
-        df::unit * unit = world->units.all[i];
-
-        if(unit->race != race)
-            continue;
-
-        if(    isDead(unit)
-            || isUndead(unit)
-            || isMerchant(unit) // ignore merchants' draught animals
-            || isForest(unit) // ignore merchants' caged animals
-            || !isOwnCiv(unit)
-            )
-            continue;
-
-        // found a bugged unit which had invalid coordinates but was not in a cage.
-        // marking it for slaughter didn't seem to have negative effects, but you never know...
-        if(!isContainedInItem(unit) && !hasValidMapPos(unit))
-            continue;
-
-        if(   !isTame(unit)
-           || isWar(unit) // ignore war dogs etc
-           || isHunter(unit) // ignore hunting dogs etc
-            // ignore creatures in built cages which are defined as rooms to leave zoos alone
-            // (TODO: better solution would be to allow some kind of slaughter cages which you can place near the butcher)
-            || (isContainedInItem(unit) && isInBuiltCageRoom(unit))  // !!! see comments in isBuiltCageRoom()
-            || isAvailableForAdoption(unit)
-            || unit->name.has_name )
-            w->PushUnit(unit);
+        if(!units[i].tame || units[i].prot)
+            w->PushUnit(units[i].unit);
     }
     return w;
 }
@@ -3724,35 +3802,11 @@ WatchedRace * checkRaceStocksButcherable(int race)
 {
     WatchedRace * w = new WatchedRace(true, race, default_fk, default_mk, default_fa, default_ma);
 
-    for(size_t i=0; i<world->units.all.size(); i++)
+    const std::vector<UnitFacets> &units = getRaceStock(race);
+    for(size_t i=0; i<units.size(); i++)
     {
-        df::unit * unit = world->units.all[i];
-
-        if(unit->race != race)
-            continue;
-
-        if(    isDead(unit)
-            || isUndead(unit)
-            || isMerchant(unit) // ignore merchants' draught animals
-            || isForest(unit) // ignore merchants' caged animals
-            || !isOwnCiv(unit)
-            || !isTame(unit)
-            || isWar(unit) // ignore war dogs etc
-            || isHunter(unit) // ignore hunting dogs etc
-            // ignore creatures in built cages which are defined as rooms to leave zoos alone
-            // (TODO: better solution would be to allow some kind of slaughter cages which you can place near the butcher)
-            || (isContainedInItem(unit) && isInBuiltCageRoom(unit))  // !!! see comments in isBuiltCageRoom()
-            || isAvailableForAdoption(unit)
-            || unit->name.has_name
-            )
-            continue;
-
-        // found a bugged unit which had invalid coordinates but was not in a cage.
-        // marking it for slaughter didn't seem to have negative effects, but you never know...
-        if(!isContainedInItem(unit) && !hasValidMapPos(unit))
-            continue;
-
-        w->PushUnit(unit);
+        if(units[i].tame && !units[i].prot)
+            w->PushUnit(units[i].unit);
     }
     return w;
 }
@@ -3761,64 +3815,24 @@ WatchedRace * checkRaceStocksButcherFlag(int race)
 {
     WatchedRace * w = new WatchedRace(true, race, default_fk, default_mk, default_fa, default_ma);
 
-    for(size_t i=0; i<world->units.all.size(); i++)
+    const std::vector<UnitFacets> &units = getRaceStock(race);
+    for(size_t i=0; i<units.size(); i++)
     {
-        df::unit * unit = world->units.all[i];
-
-        if(unit->race != race)
-            continue;
-
-        if(    isDead(unit)
-            || isUndead(unit)
-            || isMerchant(unit) // ignore merchants' draught animals
-            || isForest(unit) // ignore merchants' caged animals
-            || !isOwnCiv(unit)
-            )
-            continue;
-
-        // found a bugged unit which had invalid coordinates but was not in a cage.
-        // marking it for slaughter didn't seem to have negative effects, but you never know...
-        if(!isContainedInItem(unit) && !hasValidMapPos(unit))
-            continue;
-
-        if(isMarkedForSlaughter(unit))
-            w->PushUnit(unit);
+        if(units[i].marked)
+            w->PushUnit(units[i].unit);
     }
     return w;
 }
 
 void butcherRace(int race)
 {
-    for(size_t i=0; i<world->units.all.size(); i++)
+    const std::vector<UnitFacets> &units = getRaceStock(race);
+    for(size_t i=0; i<units.size(); i++)
     {
-        df::unit * unit = world->units.all[i];
-
-        if(unit->race != race)
-            continue;
-
-        if(    isDead(unit)
-            || isUndead(unit)
-            || isMerchant(unit) // ignore merchants' draught animals
-            || isForest(unit) // ignore merchants' caged animals
-            || !isOwnCiv(unit)
-            || !isTame(unit)
-            || isWar(unit) // ignore war dogs etc
-            || isHunter(unit) // ignore hunting dogs etc
-            // ignore creatures in built cages which are defined as rooms to leave zoos alone
-            // (TODO: better solution would be to allow some kind of slaughter cages which you can place near the butcher)
-            || (isContainedInItem(unit) && isInBuiltCageRoom(unit))  // !!! see comments in isBuiltCageRoom()
-            || isAvailableForAdoption(unit)
-            || unit->name.has_name
-            )
-            continue;
-
-        // found a bugged unit which had invalid coordinates but was not in a cage.
-        // marking it for slaughter didn't seem to have negative effects, but you never know...
-        if(!isContainedInItem(unit) && !hasValidMapPos(unit))
-            continue;
-
-        unit->flags2.bits.slaughter = true;
+        if(units[i].tame && !units[i].prot)
+            units[i].unit->flags2.bits.slaughter = true;
     }
+    invalidateUnitFacets();
 }
 
 // remove butcher flag for all units of a given race
@@ -3842,6 +3856,7 @@ void unbutcherRace(int race)
 
         unit->flags2.bits.slaughter = false;
     }
+    invalidateUnitFacets();
 }
 
 